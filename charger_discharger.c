@@ -57,8 +57,8 @@ void initialize()
     TMR1CS1 = 0; /// * Timer1 clock source is instruction clock (FOSC/4)
     T1CKPS0 = 0; // T1CKPS=0b00  
     T1CKPS1 = 0; /// * 1:1 Prescale value
-    TMR1H = 0xE1; //TMR1 Fosc/4= 8Mhz (Tosc= 0.125us). TMR1 counts: 7805 x 0.125us = 0.97562 ms
-    TMR1L = 0x83; /// * Set Timer1 register to overflow in 0.97562 ms
+    TMR1H = TMR1_RELOAD >> 8; //TMR1 Fosc/4= 8Mhz (Tosc= 0.125us). TMR1 counts: 7805 x 0.125us = 0.97562 ms
+    TMR1L = TMR1_RELOAD & 0xFF; /// * Set Timer1 register to overflow #ADC_SLOTS times every 0.97562 ms
     /** <b> PROGRAMMABLE SWITCH MODE CONTROL (PSMC) </b> */
     PSMC1CON = 0x00; /// * Clear PSMC1 configuration
     PSMC1MDL = 0x00; /// * No modulation
@@ -102,6 +102,7 @@ void initialize()
     ADCON1bits.ADPREF = 0b01; /// * Positive reference connected to VREF+
     ADCON1bits.ADFM = 1; /// * 2's compliment result
     ADCON2bits.CHSN = 0b1111; /// * Negative differential input given by ADNREF
+    ADCON0bits.CHS = V_CHAN; /// * Preselect the voltage channel, the first conversion of the sequence
     ADCON0bits.ADON = 1; /// * ADC is enabled
     /** @b UART*/
     TXSEL = 0; /// * RC6 selected as TX
@@ -120,87 +121,118 @@ void initialize()
     TXIE = 0; /// * Disable UART transmission interrupts
     /** @b FINAL */
     STOP_CONVERTER(); ///* Call #STOP_CONVERTER() macro
+    chem_load(); /// * Load the chemistry table from the EEPROM by calling #chem_load()
+    rest_load(); /// * Load the threshold of the adaptive rest with #rest_load()
+    ckpt_load(); /// * Look for a test interrupted by a reset with #ckpt_load(), #fSTANDBY() offers to resume it
 }
-/**@brief This function calls the PI control loop for current or voltage depending on the value of the #cmode variable.
+/**@brief This function calls the PI control loop for current or voltage depending on the value of the control::cmode variable.
 */
 void control_loop()
 {   
-    if(!cmode) /// If #cmode is cleared then
+    if (ctl.ffwd) feed_forward(); /// In the first control period of a charge, start from the duty cycle given by #feed_forward()
+    if(!ctl.cmode) /// If control::cmode is cleared then
     {
-        pid(v, vref);  /// * The #pid() function is called with @p feedback = #v and @p setpoint = #vref
+        pid(v, ctl.vref);  /// * The #pid() function is called with @p feedback = #v and @p setpoint = control::vref
     }else /// Else,
     {
-        pid(i, iref); /// * The #pid() function is called with @p feedback = #i and @p setpoint = #iref
+        pid(i, ctl.iref); /// * The #pid() function is called with @p feedback = #i and @p setpoint = control::iref
     }
     set_DC(); /// The duty cycle is set by calling the #set_DC() function
 }
-/**@brief This function defines the PI controller
+/**@brief This function defines the PI controller. It only uses multiplications and shifts, the dividers are
+*  precomputed as reciprocal gains in control::kp and control::ki.
 *  @param   feedback average of measured values for the control variable
 *  @param   setpoint desire controlled output for the variable
 */
 void pid(uint16_t feedback, uint16_t setpoint) 
 { 
 int16_t     er = 0; 
-int16_t     pi = 0; 
-int16_t     prop = 0; 
-int16_t     inte = 0;
+int24_t     prop = 0; 
+int24_t     inte = 0;
+int24_t     acum = 0;
     /// This function performs the folowing tasks:
     er = (int16_t) (setpoint - feedback); /// <ol> <li> Calculate the error
     if(er > ERR_MAX) er = ERR_MAX; /// <li> Make sure error is never above #ERR_MAX
     if(er < ERR_MIN) er = ERR_MIN; /// <li> Make sure error is never below #ERR_MIN
-    prop = er / kp; /// <li> Calculate the proportional component of compensator
-	intacum += (int24_t) (er); 
-    inte = (int16_t) (intacum / ((int24_t) ki * COUNTER)); /// <li> Calculate the integral component of compensator usign #intacum to accumulate over cycles
-    pi = prop + inte; /// <li> Combine proportinal and integral parts
-    dc = (uint16_t)((int16_t)dc + pi);/// <li> Sum the result to the previous duty cycle stored in the #dc variable
-    if (dc >= DC_MAX){ /// <li> Make sure the duty cycle is never above #DC_MAX
-        dc = DC_MAX;
-    }else if (dc <= DC_MIN){ /// <li> Make sure duty cycle is never below #DC_MIN </ol>
-        dc = DC_MIN;
+    prop = ((int24_t) er * ctl.kp) >> (KP_SHIFT - PID_FRAC); /// <li> Calculate the proportional component of compensator, with #PID_FRAC fractional bits
+    if (ctl.track) /// <li> After the CC to CV transfer, preload control::intacum so that the integral part cancels the proportional one, see #CV_TRACK
+    {
+        int32_t pre = -(int32_t) er * CV_TRACK - er;
+        if (pre > INTACUM_MAX) pre = INTACUM_MAX;
+        if (pre < -INTACUM_MAX) pre = -INTACUM_MAX;
+        ctl.intacum = (int24_t) pre;
+        ctl.track = 0;
+    }
+	ctl.intacum += (int24_t) (er); 
+    if(ctl.intacum > INTACUM_MAX) ctl.intacum = INTACUM_MAX; /// <li> Keep control::intacum inside 24 bits
+    if(ctl.intacum < -INTACUM_MAX) ctl.intacum = -INTACUM_MAX;
+    inte = (int24_t) (((int32_t) (ctl.intacum >> 8) * ctl.ki) >> (KI_SHIFT - 8 - PID_FRAC)); /// <li> Calculate the integral component of compensator usign control::intacum to accumulate over cycles
+    acum = ((int24_t) ctl.dc << PID_FRAC) + ctl.dc_frac + prop + inte; /// <li> Sum both parts to the previous duty cycle, stored in control::dc and control::dc_frac
+    if (acum >= ((int24_t) DC_MAX << PID_FRAC)){ /// <li> Make sure the duty cycle is never above #DC_MAX
+        acum = (int24_t) DC_MAX << PID_FRAC;
+    }else if (acum <= ((int24_t) DC_MIN << PID_FRAC)){ /// <li> Make sure duty cycle is never below #DC_MIN
+        acum = (int24_t) DC_MIN << PID_FRAC;
     }
+    ctl.dc = (uint16_t) (acum >> PID_FRAC); /// <li> Split the result in control::dc and control::dc_frac </ol>
+    ctl.dc_frac = (uint8_t) (acum & 0xFF);
+}
+/**@brief This function loads the duty cycle estimated by #DC_FF() from the cell voltage #v and the current setpoint
+* control::iref. It is called by #control_loop() in the first control period of a charge, once the relays settled,
+* so the converter starts close to the setpoint instead of ramping up from #DC_MIN.
+*/
+void feed_forward()
+{
+    uint16_t dc = DC_FF(v, ctl.iref);
+    if (dc > DC_MAX) dc = DC_MAX; /// * Keep it between #DC_MIN and #DC_MAX
+    if (dc < DC_MIN) dc = DC_MIN;
+    ctl.dc = dc;
+    ctl.dc_frac = 0;
+    ctl.intacum = 0;
+    ctl.ffwd = 0;
 }
 /**@brief This function sets the desired duty cycle of the PWM
 */
 void set_DC() /// This function performs the folowing tasks:
 {
-    PSMC1DCL = dc & 0x00FF; 
-    PSMC1DCH = (dc >> 8) & 0x01; /// <ol> <li> Load the duty cycle register of the PSMC with the #dc variable
+    PSMC1DCL = ctl.dc & 0x00FF; 
+    PSMC1DCH = (ctl.dc >> 8) & 0x01; /// <ol> <li> Load the duty cycle register of the PSMC with the control::dc variable
     PSMC1CONbits.PSMC1LD = 1; /// <li> Set the load register. This will load all the setting at once </ol>
 }
 /**@brief This function switches between CC and CV mode.
 * @param current_voltage average of current voltage
 * @param referece_voltage voltage setpoint
-* @param CC_mode_status current condition of #cmode variable
+* @param CC_mode_status current condition of control::cmode variable
 */
 void cc_cv_mode(uint16_t current_voltage, uint16_t reference_voltage, bool CC_mode_status)
 {
 /// If the current voltage is bigger than the CV setpoint and the system is in CC mode, then:
     if(current_voltage > reference_voltage && CC_mode_status)
     {        
-            intacum = 0; /// <ol> <li> The integral acummulator is cleared
-            cmode = 0; /// <li> The system is set in CV mode by clearing the #cmode variable
-            kp = CV_kp; /// <li> The proportional constant divider is set to #CV_kp 
-            ki = CV_ki; /// <li> The integral constant divider is set to #CV_ki 
+            bool gie = GIE;
+            GIE = 0; /// <ol> <li> Disable the interrupts, so the control loop does not run with half of the changes
+            ctl.cmode = 0; /// <li> The system is set in CV mode by clearing the control::cmode variable
+            ctl.kp = CV_KP_GAIN; /// <li> The proportional gain is set to #CV_KP_GAIN 
+            ctl.ki = CV_KI_GAIN; /// <li> The integral gain is set to #CV_KI_GAIN 
+            ctl.track = 1; /// <li> The duty cycle is kept and control::intacum is preloaded in the next period (control::track) instead of being cleared, see #CV_TRACK
+            GIE = gie;
     }    
 }
 /**@brief This function takes care of scaling the average values to correspond with their real values.
 */
 void scaling() /// This function performs the folowing tasks:
 {
-iavg = (uint16_t) ( ( ( iavg * 2.5 * 5000 ) / 4096 ) + 0.5 ); /// <ol><li> Scale #iavg according to the 12-bit ADC resolution (4096) and the sensitivity of the sensor (0.4 V/A). 
-vavg = (uint16_t) ( ( ( vavg * 5000.0 ) / 4096 ) + 0.5 ); /// <li> Scale #vavg according to the 12-bit ADC resolution (4096)
-tavg = (uint16_t) ( ( ( tavg * 5000.0 ) / 4096 ) + 0.5 ); 
-tavg = (int16_t) ( ( ( 1866.3 - tavg ) / 1.169 ) + 0.5 ); /// <li> Scale #tavg according to the 12-bit ADC resolution (4096) and the sensitivity of the sensor ( (1866.3 - x)/1.169 )
-qavg += (uint16_t) ( iavg / 360 ) + 0.5; /// <li> Perform the discrete integration of #iavg over one second and accumulate in #qavg 
-#if (NI_MH_CHEM)  
-if (vavg > vmax) vmax = vavg; /// <li> If the chemistry is Ni-MH and #vavg is bigger than #vmax then set #vmax equal to #vavg
-#endif
+iavg = ADC_TO_MA(iavg); /// <ol><li> Scale #iavg according to the 12-bit ADC resolution (4096) and the sensitivity of the sensor (0.4 V/A), with #ADC_TO_MA()
+vavg = ADC_TO_MV(vavg); /// <li> Scale #vavg according to the 12-bit ADC resolution (4096), with #ADC_TO_MV()
+tavg = ADC_TO_T(tavg); /// <li> Scale #tavg according to the 12-bit ADC resolution (4096) and the sensitivity of the sensor ( (1866.3 - x)/1.169 ), with #ADC_TO_T()
+coulomb_update(); /// <li> Update cell::qavg and the energy from the charge counted in the ISR by calling #coulomb_update()
+if ((chem.flags & CHEM_DV) && vavg_hr > ctx->vmax_hr) ctx->vmax_hr = vavg_hr; /// <li> If the chemistry ends the charge by -dV (#CHEM_DV) and #vavg_hr is bigger than cell::vmax_hr then set cell::vmax_hr equal to #vavg_hr
 }
 /**@brief This function takes care of calculating the average values printing the log data using the UART.
 */
 void log_control()
 {
-    if (log_on)
+    if (log_on && log_bin) log_frame(); /// If #log_bin is set the data is sent with #log_frame(), else it is printed as text
+    else if (log_on)
     {
                 LINEBREAK;
                 display_value_u(minute);
@@ -212,7 +244,7 @@ void log_control()
                 UART_send_char(cell_count); /// * Send a #cell_count variable
                 UART_send_char(comma); /// * Send a comma character
                 UART_send_char(S_str); /// * Send an 'S'
-                display_value_u((uint16_t)state);
+                display_value_u((uint16_t)ctx->state);
                 UART_send_char(comma); /// * Send a comma character
                 UART_send_char(V_str); /// * Send a 'V'
                 display_value_u(vavg);
@@ -225,12 +257,74 @@ void log_control()
                 UART_send_char(comma); ///* Send a comma character
                 UART_send_char(Q_str); /// * Send a 'Q'
                 //display_value_u((uint16_t) (dc * 1.933125));
-                display_value_u(qavg);
+                display_value_u(ctx->qavg);
                 UART_send_char('<'); /// * Send a '<'
     }
     if (!log_on) RESET_TIME(); /// If #log_on is cleared, call #RESET_TIME()
 }
 
+/**@brief This function sends the same data of the log line as a binary frame of fixed size (21 bytes):
+* <tt> 0xA5 0x5A 'L' seq minute(2) second cell state V(2) I(2) T(2) Q(2) dc(2) CRC(2) </tt>.
+* Multi-byte fields are little-endian, the cell is sent as a number (1 to 4).
+*/
+void log_frame()
+{
+    frame_begin(FRAME_LOG);
+    frame_u16(minute);
+    frame_u8((uint8_t) second);
+    frame_u8((uint8_t) (cell_count - '0'));
+    frame_u8(ctx->state);
+    frame_u16(vavg);
+    frame_u16(iavg);
+    frame_u16((uint16_t) tavg);
+    frame_u16(ctx->qavg);
+    frame_u16(ctl.dc);
+    frame_end();
+}
+
+/**@brief This function starts a binary frame: sends the synchronization bytes, the frame @p type and the
+* sequence number #frame_seq.
+* @param type character identifying the content of the frame
+*/
+void frame_begin(char type)
+{
+    UART_send_char(FRAME_SYNC1);
+    UART_send_char(FRAME_SYNC2);
+    frame_crc = 0xFFFF; /// The CRC covers everything after the synchronization bytes
+    frame_u8((uint8_t) type);
+    frame_u8(frame_seq++);
+}
+
+/**@brief This function sends one byte of a binary frame and adds it to the CRC-16/CCITT (polynomial 0x1021)
+* @param value byte to be send
+*/
+void frame_u8(uint8_t value)
+{
+    uint8_t x;
+    UART_send_char((char) value);
+    x = (uint8_t) (frame_crc >> 8) ^ value; /// Byte-wise CRC without table, only shifts and xor
+    x ^= x >> 4;
+    frame_crc = (frame_crc << 8) ^ ((uint16_t) x << 12) ^ ((uint16_t) x << 5) ^ (uint16_t) x;
+}
+
+/**@brief This function sends a 16-bit value of a binary frame, low byte first
+* @param value value to be send
+*/
+void frame_u16(uint16_t value)
+{
+    frame_u8((uint8_t) (value & 0xFF));
+    frame_u8((uint8_t) (value >> 8));
+}
+
+/**@brief This function finishes a binary frame by sending the CRC, high byte first
+*/
+void frame_end()
+{
+    uint16_t crc = frame_crc;
+    UART_send_char((char) (crc >> 8));
+    UART_send_char((char) (crc & 0xFF));
+}
+
 /**@brief This function read the ADC and store the data in the coresponding variable
 */
 uint16_t read_ADC(uint16_t channel)
@@ -245,6 +339,124 @@ uint16_t read_ADC(uint16_t channel)
     return ad_res;
 }
 
+/**@brief This function stores the result of the last conversion in the variable of the channel that was converted.
+* It is called from the ADC interrupt, so the result is collected without waiting for the conversion.
+*/
+void store_ADC()
+{
+    uint16_t ad_res = (uint16_t)((ADRESL & 0xFF)|((ADRESH << 8) & 0xF00));
+    switch(adc_chan)
+    {
+        case V_CHAN:
+            v = filter_ADC(&filt[FILT_V], ad_res); /// * Voltage result goes to #v, after the filter #filt[#FILT_V]
+            if (vhr_n) /// and the raw result is added to #vacum_hr until it has #VHR_SAMPLES conversions
+            {
+                vacum_hr += ad_res;
+                vhr_n--;
+            }
+            break;
+        case I_CHAN:
+            ad_res = filter_ADC(&filt[FILT_I], ad_res); /// * Current result goes to #i, after the filter #filt[#FILT_I] and substracting the 2.5V bias.
+            i = (uint16_t) (abs ( 2048 - (int)ad_res ) ); /// The bias is substracted after filtering so the noise around 0 A is not rectified
+            break;
+        case T_CHAN:
+            t = filter_ADC(&filt[FILT_T], ad_res); /// * Temperature result goes to #t, after the filter #filt[#FILT_T]
+            break;
+    }
+}
+
+/**@brief This function filters the conversions of one ADC channel. It is called from the ISR, so it only uses
+* additions and shifts.
+* @param f filter of the channel
+* @param x new conversion
+* @return filtered value
+*/
+uint16_t filter_ADC(struct filter *f, uint16_t x)
+{
+    uint16_t a, b, c;
+    uint8_t k;
+    if (!f->ready) /// * If the filter is not ready, load it with @p x as if it had been constant
+    {
+        for (k = 0; k < (1 << FILTER_MA_SHIFT); k++) f->x[k] = x;
+        f->acum = (uint24_t) x << FILTER_MA_SHIFT;
+        if (f->mode == FILTER_IIR) f->acum = (uint24_t) x << f->shift;
+        f->pos = 0;
+        f->ready = 1;
+    }
+    switch (f->mode)
+    {
+        case FILTER_MA: /// * #FILTER_MA: replace the oldest conversion in the sum
+            f->acum += x;
+            f->acum -= f->x[f->pos];
+            f->x[f->pos] = x;
+            f->pos = (f->pos + 1) & ((1 << FILTER_MA_SHIFT) - 1);
+            return (uint16_t) ((f->acum + (1 << (FILTER_MA_SHIFT - 1))) >> FILTER_MA_SHIFT);
+        case FILTER_IIR: /// * #FILTER_IIR: @p acum is the output with @p shift fractional bits
+            f->acum -= f->acum >> f->shift;
+            f->acum += x;
+            return (uint16_t) (f->acum >> f->shift);
+        case FILTER_MED3: /// * #FILTER_MED3: median of @p x and the two previous conversions
+            a = f->x[0];
+            b = f->x[1];
+            f->x[1] = a;
+            f->x[0] = x;
+            if (a > b) /// Sort the previous two so a <= b
+            {
+                c = a;
+                a = b;
+                b = c;
+            }
+            if (x < a) return a;
+            if (x > b) return b;
+            return x;
+        default:
+            return x;
+    }
+}
+
+/**@brief This function unloads the filters, so they start again from the next conversion. It is called whenever
+* the converter is started or the cell is changed.
+*/
+void filter_reset()
+{
+    filt[FILT_V].ready = 0;
+    filt[FILT_I].ready = 0;
+    filt[FILT_T].ready = 0;
+}
+
+/**@brief This function changes the filter of one ADC channel. The filter is unloaded with the interrupts disabled,
+* so the ISR does not run the new filter with the state of the old one, and it is loaded again by the next conversion.
+* @param k channel, #FILT_V, #FILT_I or #FILT_T
+* @param mode one of the @link filters @endlink
+*/
+void filter_select(uint8_t k, uint8_t mode)
+{
+    bool gie = GIE;
+    GIE = 0;
+    filt[k].mode = mode;
+    filt[k].ready = 0;
+    GIE = gie;
+}
+
+/**@brief This function selects the channel of the next conversion. The channel is selected as soon as the previous
+* conversion is finished, so it has a whole Timer1 slot for the acquisition and the conversion can be started without delays.
+*/
+void select_ADC()
+{
+    if (adc_slot == 0) /// In slot 0 the controlled variable is measured:
+    {
+        if(!ctl.cmode) adc_chan = V_CHAN; /// * #V_CHAN in CV mode
+        else adc_chan = I_CHAN; /// * #I_CHAN in CC mode
+    }else /// The monitoring slot alternates between the other variable and the temperature
+    {
+        if (adc_mon_t) adc_chan = T_CHAN;
+        else if(!ctl.cmode) adc_chan = I_CHAN;
+        else adc_chan = V_CHAN;
+        adc_mon_t = !adc_mon_t;
+    }
+    ADCON0bits.CHS = adc_chan;
+}
+
 /**@brief This function control the timing
 */
 void timing()
@@ -260,6 +472,102 @@ void timing()
         count--; /// * Decrease it
     }
 }
+/**@brief This function reads the 16-bit count of Timer1, one tick per instruction cycle (0.125 us). The high byte
+* is read again to catch a carry from the low byte between the two reads.
+* @return count of Timer1
+*/
+uint16_t tmr1_read()
+{
+    uint8_t hi, lo;
+    do
+    {
+        hi = TMR1H;
+        lo = TMR1L;
+    }while (hi != TMR1H);
+    return ((uint16_t) hi << 8) | lo;
+}
+
+/**@brief This function adds the duration of one call of the ISR, from #diag_t0 to now, to #diag. It is called at the
+* exit of the ISR by #DIAG_END(). A call longer than 65535 cycles (8.2 ms) wraps around, but it also leaves a Timer1
+* overflow pending that is counted in diag::overruns.
+*/
+void diag_end()
+{
+    uint16_t took = tmr1_read() - diag_t0;
+    uint8_t bin = (uint8_t) (took >> DIAG_BIN_SHIFT);
+    if (bin >= DIAG_BINS) bin = DIAG_BINS - 1;
+    diag.sum += took;
+    diag.calls++;
+    if (took > diag.max) diag.max = took;
+    if (diag.hist[bin] != 0xFFFF) diag.hist[bin]++;
+}
+
+/**@brief This function reports and clears the timing of the ISR collected in #diag during the last second. It is
+* called every second by the main loop while #diag_on is set. The times are in cycles of Timer1 (0.125 us), to be
+* compared with the 65536 - #TMR1_RELOAD cycles between two Timer1 overflows (#ADC_SLOTS per control period, 3902 at
+* 1 kHz, see #CONTROL_RATE_SHIFT):
+* <tt> Gcalls,Xmax,Mmean,Aadc,Lloop,Savg,Ulatency,Ooverruns,Bh0,...,Bh7< </tt>. In binary mode (#log_bin) it is a
+* frame of type 'G' with the same fields, 2 bytes each.
+*/
+void diag_report()
+{
+    struct diag d;
+    uint16_t mean;
+    uint8_t k;
+    bool gie = GIE;
+    GIE = 0; /// * Copy and clear #diag with the interrupts disabled, so the second is not split
+    d = diag;
+    memset(&diag, 0, sizeof(diag));
+    GIE = gie;
+    mean = d.calls ? (uint16_t) (d.sum / d.calls) : 0;
+    if (log_bin)
+    {
+        frame_begin(FRAME_DIAG);
+        frame_u16(d.calls);
+        frame_u16(d.max);
+        frame_u16(mean);
+        frame_u16(d.adc);
+        frame_u16(d.loop);
+        frame_u16(d.avg);
+        frame_u16(d.lat);
+        frame_u16(d.overruns);
+        for (k = 0; k < DIAG_BINS; k++) frame_u16(d.hist[k]);
+        frame_end();
+        return;
+    }
+    LINEBREAK;
+    UART_send_char('G');
+    display_value_u(d.calls);
+    UART_send_char(comma);
+    UART_send_char('X');
+    display_value_u(d.max);
+    UART_send_char(comma);
+    UART_send_char('M');
+    display_value_u(mean);
+    UART_send_char(comma);
+    UART_send_char('A');
+    display_value_u(d.adc);
+    UART_send_char(comma);
+    UART_send_char('L');
+    display_value_u(d.loop);
+    UART_send_char(comma);
+    UART_send_char(S_str);
+    display_value_u(d.avg);
+    UART_send_char(comma);
+    UART_send_char('U');
+    display_value_u(d.lat);
+    UART_send_char(comma);
+    UART_send_char('O');
+    display_value_u(d.overruns);
+    for (k = 0; k < DIAG_BINS; k++)
+    {
+        UART_send_char(comma);
+        UART_send_char('B');
+        display_value_u(d.hist[k]);
+    }
+    UART_send_char('<');
+}
+
 /**@brief This function calculate the averages
 */
 void calculate_avg()
@@ -270,29 +578,168 @@ void calculate_avg()
             iacum = 0; /// * Make #iavg zero
             vacum = 0; /// * Make #vavg zero
             tacum = 0; /// * Make #tavg zero
+            vacum_hr = 0; /// * Start a new oversampled voltage with #VHR_SAMPLES conversions
+            vhr_n = VHR_SAMPLES;
+            stream_vmark = 0; /// * Restart the streamed samples with the accumulators
+            stream_imark = 0;
+            stream_idx = 0;
             break;
         case 0: /// If #count = 0
-            iavg = ((iacum >> 10) + ((iacum >> 9) & 0x01)); /// * Divide the value stored in #iavg between COUNTER to obtain the average   
-            vavg = ((vacum >> 10) + ((vacum >> 9) & 0x01)); /// * This is equivalent to vacum / 1024 = vacum / 2^10 
-            tavg = ((tacum >> 10) + ((tacum >> 9) & 0x01)); /// * This is equivalent to tacum / 1024 = tacum / 2^10 
+            iavg = ((iacum >> COUNTER_SHIFT) + ((iacum >> (COUNTER_SHIFT - 1)) & 0x01)); /// * Divide the value stored in #iavg between COUNTER to obtain the average   
+            vavg = ((vacum >> COUNTER_SHIFT) + ((vacum >> (COUNTER_SHIFT - 1)) & 0x01)); /// * This is equivalent to vacum / COUNTER = vacum / 2^COUNTER_SHIFT 
+            tavg = ((tacum >> COUNTER_SHIFT) + ((tacum >> (COUNTER_SHIFT - 1)) & 0x01)); /// * This is equivalent to tacum / COUNTER = tacum / 2^COUNTER_SHIFT 
+            if (!vhr_n) vavg_hr = (uint16_t) (vacum_hr >> VHR_BITS); /// * Decimate the 4^#VHR_BITS voltage conversions into #vavg_hr, with #VHR_BITS more bits than one conversion
             break;
         default: /// If #count is not any of the previous cases then
             iacum += (uint24_t) i; /// * Accumulate #i in #iavg
             vacum += (uint24_t) v; /// * Accumulate #v in #vavg
             tacum += (uint24_t) t; /// * Accumulate #t in #tavg
+            if (stream_rate && !((count - 1) & stream_mask)) stream_sample(); /// * If the streaming is on and the last period of a sample was accumulated, call #stream_sample()
             //tavg += dc * 1.953125; // TEST FOR DC Is required to deactivate temperature protection
     }   
 }
+/**@brief This function is the coulomb counter. It is called from the ISR once per control period while the converter
+* is on, and integrates the raw current #i: the counts are added to #cc_rem and every #CC_QUANTUM counts one uAh is
+* carried into #cc_uah. The remainder stays in #cc_rem, so no charge is lost between periods.
+*/
+void coulomb_count()
+{
+    cc_rem += i;
+    while (cc_rem >= CC_QUANTUM) /// * At most two uAh per period, #i is smaller than 2 x #CC_QUANTUM
+    {
+        cc_rem -= CC_QUANTUM;
+        cc_uah++;
+    }
+}
+
+/**@brief This function updates the readouts of the coulomb counter once per second: cell::qavg in 0.1 mAh and the
+* energy #cc_uwh, integrated as the charge of the last second times #vavg (uAh x mV = nWh).
+* It must be called after #vavg is scaled.
+*/
+void coulomb_update()
+{
+    uint32_t uah, nwh;
+    bool gie = GIE;
+    GIE = 0; /// * Copy #cc_uah with the interrupts disabled, it is written by the ISR
+    uah = cc_uah;
+    GIE = gie;
+    ctx->qavg = (uint16_t) (uah / 100);
+    nwh = (uint32_t) (uint16_t) (uah - cc_uah_last) * vavg + cc_nwh;
+    cc_uwh += nwh / 1000; /// * Carry the whole uWh into #cc_uwh and keep the rest in #cc_nwh
+    cc_nwh = (uint16_t) (nwh % 1000);
+    cc_uah_last = uah;
+}
+
+/**@brief This function prints the charge and energy counted since the counters were reset:
+* <tt> C1,Sn,Q<mAh>.<uAh>,E<mWh>< </tt>, where n is the state that just finished.
+*/
+void coulomb_report()
+{
+    uint16_t frac;
+    LINEBREAK;
+    UART_send_char(C_str);
+    UART_send_char(cell_count);
+    UART_send_char(comma);
+    UART_send_char(S_str);
+    display_value_u((uint16_t) ctx->prev_state);
+    UART_send_char(comma);
+    UART_send_char(Q_str);
+    display_value_u((uint16_t) (cc_uah_last / 1000)); /// * mAh with three decimals
+    UART_send_char('.');
+    frac = (uint16_t) (cc_uah_last % 1000);
+    if (frac < 100) UART_send_char('0');
+    if (frac < 10) UART_send_char('0');
+    display_value_u(frac);
+    UART_send_char(comma);
+    UART_send_char(E_str);
+    display_value_u((uint16_t) (cc_uwh / 1000)); /// * mWh
+    UART_send_char('<');
+}
+
+/**@brief This function takes one streamed sample from the one-second accumulators. It is called from #calculate_avg()
+* every #stream_mask + 1 control periods, so there is no extra accumulation: the sample is the difference between
+* #vacum (and #iacum) and its value at the end of the previous sample, divided with a shift.
+*/
+void stream_sample()
+{
+    if (STREAMF) stream_missed++; /// * If the previous sample was not sent yet, count it in #stream_missed
+    stream_v = (uint16_t) ((vacum - stream_vmark) >> stream_shift);
+    stream_i = (uint16_t) ((iacum - stream_imark) >> stream_shift);
+    stream_vmark = vacum;
+    stream_imark = iacum;
+    stream_sec = stream_idx++;
+    STREAMF = 1; /// * Set #STREAMF, the sample is sent by #stream_send() in the main loop
+}
+
+/**@brief This function sends the last streamed sample, if the current state is selected in #stream_states. The
+* values are scaled to mV and mA with integer operations. In text mode the line is <tt> Hn,Ss,Vmv,Ima< </tt>, where
+* @p n is the index of the sample inside the second and @p s the state. In binary mode (#log_bin) it is a frame of 13 bytes:
+* <tt> 0xA5 0x5A 'H' seq second n state V(2) I(2) CRC(2) </tt>.
+*/
+void stream_send()
+{
+    uint16_t vs, is;
+    uint8_t n;
+    bool gie = GIE;
+    GIE = 0; /// * Copy the sample with the interrupts disabled, so it cannot change in the middle
+    vs = stream_v;
+    is = stream_i;
+    n = stream_sec;
+    GIE = gie;
+    if (!(stream_states & STREAM_STATE(ctx->state))) return; /// * Send nothing if the current state is not selected
+    vs = ADC_TO_MV(vs); /// * Scale the sample to mV and mA like #scaling()
+    is = ADC_TO_MA(is);
+    if (log_bin)
+    {
+        frame_begin(FRAME_STREAM);
+        frame_u8((uint8_t) second);
+        frame_u8(n);
+        frame_u8(ctx->state);
+        frame_u16(vs);
+        frame_u16(is);
+        frame_end();
+    }else
+    {
+        LINEBREAK;
+        UART_send_char('H');
+        display_value_u((uint16_t) n);
+        UART_send_char(comma);
+        UART_send_char(S_str);
+        display_value_u((uint16_t) ctx->state);
+        UART_send_char(comma);
+        UART_send_char(V_str);
+        display_value_u(vs);
+        UART_send_char(comma);
+        UART_send_char(I_str);
+        display_value_u(is);
+        UART_send_char('<');
+    }
+}
+
+/**@brief This function selects the streaming rate. It is called from the ISR when the 'h' key is received.
+* @param rate streaming rate as a power of two in Hz, from #STREAM_RATE_MIN to #STREAM_RATE_MAX, or 0 to stop
+*/
+void stream_select(uint8_t rate)
+{
+    if (rate)
+    {
+        stream_shift = COUNTER_SHIFT - rate; /// * Each sample has 2^(#COUNTER_SHIFT - @p rate) control periods
+        stream_mask = (1 << stream_shift) - 1;
+    }
+    STREAMF = 0;
+    stream_rate = rate;
+}
+
 /**@brief This function activate the UART reception interruption 
 */
 void interrupt_enable()
 {
-    char clear_buffer = 0; /// * Define the variable @p clear_buffer, used to empty the UART buffer
     while(RCIF){
-        clear_buffer = RC1REG; /// * Clear the reception buffer and store it in @p clear_buffer
+        (void) RC1REG; /// * Clear the reception buffer, the read bytes are discarded
     }
     RCIE = 1; /// * Enable UART reception interrupts
-    TXIE = 0; /// * Disable UART transmission interrupts
+    ADIF = 0; /// * Clear ADC interrupt flag
+    ADIE = 1; /// * Enable ADC interrupts, used to collect the conversions started by Timer1
     TMR1IE = 1;   //enable T1 interrupt
     PEIE = 1;       //enable peripherals interrupts
     GIE = 1;        //enable global interrupts
@@ -300,28 +747,109 @@ void interrupt_enable()
     TMR1IF = 0; //Clear timer1 interrupt flag
     TMR1ON = 1;    //turn on timer 
 }
-/**@brief This function send one byte of data to UART
+/**@brief This function send one byte of data to UART. The byte is stored in #tx_buf and sent by the
+* transmission interrupt, so the caller does not wait for the UART.
 * @param bt character to be send
 */
 void UART_send_char(char bt)  
 {
-    while(0 == TXIF)
+    unsigned char next;
+    bool gie;
+    if(!PEIE) /// If the interrupts have not been enabled yet (see #interrupt_enable()), then
     {
-    }/// * Hold the program until the transmission buffer is free
-    TX1REG = bt; /// * Load the transmission buffer with @p bt
+        while(0 == TXIF)
+        {
+        }/// * Hold the program until the transmission buffer is free
+        TX1REG = bt; /// * Load the transmission buffer with @p bt
+        return;
+    }
+    while(1) /// Else,
+    {
+        gie = GIE; 
+        GIE = 0; /// * Disable interrupts while the buffer is checked and updated, the ISR can also send
+        next = (tx_head + 1) & (TX_BUF_SIZE - 1);
+        if(next != tx_tail) break;
+        GIE = gie;
+        if(!gie) /// * If the buffer is full inside the ISR (@p GIE is cleared), drop the byte and count it in #tx_dropped
+        {
+            tx_dropped++;
+            return;
+        }
+        tx_overflows++; /// * If the buffer is full in the main loop, count it in #tx_overflows and wait for the ISR to make room
+        while(((tx_head + 1) & (TX_BUF_SIZE - 1)) == tx_tail) MAIN_IDLE();
+    }
+    tx_buf[tx_head] = bt; /// * Store @p bt in #tx_buf
+    tx_head = next;
+    TXIE = 1; /// * Enable the transmission interrupt, it is disabled by the ISR when #tx_buf is empty
+    GIE = gie;
 }
-/**@brief This function receive one byte of data from UART
+/**@brief This function receive one byte of data from UART. The bytes of a command line are given to #cmd_rx()
+* instead of the caller, and once the line is complete the menus get @b ESC until #command() runs it.
 * @return RC1REG reception register
 */
 char UART_get_char()
 {
+    char c;
     if(OERR) /// If there is error
     {
         CREN = 0; /// * Clear the error
         CREN = 1; /// * Restart
     }    
-    while(!RCIF);  /// Hold the program until the reception buffer is free   
-    return RC1REG; /// Receive the value and return it
+    while(1)
+    {
+        if (CMDF) return 0x1B; /// A complete command line leaves the menus with @b ESC, it runs in the main loop
+        while(!RCIF);  /// Hold the program until the reception buffer is free   
+        c = RC1REG; /// Receive the value and return it, unless it belongs to a command line
+        if (!cmd_rx(c)) return c;
+    }
+}
+/**@brief This function feeds one received byte to #cmd_line. A command line starts with #CMD_START and finishes
+* with a carriage return or a line feed, then #CMDF is set for #command(). It is called by the ISR, and by
+* #UART_get_char() while the reception interrupt is off in the menus.
+* @param c received byte
+* @return 1 if @p c belongs to a command line
+*/
+bool cmd_rx(char c)
+{
+    if (!cmd_len)
+    {
+        if (c != CMD_START) return 0;
+        if (CMDF) cmd_len = CMD_DROP; /// * A line that starts before the last one was run is dropped
+        else
+        {
+            cmd_line[0] = CMD_START;
+            cmd_len = 1;
+        }
+    }else if (c == 13 || c == 10)
+    {
+        if (cmd_len != CMD_DROP) /// * The end of the line terminates #cmd_line and sets #CMDF
+        {
+            cmd_line[cmd_len] = 0;
+            CMDF = 1;
+        }
+        cmd_len = 0;
+    }else if (cmd_len < CMD_LEN - 1) cmd_line[cmd_len++] = c;
+    else if (cmd_len != CMD_DROP) cmd_line[0] = 0; /// * A line that does not fit is emptied, so #command() rejects it
+    return 1;
+}
+/**@brief This function receives a decimal number from UART. The digits are echoed and the number finishes with a
+* carriage return or a line feed.
+* @return received number, 0 if @b ESC was pressed
+*/
+uint16_t UART_get_number()
+{
+    uint16_t value = 0;
+    char c;
+    while(1)
+    {
+        c = UART_get_char();
+        if (c >= '0' && c <= '9' && value < 6553) /// * Add each digit to @p value while it fits in 16 bits
+        {
+            value = value * 10 + (uint16_t) (c - '0');
+            UART_send_char(c);
+        }else if (c == 13 || c == 10) return value;
+        else if (c == 0x1B) return 0;
+    }
 }
 /**@brief This function send a string using UART
 * @param st_pt pointer to string to be send
@@ -354,65 +882,355 @@ void temp_protection()
     if (conv && (tavg > 350)){
         UART_send_string((char*)"HIGH_TEMP:");
         STOP_CONVERTER(); /// -# Stop the converter by calling the #STOP_CONVERTER() macro.
-        state = STANDBY; /// -# Go to the #STANDBY state.
+        ctx->state = STANDBY; /// -# Go to the #STANDBY state.
     }
 }
+/**@brief This function is the fast protection, called by the ISR after every conversion while the converter runs.
+* It compares the channel that was just converted with its limit and, on a trip, it stops the converter without
+* waiting for the main loop: the duty cycle goes to #DC_MIN and the main relay (@p RC5) opens. The fault code is
+* latched in #fault, so the control loop does not start again until a test starts, and #FAULTF calls #trip_report().
+*/
+void trip_check()
+{
+    uint8_t code = FAULT_NONE;
+    switch(adc_chan)
+    {
+        case V_CHAN: /// * Over-voltage: #v above #trip_v
+            if (v > trip_v) code = FAULT_OV;
+            break;
+        case I_CHAN: /// * Over-current: #i above the setpoint, plus half the setpoint and #TRIP_I_MA
+            if (i > ctl.iref + (ctl.iref >> TRIP_I_SHIFT) + TRIP_I_ADC) code = FAULT_OC;
+            break;
+        case T_CHAN: /// * Over-temperature: #t below the counts of #TRIP_T
+            if (t < TRIP_T_ADC) code = FAULT_OT;
+            break;
+    }
+    if (code == FAULT_NONE) return;
+    conv = 0;
+    ctl.dc = DC_MIN;
+    set_DC();
+    RC5 = 0;
+    fault = code;
+    fault_v = v;
+    fault_i = i;
+    fault_t = t;
+    FAULTF = 1;
+}
+/**@brief This function reports a trip of #trip_check() from the main loop. The hardware is already safe, so it
+* stops the rest of the converter with #STOP_CONVERTER(), prints the fault and the measurements at the trip as
+* <tt> C1,S6,F1,V4312,I1580,T253 </tt> (F is the @link faults @endlink code) and ends the test in the #FAULT state.
+*/
+void trip_report()
+{
+    FAULTF = 0;
+    STOP_CONVERTER();
+    LINEBREAK;
+    UART_send_char(C_str);
+    UART_send_char(cell_count);
+    UART_send_char(comma);
+    UART_send_char(S_str);
+    display_value_u((uint16_t)ctx->state);
+    UART_send_char(comma);
+    UART_send_char('F');
+    display_value_u(fault);
+    UART_send_char(comma);
+    UART_send_char(V_str);
+    display_value_u(ADC_TO_MV(fault_v));
+    UART_send_char(comma);
+    UART_send_char(I_str);
+    display_value_u(ADC_TO_MA(fault_i));
+    UART_send_char(comma);
+    UART_send_char(T_str);
+    display_value_s(ADC_TO_T(fault_t));
+    UART_send_char('<');
+    LINEBREAK;
+    ctx->state = FAULT;
+}
 /**@brief This function activate the desired relay in the switcher board according to the value
-* of #cell_count
+* of #cell_count. The relays are switched one by one, #RELAY_CELL_MS apart, by the relay sequencer (#relay_queue())
 */
 void Cell_ON()
 {
-    if (cell_count == '1') /// If cell_count = '1'
-    {
-        CELL1_ON(); /// * Turn ON cell #1 by calling #CELL1_ON
-        __delay_ms(10);
-        CELL2_OFF(); /// * Turn OFF cell #2 by calling #CELL2_OFF
-        __delay_ms(10);        
-        CELL3_OFF(); /// * Turn OFF cell #3 by calling #CELL3_OFF
-        __delay_ms(10);
-        CELL4_OFF(); /// * Turn OFF cell #4 by calling #CELL4_OFF
-        __delay_ms(10);
-    }else if (cell_count == '2')
-    {
-        CELL1_OFF(); /// * Turn OFF cell #1 by calling #CELL1_OFF
-        __delay_ms(10);
-        CELL2_ON(); /// * Turn ON cell #2 by calling #CELL2_ON
-        __delay_ms(10);
-        CELL3_OFF(); /// * Turn OFF cell #3 by calling #CELL3_OFF
-        __delay_ms(10);
-        CELL4_OFF(); /// * Turn OFF cell #4 by calling #CELL4_OFF
-        __delay_ms(10);
-    }else if (cell_count == '3')
-    {
-        CELL1_OFF(); /// * Turn OFF cell #1 by calling #CELL1_OFF
-        __delay_ms(10);
-        CELL2_OFF(); /// * Turn OFF cell #2 by calling #CELL2_OFF
-        __delay_ms(10);
-        CELL3_ON(); /// * Turn ON cell #3 by calling #CELL3_ON
-        __delay_ms(10);
-        CELL4_OFF(); /// * Turn OFF cell #4 by calling #CELL4_OFF    
-    }else if (cell_count == '4')
-    {
-        CELL1_OFF(); /// * Turn OFF cell #1 by calling #CELL1_OFF
-        __delay_ms(10);
-        CELL2_OFF(); /// * Turn OFF cell #2 by calling #CELL2_OFF
-        __delay_ms(10);
-        CELL3_OFF(); /// * Turn OFF cell #3 by calling #CELL3_OFF
-        __delay_ms(10);
-        CELL4_ON(); /// * Turn ON cell #4 by calling #CELL4_ON
-        __delay_ms(10);
-    }
+    uint8_t k;
+    for (k = 0; k < 4; k++) /// * Turn ON the relay of cell #cell_count and turn OFF the other three
+        relay_queue(RELAY_OP(RELAY_CELL1 + k, k == (uint8_t) (cell_count - '1')), RELAY_CELL_MS);
 }
-/**@brief This function deactivate all relays in the switcher board
+/**@brief This function deactivate all relays in the switcher board, one by one through the relay sequencer
 */
 void Cell_OFF()
 {
-    CELL1_OFF(); /// * Turn OFF cell #1 by calling #CELL1_OFF
-    __delay_ms(10);
-    CELL2_OFF(); /// * Turn OFF cell #2 by calling #CELL2_OFF
-    __delay_ms(10);
-    CELL3_OFF(); /// * Turn OFF cell #3 by calling #CELL3_OFF
-    __delay_ms(10);
-    CELL4_OFF(); /// * Turn OFF cell #4 by calling #CELL4_OFF  
-    __delay_ms(10);
-}
\ No newline at end of file
+    uint8_t k;
+    for (k = 0; k < 4; k++) relay_queue(RELAY_OP(RELAY_CELL1 + k, 0), RELAY_CELL_MS);
+}
+/**@brief This function queues the pulse that latches the charge/discharge relay and then closes the main relay
+* (@p RC5), the sequence of #SET_CHAR() and #SET_DISC()
+* @param coil #RELAY_CHAR (@p RC4) or #RELAY_DISC (@p RC3)
+*/
+void relay_latch(uint8_t coil)
+{
+    relay_queue(RELAY_OP(RELAY_DISC, 0), 0); /// * Release both coils
+    relay_queue(RELAY_OP(RELAY_CHAR, 0), RELAY_LATCH_MS);
+    relay_queue(RELAY_OP(coil, 1), RELAY_LATCH_MS); /// * Pulse the coil of @p coil
+    relay_queue(RELAY_OP(coil, 0), RELAY_LATCH_MS);
+    relay_queue(RELAY_OP(RELAY_MAIN, 1), RELAY_LATCH_MS); /// * Close the main relay
+}
+/**@brief This function adds one step to the relay sequencer: the relay @p op is switched when the previous steps
+* are done, and the next step waits @p ms milliseconds after it. The steps are run by #relay_tick() from the ISR, so
+* the firmware is not stopped while the contacts settle. While Timer1 is not running the queue is run at once
+* with #relay_flush(), as the delays did before.
+* @param op relay and value, see #RELAY_OP()
+* @param ms time to wait after the step, in ms
+*/
+void relay_queue(uint8_t op, uint8_t ms)
+{
+    uint8_t next;
+    bool gie = GIE;
+    GIE = 0;
+    next = (relay_head + 1) & (RELAY_QUEUE - 1);
+    if (next == relay_tail) /// * If the queue is full, run it first
+    {
+        relay_flush();
+        next = (relay_head + 1) & (RELAY_QUEUE - 1);
+    }
+    relay_q[relay_head].op = op;
+    relay_q[relay_head].ms = ms;
+    relay_head = next;
+    GIE = gie;
+    if (!TMR1ON || !TMR1IE) relay_flush();
+}
+/**@brief This function drops the steps of the relay sequencer that were not run yet. It is called by
+* #STOP_CONVERTER(), so a pending step cannot close the main relay after the converter was stopped
+*/
+void relay_cancel()
+{
+    bool gie = GIE;
+    GIE = 0;
+    relay_tail = relay_head;
+    relay_wait = 0;
+    GIE = gie;
+}
+/**@brief This function switches one relay
+* @param op relay and value, see #RELAY_OP()
+*/
+void relay_set(uint8_t op)
+{
+    bool on = op & 1;
+    switch (op >> 1)
+    {
+        case RELAY_CELL1:
+            RB2 = on;
+            break;
+        case RELAY_CELL2:
+            RB3 = on;
+            break;
+        case RELAY_CELL3:
+            RB4 = on;
+            break;
+        case RELAY_CELL4:
+            RB5 = on;
+            break;
+        case RELAY_DISC:
+            RC3 = on;
+            break;
+        case RELAY_CHAR:
+            RC4 = on;
+            break;
+        case RELAY_MAIN:
+            RC5 = on;
+            break;
+    }
+}
+/**@brief This function runs the relay sequencer. It is called from the ISR once per control period (about 1 ms,
+* see #RELAY_TICKS()): it waits the time of the last step and then switches the relay of the next one
+*/
+void relay_tick()
+{
+    if (relay_wait)
+    {
+        relay_wait--;
+        return;
+    }
+    while (relay_tail != relay_head && !relay_wait) /// * Steps without a wait are run in the same period
+    {
+        relay_set(relay_q[relay_tail].op);
+        relay_wait = RELAY_TICKS(relay_q[relay_tail].ms);
+        relay_tail = (relay_tail + 1) & (RELAY_QUEUE - 1);
+    }
+}
+/**@brief This function runs all the steps of the relay sequencer at once, waiting with @p __delay_ms(). It is used
+* while Timer1 is stopped (#fSTANDBY(), #initialize()), where #relay_tick() is not called, and when the queue is full
+*/
+void relay_flush()
+{
+    uint8_t ms;
+    uint16_t n;
+    for (n = relay_wait >> CONTROL_RATE_SHIFT; n; n--) __delay_ms(1); /// * Finish the wait of the last step run by #relay_tick()
+    relay_wait = 0;
+    while (relay_tail != relay_head)
+    {
+        relay_set(relay_q[relay_tail].op);
+        for (ms = relay_q[relay_tail].ms; ms; ms--) __delay_ms(1);
+        relay_tail = (relay_tail + 1) & (RELAY_QUEUE - 1);
+    }
+}
+/**@brief This function reads @p n bytes of the data EEPROM
+* @param addr first address
+* @param dst destination in RAM
+* @param n number of bytes
+*/
+void ee_read(uint8_t addr, void *dst, uint8_t n)
+{
+    uint8_t *p = (uint8_t *) dst;
+    while (n--) *p++ = eeprom_read(addr++);
+}
+/**@brief This function writes @p n bytes of the data EEPROM. Only the bytes that changed are written, each write
+* takes about 4 ms and wears the cell.
+* @param addr first address
+* @param src source in RAM
+* @param n number of bytes
+*/
+void ee_write(uint8_t addr, const void *src, uint8_t n)
+{
+    const uint8_t *p = (const uint8_t *) src;
+    for (; n; n--, addr++, p++)
+    {
+        if (eeprom_read(addr) != *p) eeprom_write(addr, *p);
+    }
+}
+/**@brief This function adds the selected chemistry and the table of the EEPROM
+* @return 8-bit sum, stored at #EE_CHEM_SUM
+*/
+uint8_t chem_sum()
+{
+    uint8_t sum = eeprom_read(EE_CHEM_SEL);
+    uint8_t addr;
+    for (addr = EE_CHEM; addr < EE_CHEM_END; addr++) sum += eeprom_read(addr);
+    return sum;
+}
+/**@brief This function checks the chemistry table of the EEPROM and loads the selected chemistry into #chem. An
+* empty or corrupted EEPROM (wrong #EE_MAGIC_VAL or sum) gets the table #chem_defaults with #CHEM_DEFAULT selected.
+*/
+void chem_load()
+{
+    uint8_t k;
+    if (eeprom_read(EE_MAGIC) != EE_MAGIC_VAL || eeprom_read(EE_CHEM_SUM) != chem_sum() || eeprom_read(EE_CHEM_SEL) >= CHEMS)
+    {
+        for (k = 0; k < CHEMS; k++) ee_write(EE_CHEM + k * sizeof(struct chem), &chem_defaults[k], sizeof(struct chem));
+        k = CHEM_DEFAULT;
+        ee_write(EE_CHEM_SEL, &k, 1);
+        k = chem_sum();
+        ee_write(EE_CHEM_SUM, &k, 1);
+        k = EE_MAGIC_VAL;
+        ee_write(EE_MAGIC, &k, 1);
+    }
+    chem_select(eeprom_read(EE_CHEM_SEL));
+}
+/**@brief This function selects the chemistry @p k of the table: it is stored in the EEPROM and loaded into #chem
+*/
+void chem_select(uint8_t k)
+{
+    uint8_t sum;
+    chem_sel = k;
+    ee_write(EE_CHEM_SEL, &k, 1);
+    sum = chem_sum();
+    ee_write(EE_CHEM_SUM, &sum, 1);
+    ee_read(EE_CHEM + k * sizeof(struct chem), &chem, sizeof(struct chem));
+}
+/**@brief This function writes the chemistry @p k of the table and updates the sum
+*/
+void chem_store(uint8_t k, const struct chem *c)
+{
+    uint8_t sum;
+    ee_write(EE_CHEM + k * sizeof(struct chem), c, sizeof(struct chem));
+    sum = chem_sum();
+    ee_write(EE_CHEM_SUM, &sum, 1);
+}
+/**@brief This function loads #rest_dv from the EEPROM, #REST_DV_DEFAULT if it was not written
+*/
+void rest_load()
+{
+    ee_read(EE_REST, &rest_dv, sizeof(rest_dv));
+    if (rest_dv == 0xFFFF) rest_dv = REST_DV_DEFAULT;
+}
+/**@brief This function sets #rest_dv to @p uv and keeps it in the EEPROM
+*/
+void rest_store(uint16_t uv)
+{
+    rest_dv = uv;
+    ee_write(EE_REST, &rest_dv, sizeof(rest_dv));
+}
+/**@brief This function adds the bytes of the checkpoint @p k, except the sum
+* @return 8-bit sum, stored in ckpt::sum
+*/
+uint8_t ckpt_sum(const struct ckpt *k)
+{
+    const uint8_t *p = (const uint8_t *) k;
+    uint8_t sum = 0;
+    uint8_t n;
+    for (n = 0; n < sizeof(struct ckpt) - 1; n++) sum += p[n];
+    return sum;
+}
+/**@brief This function searches the ring of checkpoints for the last one with a good sum. Its address is kept in
+* #ckpt_addr and the next checkpoint goes to the next slot. If it is a step of a sequential test, #ckpt_valid is set.
+*/
+void ckpt_load()
+{
+    struct ckpt k;
+    uint8_t n;
+    uint8_t addr;
+    bool found = 0;
+    for (n = 0; n < CKPT_SLOTS; n++)
+    {
+        addr = EE_CKPT + n * sizeof(struct ckpt);
+        ee_read(addr, &k, sizeof(struct ckpt));
+        if (k.sum != ckpt_sum(&k)) continue; /// * A slot with a wrong sum (erased, or cut by a reset) is skipped
+        if (found && (int8_t) (k.seq - ckpt_seq) <= 0) continue; /// * The last checkpoint has the highest sequence number, it wraps around
+        found = 1;
+        ckpt_seq = k.seq;
+        ckpt_addr = addr;
+    }
+    if (!found) return;
+    ee_read(ckpt_addr, &k, sizeof(struct ckpt));
+    ckpt_seq++;
+    ckpt_valid = CKPT_STATE(k.state) && k.chem < CHEMS && k.option >= '1' && k.option <= '6' && k.option != '5' && k.cell_count >= '1' && k.cell_count <= k.cell_max && k.cell_max <= '0' + CELLS; /// * The uploaded profile of option 5 is lost in a reset, its tests cannot be resumed
+}
+/**@brief This function writes the context of the running cell #ctx to the next slot of the ring at #EE_CKPT. It is
+* called by #step_start() when a step starts, every #CKPT_SECS seconds by #checkpoint() and by #fSTANDBY() when the
+* test finishes, then the state is not one of #CKPT_STATE() and the test cannot be resumed.
+*/
+void ckpt_save()
+{
+    struct ckpt k;
+    k.uah = cc_uah_last;
+    k.uwh = cc_uwh;
+    k.vmax_hr = ctx->vmax_hr;
+    k.minute = minute;
+    k.wait_count = ctx->wait_count;
+    k.cycle = ctx->cycle;
+    k.cycles = cycles;
+    k.ccref = ccref;
+    k.dcref = dcref;
+    k.seq = ckpt_seq;
+    k.state = ctx->state;
+    k.prev_state = ctx->prev_state;
+    k.step_idx = ctx->step_idx;
+    k.cell_count = cell_count;
+    k.option = option;
+    k.cell_max = cell_max;
+    k.chem = chem_sel;
+    k.second = (uint8_t) second;
+    k.sum = ckpt_sum(&k);
+    ckpt_addr = EE_CKPT + (ckpt_seq % CKPT_SLOTS) * sizeof(struct ckpt);
+    ee_write(ckpt_addr, &k, sizeof(struct ckpt)); /// * The sum is the last byte written, so a checkpoint cut by a reset is not valid
+    ckpt_seq++;
+    ckpt_secs = CKPT_SECS;
+}
+/**@brief This function writes a checkpoint with #ckpt_save() every #CKPT_SECS seconds while a test runs (#ckpt_run).
+* It is called every second from the main loop.
+*/
+void checkpoint()
+{
+    if (!ckpt_run || !CKPT_STATE(ctx->state)) return;
+    if (--ckpt_secs) return;
+    ckpt_save();
+}
@@ -56,24 +56,219 @@
         POSTCHARGE = 8, ///< "Postcharge" state, defined by function @link fCHARGE() @endlink
         DS_DC_res = 9, ///< "Discharged state DC resistance" state, defined by function @link fDC_res() @endlink
         CS_DC_res = 10, ///< "Charged state DC resistance" state, defined by function @link fDC_res() @endlink
-        PS_DC_res = 11 ///< "Postcharged state DC resistance" state, defined by function @link fDC_res() @endlink
+        PS_DC_res = 11, ///< "Postcharged state DC resistance" state, defined by function @link fDC_res() @endlink
+        /** End of a cycle of the profile, only used as a #step, see #step_start(). A #CYCLE step closes a cycle: it
+        prints the summary of the cycle with #cycle_report() and goes back to the step @p limit until the cycle was
+        repeated @p timeout times (#cycles if 0). Only the steps between the step @p limit and the #CYCLE step are
+        added to the summary.*/
+        CYCLE = 12
     };    
+    /** Termination criteria of a profile #step. A @p limit of 0 takes the value defined in @link param() @endlink*/
+    enum ends {
+        END_TIME = 0, ///< The step lasts @p limit seconds (#WAIT_TIME for a #WAIT step with @p limit 0)
+        END_CHEM = 1, ///< End of charge of the chemistry: #iavg below @p limit mA (#EOC_current) or, with #CHEM_DV, #vavg_hr @p limit mV below its maximum (chem::eoc)
+        END_V_BELOW = 2, ///< #vavg below @p limit mV (#EOD_voltage)
+        END_Q = 3, ///< cell::qavg reaches @p limit x 0.1 mAh (half the capacity)
+        END_V_ABOVE = 4, ///< #vavg reaches @p limit mV (#cvref)
+        END_I_BELOW = 5 ///< #iavg below @p limit mA (#EOC_current)
+    };
+    #define     END_COUNT               6 ///< Number of @link ends @endlink
+    /** Latched codes of the fast protection, see #trip_check()*/
+    enum faults {
+        FAULT_NONE = 0, ///< No fault
+        FAULT_OV = 1, ///< Over-voltage: #v above #trip_v
+        FAULT_OC = 2, ///< Over-current: #i above the setpoint plus #TRIP_I_MA and half the setpoint (#TRIP_I_SHIFT)
+        FAULT_OT = 3 ///< Over-temperature: #t above #TRIP_T
+    };
+    /** One step of a test profile. A profile is a list of steps that ends with an #ISDONE step*/
+    struct step {
+        uint8_t     state; ///< State that runs the step: #PREDISCHARGE, #CHARGE, #DISCHARGE, #POSTCHARGE, #CS_DC_res, #DS_DC_res, #PS_DC_res, #WAIT, #CYCLE or #ISDONE
+        uint8_t     end; ///< Termination criterion, one of the @link ends @endlink
+        uint16_t    current; ///< Current setpoint in mA, 0 takes #i_char or #i_disc
+        uint16_t    limit; ///< Value of the termination criterion
+        uint16_t    timeout; ///< Maximum duration in minutes, 0 for the default (the charge cell::timeout of chem::timeout, none otherwise)
+    };
+    /** Parameters of a chemistry. The table of #CHEMS chemistries is kept in the data EEPROM (see #EE_CHEM), so the
+    chemistry is selected and edited over UART with #chem_menu() instead of compiling the firmware again. The struct
+    is 16 bytes without padding, also on a host compiler*/
+    struct chem {
+        uint16_t    cv; ///< Constant voltage setting in mV
+        uint16_t    cap; ///< Nominal capacity in mAh
+        uint16_t    eoc; ///< End-of-charge current in mA, or voltage drop in mV with #CHEM_DV
+        uint16_t    eod; ///< End-of-discharge voltage in mV
+        uint8_t     timeout; ///< Charge timeout in percent of the charge time at the set current, 0 for none
+        uint8_t     flags; ///< #CHEM_DV
+        char        name[6]; ///< Name printed in the menu, not terminated if it has 6 characters
+    };
+    #define     CHEMS                   4 ///< Chemistries of the table
+    #define     CHEM_DV                 0x01 ///< chem::flags: the charge ends by the voltage drop (-dV) of Ni-MH, not by the current
+    /** Chemistries of the default table, written to an empty or corrupted EEPROM by #chem_load()*/
+    enum chems {
+        CHEM_LI_ION = 0, ///< Li-Ion
+        CHEM_NI_MH = 1, ///< Ni-MH
+        CHEM_LI_PO = 2, ///< Li-Po
+        CHEM_CUSTOM = 3 ///< Free entry, a copy of Li-Ion
+    };
+    #define     CELLS                   4 ///< Number of cells of the switcher board
+    #define     CELL_CHAR(c)            ((unsigned char) ('1' + ((c) - cells))) ///< Number of the cell of the context @p c as a character, like #cell_count
+    /** Context of one cell: the state of its test and its measurements that last longer than one step. The
+    running cell is #ctx, the rest of #cells keep their context while they rest or wait for the converter in
+    #parallel mode. Only the main loop uses it, the fields of the interrupt are in #ctl. The fields are ordered by
+    size, so the struct is packed without padding also on a host compiler*/
+    struct cell {
+        uint32_t    cyc_qc; ///< Charge of the cycle in uAh
+        uint32_t    cyc_qd; ///< Discharge of the cycle in uAh
+        uint32_t    cyc_ec; ///< Charged energy of the cycle in uWh
+        uint32_t    cyc_ed; ///< Discharged energy of the cycle in uWh
+        uint24_t    dc_res_val; ///< To store the operation of obtained from the DC resistance state
+        uint16_t    qavg; ///< Charge of the step in 0.1 mAh, see #coulomb_update()
+        uint16_t    vmax_hr; ///< Maximum recorded #vavg_hr
+        uint16_t    wait_count; ///< Counter for waiting time between states, also counted down by #scheduler() in the background
+        uint16_t    timeout; ///< Duration of a Ni-MH charge in minutes
+        uint16_t    v_1_dcres; ///< First voltage measured during DC resistance state
+        uint16_t    i_1_dcres; ///< First current measured during DC resistance state
+        uint16_t    v_2_dcres; ///< Second voltage measured during DC resistance state
+        uint16_t    i_2_dcres; ///< Second current measured during DC resistance state
+        uint16_t    cycle; ///< Cycles already finished
+        uint16_t    cyc_rc; ///< DC resistance of the cycle in charged state (0.1 mOhm)
+        uint16_t    cyc_rd; ///< DC resistance of the cycle in discharged state (0.1 mOhm)
+        uint16_t    rest_secs; ///< Seconds since the start of a #WAIT step, for the adaptive rest of #rest_end()
+        uint16_t    rest_v; ///< #vavg_hr at the start of the last window of #rest_end()
+        int16_t     cyc_tmax; ///< Maximum #tavg of the cycle
+        int16_t     step_tmax; ///< Maximum #tavg of the current step
+        uint8_t     state; ///< Used with store the value of the @link states @endlink enum. Initialized as @link STANDBY @endlink
+        uint8_t     prev_state; ///< Used to store the previous state
+        uint8_t     step_idx; ///< Step of #profile that is running
+        uint8_t     dc_res_count; ///< Counter for DC resistance
+        bool        started; ///< The profile of the cell was started
+        bool        done; ///< The test of the cell is finished, or the cell is not tested
+    };
+    /** Checkpoint of a test, written to the ring of #CKPT_SLOTS at #EE_CKPT by #ckpt_save() at every step and every
+    #CKPT_SECS seconds. After a reset the test is resumed from the last one with #resume(). The struct is 32 bytes
+    without padding, also on a host compiler*/
+    struct ckpt {
+        uint32_t    uah; ///< Charge of the step in uAh, #cc_uah_last
+        uint32_t    uwh; ///< Energy of the step in uWh, #cc_uwh
+        uint16_t    vmax_hr; ///< cell::vmax_hr
+        uint16_t    minute; ///< #minute of the step
+        uint16_t    wait_count; ///< cell::wait_count
+        uint16_t    cycle; ///< cell::cycle
+        uint16_t    cycles; ///< #cycles
+        uint16_t    ccref; ///< #ccref
+        uint16_t    dcref; ///< #dcref
+        uint8_t     seq; ///< Sequence number, the slot of the ring is @p seq % #CKPT_SLOTS
+        uint8_t     state; ///< cell::state, a test can only be resumed from #WAIT to #PS_DC_res (#CKPT_STATE())
+        uint8_t     prev_state; ///< cell::prev_state
+        uint8_t     step_idx; ///< cell::step_idx
+        uint8_t     cell_count; ///< #cell_count
+        uint8_t     option; ///< #option
+        uint8_t     cell_max; ///< #cell_max
+        uint8_t     chem; ///< #chem_sel
+        uint8_t     second; ///< #second of the step
+        uint8_t     sum; ///< 8-bit sum of the bytes above, see #ckpt_sum()
+    };
+    /** Variables of the PI compensator, used by the interrupt every control period. #ctl is qualified with
+    @p __bank(0) to keep them together in one bank; the qualifier only takes effect when the address qualifiers of
+    XC8 are enabled, and the other variables of the interrupt are placed by the compiler*/
+    struct control {
+        int24_t     intacum; ///< Integral acumulator of PI compensator
+        uint16_t    kp; ///< Proportional compesator gain, see #KP_GAIN
+        uint16_t    ki; ///< Integral compesator gain, see #KI_GAIN
+        uint16_t    vref; ///< Scaled voltage setpoint
+        uint16_t    iref; ///< Current setpoint
+        uint16_t    dc; ///< Duty cycle
+        uint8_t     dc_frac; ///< Fractional part of the duty cycle, #PID_FRAC bits
+        bool        cmode; ///< CC / CV selector. CC: <tt> cmode = 1 </tt>. CV: <tt> cmode = 0 </tt>
+        bool        ffwd; ///< Load the feed-forward duty cycle (#DC_FF()) in the next control period, set by #converter_settings() in charge
+        bool        track; ///< Preload control::intacum in the next control period for a bumpless CC to CV transfer, set by #cc_cv_mode()
+    };
+    #define     FILTER_MA_SHIFT         2 ///< log2 of the length of the #FILTER_MA moving average (size of @p x in #filter)
+    /** Filters of the ADC channels, selected per channel in #filt with the member @p mode*/
+    enum filters {
+        FILTER_NONE = 0, ///< The raw conversion is used
+        FILTER_MA = 1, ///< Moving average of the last 2^#FILTER_MA_SHIFT conversions
+        FILTER_IIR = 2, ///< First-order low-pass filter, y += (x - y) / 2^@p shift
+        FILTER_MED3 = 3 ///< Median of the last 3 conversions, removes single spikes
+    };
+    /** State of the filter of one ADC channel*/
+    struct filter {
+        uint8_t     mode; ///< One of the @link filters @endlink
+        uint8_t     shift; ///< Coefficient of #FILTER_IIR as a shift
+        bool        ready; ///< Cleared to load the filter with the next conversion
+        uint8_t     pos; ///< Position of the oldest conversion in @p x
+        uint16_t    x[1 << FILTER_MA_SHIFT]; ///< Last conversions, used by #FILTER_MA and #FILTER_MED3
+        uint24_t    acum; ///< Sum of @p x for #FILTER_MA, output << @p shift for #FILTER_IIR
+    };
+    /** Relays switched by the relay sequencer, see #relay_queue() and #RELAY_OP()*/
+    enum relays {
+        RELAY_CELL1 = 0, ///< Cell #1 in the switcher board (@p RB2)
+        RELAY_CELL2 = 1, ///< Cell #2 (@p RB3)
+        RELAY_CELL3 = 2, ///< Cell #3 (@p RB4)
+        RELAY_CELL4 = 3, ///< Cell #4 (@p RB5)
+        RELAY_DISC = 4, ///< Coil that latches the charge/discharge relay in discharge position (@p RC3)
+        RELAY_CHAR = 5, ///< Coil that latches the charge/discharge relay in charge position (@p RC4)
+        RELAY_MAIN = 6, ///< Main relay of the converter (@p RC5)
+        RELAY_NONE = 7 ///< Not a relay: only waits
+    };
+    /** One step of the relay sequencer*/
+    struct relay_step {
+        uint8_t     op; ///< Relay and value, see #RELAY_OP()
+        uint8_t     ms; ///< Time to wait after the step, in ms
+    };
+    #define     DIAG_BINS               8 ///< Bins of diag::hist
+    #define     DIAG_BIN_SHIFT          9 ///< Bins of 512 cycles (64 us), the last bin counts the calls longer than 3584 cycles (448 us)
+    /** Timing of the ISR in the last second, in cycles of Timer1 (0.125 us). Written by the ISR, reported and
+    cleared by #diag_report()*/
+    struct diag {
+        uint32_t    sum; ///< Sum of the durations, from the entry to the exit of the ISR
+        uint16_t    calls; ///< Calls of the ISR
+        uint16_t    max; ///< Longest call of the ISR
+        uint16_t    adc; ///< Longest read of the ADC result, #store_ADC()
+        uint16_t    loop; ///< Longest control loop, #control_loop() and #coulomb_count()
+        uint16_t    avg; ///< Longest averaging, #calculate_avg() and #timing()
+        uint16_t    lat; ///< Longest latency, from the overflow of Timer1 to its reload in the ISR
+        uint16_t    overruns; ///< Timer1 overflows already pending at the end of the ADC interrupt
+        uint16_t    hist[DIAG_BINS]; ///< Calls of the ISR by duration, in bins of 2^#DIAG_BIN_SHIFT cycles
+    };
     void fSTANDBY(void);
     void fIDLE(void);
-    void fCHARGE(void);
-    void fDISCHARGE(void);
-    void fDC_res(void);
-    void fWAIT(void);
+    void fCHARGE(struct cell *c);
+    void fDISCHARGE(struct cell *c);
+    void fDC_res(struct cell *c);
+    void fWAIT(struct cell *c);
+    bool rest_end(struct cell *c);
     void fISDONE(void);
     void fFAULT(void);
+    bool scheduler(void);
+    bool cell_switch(bool force);
+    void step_start(struct cell *c);
+    void cycle_add(struct cell *c);
+    void cycle_report(struct cell *c);
+    void step_next(struct cell *c);
+    bool step_end(struct cell *c);
+    unsigned char profile_upload(void);
+    bool profile_step(uint16_t *val, unsigned char n);
     void start_state_machine(void);
     void state_machine(void);
     void param(void);
+    void param_chem(void);
+    bool profile_select(void);
+    bool resume_ask(void);
+    void resume(void);
+    void command(void);
+    bool cmd_set(char *s);
+    bool cmd_step(char *s);
+    void cmd_status(void);
+    void cmd_value(const char *tag, uint16_t value);
+    char *cmd_field(char *s, char *tag, uint16_t *val);
     void converter_settings(void);
     void initialize(void);
     void pid(uint16_t feedback, uint16_t setpoint);
     void set_DC(void);
+    void feed_forward(void);
     uint16_t read_ADC(uint16_t channel);
+    void store_ADC(void);
+    void select_ADC(void);
     void scaling(void);
     void log_control(void);
     void display_value_u(uint16_t value);
@@ -84,11 +279,55 @@
     void interrupt_enable(void);
     void UART_send_char(char bt);
     char UART_get_char(void); 
+    bool cmd_rx(char c);
+    uint16_t UART_get_number(void);
     void UART_send_string(char* st_pt);
+    void frame_begin(char type);
+    void frame_u8(uint8_t value);
+    void frame_u16(uint16_t value);
+    void frame_end(void);
+    void log_frame(void);
+    uint16_t filter_ADC(struct filter *f, uint16_t x);
+    void filter_reset(void);
+    void filter_select(uint8_t k, uint8_t mode);
+    void coulomb_count(void);
+    void coulomb_update(void);
+    void coulomb_report(void);
+    void stream_sample(void);
+    void stream_send(void);
+    void stream_select(uint8_t rate);
     void temp_protection(void);
+    void trip_check(void);
+    void trip_report(void);
+    void ee_read(uint8_t addr, void *dst, uint8_t n);
+    void ee_write(uint8_t addr, const void *src, uint8_t n);
+    uint8_t chem_sum(void);
+    void chem_load(void);
+    void chem_select(uint8_t k);
+    void chem_store(uint8_t k, const struct chem *c);
+    void rest_load(void);
+    void rest_store(uint16_t uv);
+    uint8_t ckpt_sum(const struct ckpt *k);
+    void ckpt_load(void);
+    void ckpt_save(void);
+    void checkpoint(void);
+    void chem_print(uint8_t k);
+    void chem_name(const struct chem *c);
+    void chem_menu(void);
+    void chem_edit(void);
+    uint16_t chem_field(const char *prompt, uint16_t old);
     void Cell_ON(void);
     void Cell_OFF(void);
+    void relay_latch(uint8_t coil);
+    void relay_queue(uint8_t op, uint8_t ms);
+    void relay_cancel(void);
+    void relay_set(uint8_t op);
+    void relay_tick(void);
+    void relay_flush(void);
     void timing(void);
+    uint16_t tmr1_read(void);
+    void diag_end(void);
+    void diag_report(void);
     #define     _XTAL_FREQ              32000000 ///< Frequency to coordinate delays, 32 MHz
     #define     ERR_MAX                 500 ///< Maximum permisible error, useful to avoid ringing
     #define     ERR_MIN                 -500 ///< Minimum permisible error, useful to avoid ringing
@@ -103,6 +342,30 @@
     #define     CELL2_OFF()             { RB3 = 0; } ///< Turn off Cell #2
     #define     CELL3_OFF()             { RB4 = 0; } ///< Turn off Cell #3
     #define     CELL4_OFF()             { RB5 = 0; } ///< Turn off Cell #4
+    #define     ADC_SLOTS               2 ///< ADC conversions per control cycle. Timer1 overflows once per slot
+    #define     FILT_V                  0 ///< Index of the voltage filter in #filt
+    #define     FILT_I                  1 ///< Index of the current filter in #filt
+    #define     FILT_T                  2 ///< Index of the temperature filter in #filt
+    #ifndef V_FILTER
+    #define     V_FILTER                FILTER_IIR ///< Filter of the voltage channel at start-up, one of the @link filters @endlink. Changed at run time with the @p FV field of @p $SET, see #filter_select()
+    #endif
+    #ifndef I_FILTER
+    #define     I_FILTER                FILTER_IIR ///< Filter of the current channel at start-up (@p FI of @p $SET)
+    #endif
+    #ifndef T_FILTER
+    #define     T_FILTER                FILTER_MA ///< Filter of the temperature channel at start-up (@p FT of @p $SET)
+    #endif
+    #ifndef VHR_BITS
+    #define     VHR_BITS                4 ///< Extra bits of #vavg_hr obtained by oversampling, from 1 to 4
+    #endif
+    #define     VHR_SAMPLES             (1 << (2 * VHR_BITS)) ///< Voltage conversions decimated into #vavg_hr every second, 4^#VHR_BITS (256)
+    #define     MV_TO_HR(mv)            ((uint16_t) (((uint32_t) (mv) * MV_ADC_GAIN + (0x8000 >> VHR_BITS)) >> (16 - VHR_BITS))) ///< mV to units of #vavg_hr
+    #define     UV_TO_HR(uv)            ((uint16_t) (((uint32_t) (uv) * MV_ADC_GAIN / 1000 + (0x8000 >> VHR_BITS)) >> (16 - VHR_BITS))) ///< uV to units of #vavg_hr
+    #define     FILTER_IIR_SHIFT        2 ///< Default coefficient of #FILTER_IIR, 1/4 (time constant of about 4 conversions)
+    #ifndef CONTROL_RATE_SHIFT
+    #define     CONTROL_RATE_SHIFT      0 ///< Control loop rate is 1024 Hz << #CONTROL_RATE_SHIFT (0: 1 kHz, 1: 2 kHz, 2: 4 kHz)
+    #endif
+    #define     TMR1_RELOAD             (65536 - ((7805 >> CONTROL_RATE_SHIFT) / ADC_SLOTS)) ///< Timer1 reload value. At 1 kHz one control cycle is 7805 x 0.125us = 0.97562 ms
     #define     AD_SET_CHAN(x)          { ADCON0bits.CHS = x; __delay_us(5); } ///< Set the ADC channel to @p x and wait for 5 microseconds.
     #define     AD_CONVERT()            { GO_nDONE = 1; while(GO_nDONE);} ///< Start the conversion and wait until it is finished
     #define     AD_RESULT()             { ad_res = 0; ad_res = (ADRESL & 0xFF)|((ADRESH << 8) & 0xF00);} ///< Store conversion result in #ad_res
@@ -111,9 +374,51 @@
     turn off all the cell relays in the switcher board, disable the logging of data to the terminal 
     and the UART reception interrupts.
     */
-    #define     STOP_CONVERTER()        { RC3 = 0; RC4 = 0; conv = 0; RC5 = 0; dc = DC_MIN; set_DC(); Cell_OFF(); LOG_OFF();}
-    #define     SET_DISC()              { RC3 = 0; RC4 = 0; __delay_ms(100); RC3 = 1; __delay_ms(100); RC3 = 0; __delay_ms(100); RC5 = 1; __delay_ms(100);}
-    #define     SET_CHAR()              { RC3 = 0; RC4 = 0; __delay_ms(100); RC4 = 1; __delay_ms(100); RC4 = 0; __delay_ms(100); RC5 = 1; __delay_ms(100);}
+    #define     STOP_CONVERTER()        { RC3 = 0; RC4 = 0; conv = 0; RC5 = 0; ctl.dc = DC_MIN; set_DC(); relay_cancel(); Cell_OFF(); LOG_OFF();}
+    #define     SET_DISC()              { relay_latch(RELAY_DISC); } ///< Queue the latch of the discharge position and the main relay, 400 ms
+    #define     SET_CHAR()              { relay_latch(RELAY_CHAR); } ///< Queue the latch of the charge position and the main relay, 400 ms
+    #define     RELAY_QUEUE             16 ///< Steps of the relay sequencer, must be a power of 2
+    #define     RELAY_OP(r, on)         ((uint8_t) (((r) << 1) | ((on) ? 1 : 0))) ///< Step that switches the relay @p r (one of the @link relays @endlink) on or off
+    #define     RELAY_TICKS(ms)         ((uint16_t) (((uint32_t) (ms) * 40 + 38) / 39) << CONTROL_RATE_SHIFT) ///< Control periods (0.9755 ms at 1 kHz) of at least @p ms milliseconds: @p ms / 0.975 rounded up, since 4 periods at 4 kHz are 0.975 ms
+    #define     RELAY_CELL_MS           10 ///< Time between the relays of the switcher board
+    #define     RELAY_LATCH_MS          100 ///< Time between the steps of the charge/discharge relay and the main relay
+    #define     RELAY_BUSY()            (relay_tail != relay_head || relay_wait) ///< The relay sequencer has steps or a wait pending
+    #define     RELAY_SETTLE_MS         10 ///< Time for the contacts to settle before the control loop starts
+    #define     TX_BUF_SIZE             64 ///< Size of the UART transmission ring buffer, must be a power of 2
+    #define     CMD_START               '$' ///< First byte of a command line, see #command()
+    #define     CMD_LEN                 40 ///< Size of #cmd_line, the longer lines are cut and rejected
+    #define     CMD_DROP                0xFF ///< Value of #cmd_len while a line is dropped because the last one was not run yet
+    #define     FRAME_SYNC1             0xA5 ///< First synchronization byte of a binary frame
+    #define     FRAME_SYNC2             0x5A ///< Second synchronization byte of a binary frame
+    #define     FRAME_LOG               'L' ///< Type of the binary frame sent by #log_frame()
+    #ifndef LOG_BIN_DEFAULT
+    #define     LOG_BIN_DEFAULT         0 ///< Set to 1 to start with binary frames instead of ASCII lines
+    #endif
+    #define     FRAME_STREAM            'H' ///< Type of the binary frame sent by #stream_send()
+    #define     FRAME_CYCLE             'Y' ///< Type of the binary frame sent by #cycle_report()
+    #define     FRAME_DIAG              'G' ///< Type of the binary frame sent by #diag_report()
+    #define     STREAM_RATE_MIN         4 ///< Lowest streaming rate selected by the 'h' key, 2^4 = 16 Hz
+    #define     STREAM_RATE_MAX         6 ///< Highest streaming rate selected by the 'h' key, 2^6 = 64 Hz
+    #define     STREAM_STATE(s)         ((uint16_t) 1 << (s)) ///< Bit of the state @p s in #stream_states
+    #ifndef STREAM_STATES_DEFAULT
+    #define     STREAM_STATES_DEFAULT   (STREAM_STATE(DS_DC_res) | STREAM_STATE(CS_DC_res) | STREAM_STATE(PS_DC_res)) ///< States streamed by default
+    #endif
+    #ifndef DIAG_TIMING
+    #define     DIAG_TIMING             1 ///< Set to 0 to remove the timing of the ISR (#diag), only diag::overruns is kept
+    #endif
+    #if (DIAG_TIMING)
+    #define     DIAG_START()            { diag_t0 = tmr1_read(); diag_t = diag_t0; } ///< Take the entry time of the ISR
+    #define     DIAG_LATENCY()          { diag_t = tmr1_read(); if (diag_t > diag.lat) diag.lat = diag_t; } ///< Timer1 counts from 0 after its overflow, so its value is the latency
+    #define     DIAG_RELOAD()           { diag_t0 = TMR1_RELOAD - (diag_t - diag_t0); diag_t = TMR1_RELOAD; } ///< Move the times taken before the reload of Timer1 to the reloaded count
+    #define     DIAG_SPLIT(m)           { diag_tn = tmr1_read(); if ((uint16_t) (diag_tn - diag_t) > (m)) (m) = diag_tn - diag_t; diag_t = diag_tn; } ///< Keep in @p m the longest time since the last split
+    #define     DIAG_END()              { diag_end(); } ///< Add the time from the entry to the exit of the ISR to #diag
+    #else
+    #define     DIAG_START()            {}
+    #define     DIAG_LATENCY()          {}
+    #define     DIAG_RELOAD()           {}
+    #define     DIAG_SPLIT(m)           {}
+    #define     DIAG_END()              {}
+    #endif
     #define     UART_INT_ON()           { while(RCIF) clear = RC1REG; RCIE = 1; } ///< Clear transmission buffer and turn ON UART transmission interrupts.
     #define     LOG_ON()                { log_on = 1; }  ///< Turn OFF logging in the terminal.
     #define     LOG_OFF()               { log_on = 0; }  ///< Turn ON logging in the terminal.
@@ -121,59 +426,166 @@
    //It seems that above 0.8 of DC the losses are so high that I don't get anything similar to the transfer function 
     #define     DC_MIN                  50  ///< Minimum possible duty cycle, set around @b 0.1 
     #define     DC_MAX                  409  ///< Maximum possible duty cycle, set around @b 0.8
-    #define     COUNTER                 1024  ///< Counter value, needed to obtained one second between counts.
+    #define     COUNTER_SHIFT           (10 + CONTROL_RATE_SHIFT) ///< log2 of #COUNTER
+    #define     COUNTER                 (1 << COUNTER_SHIFT)  ///< Counter value, needed to obtained one second between counts.
     #define     CC_kp                   25  ///< Proportional constant divider for CC mode
     #define     CC_ki                   35  ///< Integral constant divider for CC mode 
     // last test with LI_ION gave this constants
     #define     CV_kp                   10  ///< Proportional constant divider for CV mode
     #define     CV_ki                   400  ///< Integral constant divider for CV mode 
+    /** The dividers above were tuned at 1 kHz. The PI kernel multiplies by their reciprocals, precomputed here and scaled
+    by the control rate so every cycle moves the duty cycle proportionally less and the tuning holds at any rate.*/
+    #define     PID_FRAC                8 ///< Fractional bits kept in the duty cycle between cycles
+    #define     KP_SHIFT                16 ///< control::kp is the proportional divider reciprocal in Q16
+    #define     KI_SHIFT                28 ///< control::ki is the integral divider reciprocal, including #COUNTER, in Q28
+    #define     KP_GAIN(div)            ((uint16_t) (((1UL << KP_SHIFT) + ((uint32_t) (div) << CONTROL_RATE_SHIFT) / 2) / ((uint32_t) (div) << CONTROL_RATE_SHIFT)))
+    #define     KI_GAIN(div)            ((uint16_t) (((1UL << KI_SHIFT) + ((uint32_t) (div) * COUNTER << CONTROL_RATE_SHIFT) / 2) / ((uint32_t) (div) * COUNTER << CONTROL_RATE_SHIFT)))
+    #define     CC_KP_GAIN              KP_GAIN(CC_kp) ///< Proportional gain for CC mode
+    #define     CC_KI_GAIN              KI_GAIN(CC_ki) ///< Integral gain for CC mode
+    #define     CV_KP_GAIN              KP_GAIN(CV_kp) ///< Proportional gain for CV mode
+    #define     CV_KI_GAIN              KI_GAIN(CV_ki) ///< Integral gain for CV mode
+    #define     INTACUM_MAX             (0x7FFFFF - ERR_MAX) ///< Limit of control::intacum to keep it inside 24 bits
+    /** The integral part equals the proportional one with opposite sign when control::intacum is @p -er times
+    #CV_TRACK, so the CC to CV transfer starts without a step in the duty cycle.*/
+    #define     CV_TRACK                ((int32_t) ((uint32_t) CV_ki * COUNTER / CV_kp)) ///< control::intacum per count of voltage error that cancels the proportional part in CV mode
+    /** Feed-forward of the duty cycle in charge. The buck stage gives #V_BUS_MV times the duty cycle, so the cell
+    voltage plus the drop of the setpoint current on #R_CHAR_MOHM gives the duty cycle before the first control
+    period. The coefficients are in Q16 per ADC count.*/
+    #define     DC_PERIOD               512 ///< Clock cycles of the PSMC1 period, the duty cycle of 100 %
+    #define     V_BUS_MV                9000 ///< Input voltage of the buck stage in mV
+    #define     R_CHAR_MOHM             50 ///< Resistance of the charge path and the cell in mOhm, low on purpose so the current does not overshoot
+    #define     DC_FF_V                 (((uint32_t) ADC_REF_MV * DC_PERIOD << (16 - ADC_BITS)) / V_BUS_MV) ///< Duty cycle per count of #v, Q16
+    #define     DC_FF_I                 (((uint32_t) ADC_MA_NUM * R_CHAR_MOHM / 1000 * DC_PERIOD << (16 - ADC_BITS)) / V_BUS_MV) ///< Duty cycle per count of #i, Q16
+    #define     DC_FF(vc, ic)           ((uint16_t) (((uint32_t) (vc) * DC_FF_V + (uint32_t) (ic) * DC_FF_I + 0x8000) >> 16)) ///< Duty cycle that gives the current @p ic at the cell voltage @p vc, both in counts
+    /** Calibration of the measurements. The scale factors below are integer constants calculated by the preprocessor,
+    so the conversions between ADC counts and mV, mA or 0.1 degC only need one multiplication and one shift.*/
+    #define     ADC_BITS                12 ///< Resolution of the ADC
+    #define     ADC_REF_MV              5000 ///< ADC reference voltage in mV
+    #define     I_SENS_MV               400 ///< Sensitivity of the current sensor in mV/A
+    #define     T_ZERO_UV               1866300 ///< Output of the temperature sensor at 0 degC in uV
+    #define     T_SLOPE_UV              1169 ///< Slope of the temperature sensor in uV per 0.1 degC
+    #define     ADC_MA_NUM              ((uint32_t) ADC_REF_MV * 1000 / I_SENS_MV) ///< mA of 2^#ADC_BITS counts of #i, 12500
+    #define     ADC_TO_MV(x)            ((uint16_t) (((uint32_t) (x) * ADC_REF_MV + (1UL << (ADC_BITS - 1))) >> ADC_BITS)) ///< Counts of #v to mV
+    #define     ADC_TO_MA(x)            ((uint16_t) (((uint32_t) (x) * ADC_MA_NUM + (1UL << (ADC_BITS - 1))) >> ADC_BITS)) ///< Counts of #i to mA
+    #define     MV_ADC_GAIN             ((uint16_t) (((1UL << (16 + ADC_BITS)) + ADC_REF_MV / 2) / ADC_REF_MV)) ///< Counts per mV in Q16
+    #define     MA_ADC_GAIN             ((uint16_t) (((1UL << (16 + ADC_BITS)) + ADC_MA_NUM / 2) / ADC_MA_NUM)) ///< Counts per mA in Q16
+    #define     MV_TO_ADC(mv)           ((uint16_t) (((uint32_t) (mv) * MV_ADC_GAIN + 0x8000) >> 16)) ///< mV to counts of #v
+    #define     C_TO_ADC(cap, n)        ((uint16_t) (((uint32_t) (cap) * MA_ADC_GAIN / (n) + 0x8000) >> 16)) ///< Current of @p cap / @p n (C-rate) in counts of #i
+    #define     T_GAIN_Q                ((int32_t) (((uint32_t) ADC_REF_MV * 1000 * (0x10000 >> ADC_BITS) + T_SLOPE_UV / 2) / T_SLOPE_UV)) ///< 0.1 degC per count of #t in Q16
+    #define     T_ZERO_Q                ((int32_t) (((uint32_t) (T_ZERO_UV / T_SLOPE_UV) << 16) + ((((uint32_t) (T_ZERO_UV % T_SLOPE_UV) << 16) + T_SLOPE_UV / 2) / T_SLOPE_UV))) ///< 0.1 degC at 0 counts in Q16
+    #define     ADC_TO_T(x)             ((int16_t) ((T_ZERO_Q - (int32_t) (x) * T_GAIN_Q + 0x8000) >> 16)) ///< Counts of #t to 0.1 degC
+    #define     T_TO_ADC(dc)            ((uint16_t) (((T_ZERO_UV - (uint32_t) (dc) * T_SLOPE_UV) * ((1UL << ADC_BITS) / 8) + ADC_REF_MV * 125UL / 2) / (ADC_REF_MV * 125UL))) ///< 0.1 degC to counts of #t, the counts fall as the temperature rises
+    /** Fast protection. While the converter runs, the ISR compares every filtered conversion with these limits in
+    #trip_check(), so a trip stops the converter in the period of the conversion instead of the next second. The
+    limits are in counts, the one of the voltage follows the chemistry (#trip_v) and the one of the current the
+    setpoint.*/
+    #ifndef TRIP_V_MV
+    #define     TRIP_V_MV               100 ///< Over-voltage margin above chem::cv in mV
+    #endif
+    #ifndef TRIP_I_MA
+    #define     TRIP_I_MA               250 ///< Over-current margin above the setpoint in mA
+    #endif
+    #define     TRIP_I_SHIFT            1 ///< The setpoint shifted by #TRIP_I_SHIFT is added to the margin, so the limit scales with the C-rate
+    #ifndef TRIP_T
+    #define     TRIP_T                  450 ///< Over-temperature limit in 0.1 degC, above the 35 degC of #temp_protection()
+    #endif
+    #define     TRIP_I_ADC              C_TO_ADC(TRIP_I_MA, 1) ///< #TRIP_I_MA in counts of #i
+    #define     TRIP_T_ADC              T_TO_ADC(TRIP_T) ///< #TRIP_T in counts of #t
+    #define     CC_PERIOD_TMR1          (((7805 >> CONTROL_RATE_SHIFT) / ADC_SLOTS) * ADC_SLOTS) ///< Timer1 counts (0.125 us) of one control period
+    /** One uAh is 3.6e6 mA x us. One count of #i during one control period is #ADC_MA_NUM / 4096 mA during
+    #CC_PERIOD_TMR1 / 8 us, so #CC_QUANTUM counts x periods make one uAh (1209 at 1 kHz).*/
+    #define     CC_QUANTUM              ((uint16_t) ((((1UL << ADC_BITS) * 288000UL / ADC_MA_NUM) * 100 + CC_PERIOD_TMR1 / 2) / CC_PERIOD_TMR1))
+    #define     CYCLE_RESET(c)          { (c)->cyc_qc = 0; (c)->cyc_qd = 0; (c)->cyc_ec = 0; (c)->cyc_ed = 0; (c)->cyc_rc = 0; (c)->cyc_rd = 0; (c)->cyc_tmax = 0; } ///< Restart the summary of the cycle of the cell @p c
+    #define     COULOMB_RESET()         { cc_uah = 0; cc_rem = 0; cc_uah_last = 0; cc_uwh = 0; cc_nwh = 0; ctx->qavg = 0; } ///< Restart the charge and energy counters
     #define     LINEBREAK               { UART_send_char(10); UART_send_char(13); } ///< Send a linebreak to the terminal
+    #ifdef HOST_SIM
+    #define     MAIN_IDLE()             { sim_idle(); } ///< Host simulation: let the simulated time run until the next event
+    #else
+    #define     MAIN_IDLE()             {} ///< Nothing to do while waiting for the 1 second flag
+    #endif
     //////////////////////////Chemistry definition///////////////////////////////////////
-    #define     LI_ION_CHEM             0 ///< Set this definition to 1 and NI_MH_CHEM to 0 to set the test Li-Ion cells  
-    #define     NI_MH_CHEM              1 ///< Set this definition to 1 and LI_ION_CHEM to 0 to set the test Ni-MH cells
+    #ifndef CHEM_DEFAULT
+    #define     CHEM_DEFAULT            CHEM_NI_MH ///< Chemistry selected when the EEPROM is written with the default table
+    #endif
+    /** Layout of the data EEPROM (256 bytes). The chemistry table is checked with an 8-bit sum of the selected
+    chemistry and the table, a wrong sum or magic byte loads the default table (#chem_load())*/
+    #define     EE_MAGIC                0x00 ///< Address of the magic byte, #EE_MAGIC_VAL
+    #define     EE_MAGIC_VAL            0xC1 ///< Magic byte of the layout, change it when the layout changes
+    #define     EE_CHEM_SEL             0x01 ///< Address of the selected chemistry, #chem_sel
+    #define     EE_CHEM_SUM             0x02 ///< Address of the sum, see #chem_sum()
+    #define     EE_CHEM                 0x04 ///< Address of the table of #CHEMS chemistries
+    #define     EE_CHEM_END             (EE_CHEM + CHEMS * sizeof(struct chem)) ///< First free address after the table
+    #define     EE_REST                 EE_CHEM_END ///< Address of #rest_dv (2 bytes), erased (0xFFFF) takes #REST_DV_DEFAULT
+    /** The checkpoints of #ckpt_save() take turns in #CKPT_SLOTS slots, so each byte is written every #CKPT_SLOTS
+    checkpoints. A checkpoint cut by a reset has a wrong sum and the previous one is used*/
+    #define     EE_CKPT                 0x80 ///< Address of the ring of checkpoints, up to the end of the EEPROM
+    #define     CKPT_SLOTS              4 ///< Slots of the ring, #CKPT_SLOTS x 32 bytes
+    #define     CKPT_SECS               60 ///< Seconds between the checkpoints of a step
+    #define     CKPT_STATE(s)           ((s) >= WAIT && (s) <= PS_DC_res) ///< The state @p s is a step of a test that can be resumed
     ////////////////////////////////////////////////////////////////////////////////////
     //General definitions
+    #define     PROFILE_MAX             24 ///< Maximum number of steps of an uploaded profile, including the final #ISDONE
     #define     WAIT_TIME               600 ///< Time to wait before states, set to 10 minutes
+    /** Adaptive rest. With #rest_dv set, a #WAIT step keeps the cell connected to the voltage sense (the converter
+    is stopped) and ends when the cell relaxed: the voltage changed less than #rest_dv in one #REST_WINDOW, after at
+    least #REST_MIN seconds. The time of the step (#WAIT_TIME by default) is the maximum, see #rest_end()*/
+    #ifndef REST_DV_DEFAULT
+    #define     REST_DV_DEFAULT         0 ///< #rest_dv of an erased EEPROM, 0 for rests of fixed time
+    #endif
+    #ifndef REST_MIN
+    #define     REST_MIN                180 ///< Minimum time of an adaptive rest in seconds
+    #endif
+    #define     REST_WINDOW             60 ///< Seconds between the voltages compared by #rest_end(), #rest_dv is per window
+    #define     REST_SETTLE             5 ///< Seconds from the start of the rest to the first voltage, the relays and the averages settle
+    #define     REST_ADAPTIVE()         (rest_dv && !parallel) ///< The rests are adaptive. In #parallel mode a resting cell is not connected, so its rests are fixed
     #define     DC_RES_SECS             14 ///< How many seconds the DC resistance process takes
-    //Li-Ion definitions
-    #define     Li_Ion_CV               4200 ///< Li-Ion constant voltage setting in mV
-    #define     Li_Ion_CAP              3250 ///< Li-Ion capacity setting in mAh
-    #define     Li_Ion_EOC_I            100 ///< Li-Ion end-of-charge current in mA
-    #define     Li_Ion_EOD_V            3000 ///< Li_Ion end-of-discharge voltage in mV
-//    //HACK FOR LI-PO (make system thinks it is Li-Ion)
-//    #define     Li_Ion_CV               4200 ///< Li-Ion constant voltage setting in mV
-//    #define     Li_Ion_CAP              1200 ///< Li-Ion capacity setting in mAh
-//    #define     Li_Ion_EOC_I            60 ///< Li-Ion end-of-charge current in mA
-//    #define     Li_Ion_EOD_V            3000 ///< Li_Ion end-of-discharge voltage in mV
-//    //Li-Po definitions
-//    #define     Li_Po_CV                4200 ///< Li-Ion constant voltage setting in mV
-//    #define     Li_Po_CAP               1200 ///< Li-Ion capacity setting in mAh
-//    #define     Li_Po_EOC_I             60 ///< Li-Ion end-of-charge current in mA
-//    #define     Li_Po_EOD_V             3000 ///< Li_Ion end-of-discharge voltage in mV
-    //Ni-MH definitions
-    #define     Ni_MH_CV                1750 ///< Ni-MH constant voltage setting in mV
-    #define     Ni_MH_CAP               2000 ///< Ni-MH capacity setting in mAh
-    #define     Ni_MH_EOC_DV            10 ///< Ni-MH end-fo-charge voltage drop in mV
-    #define     Ni_MH_EOD_V             1000 ///< Ni-MH end-of-discharge voltage in mV
+    #define     CHEM_TIMEOUT_NI_MH      110 ///< Ni-MH charge timeout, 10 % more than the charge time at the set current
     //Variables
     bool                                SECF = 1; ///< 1 second flag
-    unsigned char                       option = 0; ///< Four different options, look into @link param() @endlink for details
+    unsigned char                       option = 0; ///< Four different options and the uploaded profile, look into @link param() @endlink for details
+    struct step const                   *profile; ///< Profile of the test, selected in #start_state_machine() from #option
+    struct step                         custom_profile[PROFILE_MAX] = { {ISDONE} }; ///< Profile uploaded with #profile_upload(), always closed with an #ISDONE step
+    unsigned char                       custom_len = 0; ///< Steps of #custom_profile, 0 if no profile was uploaded
+    /** Profile of option 1: Predischarge->Charge->Discharge->Postcharge, with a DC resistance measurement after
+    charge, discharge and postcharge and #WAIT_TIME rest between steps*/
+    struct step const                   profile_1[] = { {PREDISCHARGE, END_V_BELOW}, {WAIT}, {CHARGE, END_CHEM}, {WAIT}, {CS_DC_res}, {WAIT},
+                                            {DISCHARGE, END_V_BELOW}, {WAIT}, {DS_DC_res}, {WAIT}, {POSTCHARGE, END_Q}, {WAIT}, {PS_DC_res}, {WAIT}, {ISDONE} };
+    struct step const                   profile_2[] = { {CHARGE, END_CHEM}, {WAIT}, {CS_DC_res}, {WAIT}, {DISCHARGE, END_V_BELOW}, {ISDONE} }; ///< Profile of option 2: Charge->Discharge
+    struct step const                   profile_3[] = { {CHARGE, END_CHEM}, {ISDONE} }; ///< Profile of option 3: only charge
+    struct step const                   profile_4[] = { {DISCHARGE, END_V_BELOW}, {ISDONE} }; ///< Profile of option 4: only discharge
+    /** Profile of option 6: Predischarge->(Charge->Discharge) x #cycles->Postcharge, with DC resistance measurements*/
+    struct step const                   profile_6[] = { {PREDISCHARGE, END_V_BELOW}, {WAIT}, {CHARGE, END_CHEM}, {WAIT}, {CS_DC_res}, {WAIT},
+                                            {DISCHARGE, END_V_BELOW}, {WAIT}, {DS_DC_res}, {WAIT}, {CYCLE, 0, 0, 2}, {POSTCHARGE, END_Q}, {WAIT}, {PS_DC_res}, {WAIT}, {ISDONE} };
+    uint16_t                            cycles = 1; ///< Number of cycles of a profile with a #CYCLE step, defined in #param() for option 6
+    uint16_t                            rest_dv = REST_DV_DEFAULT; ///< Threshold of the adaptive rest in uV per #REST_WINDOW, 0 for rests of fixed time. Kept in the EEPROM at #EE_REST
+    unsigned char                       cycle_first = 0; ///< First step of the cycle of the #profile
+    unsigned char                       cycle_end = 0; ///< Index of the #CYCLE step of the #profile, 0 if there is none
     uint16_t                            capacity; ///< Definition of capacity per cell according to each chemistry
+    /** Default table of the chemistries: CV (mV), capacity (mAh), end of charge (mA, or mV with #CHEM_DV), end of
+    discharge (mV), charge timeout (%), flags and name*/
+    struct chem const                   chem_defaults[CHEMS] = {
+        {4200, 3250, 100, 3000, 0, 0, "Li-Ion"},
+        {1750, 2000, 10, 1000, CHEM_TIMEOUT_NI_MH, CHEM_DV, "Ni-MH"},
+        {4200, 1200, 60, 3000, 0, 0, "Li-Po"},
+        {4200, 3250, 100, 3000, 0, 0, "Custom"}
+    };
+    struct chem                         chem; ///< Parameters of the selected chemistry, loaded from the EEPROM by #chem_select()
+    uint8_t                             chem_sel; ///< Selected chemistry, index of the EEPROM table
+    uint8_t                             ckpt_seq = 0; ///< Sequence number of the next checkpoint, see #ckpt_save()
+    uint8_t                             ckpt_addr = 0; ///< Address of the last checkpoint found by #ckpt_load(), 0 if none
+    uint8_t                             ckpt_secs = CKPT_SECS; ///< Seconds to the next checkpoint
+    bool                                ckpt_run = 0; ///< A test is running and its checkpoints are written
+    bool                                ckpt_valid = 0; ///< The checkpoint at #ckpt_addr is a test that can be resumed with #resume()
     uint16_t                            i_char; ///< Charging current in mA
     uint16_t                            i_disc; ///< Discharging current in mA
     unsigned char                       cell_count = 49; ///< Cell counter from '1' to '4'. Initialized as '1'
     unsigned char                       cell_max = 0; ///< Number of cells to be tested. Initialized as 0
-    uint16_t                            wait_count = 0; ///< Counter for waiting time between states. Initialized as 0
-    unsigned char                       dc_res_count = 0; ///< Counter for DC resistance. Initialized as 0
-    unsigned char                       state = STANDBY; ///< Used with store the value of the @link states @endlink enum. Initialized as @link STANDBY @endlink
-    unsigned char                       prev_state = STANDBY; ///< Used to store the previous state. Initialized as @link STANDBY @endlink  
+    bool                                parallel = 0; ///< Test the cells in parallel: the rests of a cell overlap with the steps of the others, see #scheduler()
+    struct cell                         cells[CELLS]; ///< Context of the cells, indexed by #cell_count - '1'
+    struct cell                         *ctx = &cells[0]; ///< Context of the running cell, the one connected by #Cell_ON()
+    __bank(0) struct control            ctl = {0, 0, 0, 0, 0, 0, 0, 1, 0, 0}; ///< PI compensator, grouped in bank 0 when the XC8 address qualifiers are enabled
     uint16_t                            EOC_current; ///< End-of-charge current in mA
     uint16_t                            EOD_voltage; ///< End-of-dischage voltage in mV
-    uint16_t                            v_1_dcres; ///< First voltage measured during DC resistance state 
-    uint16_t                            i_1_dcres; ///< First current measured during DC resistance state  
-    uint16_t                            v_2_dcres; ///< Second voltage measured during DC resistance state 
-    uint16_t                            i_2_dcres; ///< Second current measured during DC resistance state
-    uint24_t                            dc_res_val; ///< To store the operation of obtained from the DC resistance state
     bool                                conv = 0; ///< Turn controller ON(1) or OFF(0). Initialized as 0
     uint16_t                            count = COUNTER; ///< Counter that should be cleared every second. Initialized as #COUNTER 
     /**< Every control loop cycle this counter will be decreased. This variable is used to calculate the averages and to trigger
@@ -182,6 +594,16 @@
     uint16_t                            v;  ///< Last voltage ADC measurement.
     uint16_t                            i;  ///< Last current ADC measurement.
     uint16_t                            t;  ///<  Last temperature ADC measurement.
+    uint16_t                            trip_v; ///< Over-voltage limit in counts of #v, set by #param_chem() from chem::cv and #TRIP_V_MV
+    uint8_t                             fault = FAULT_NONE; ///< Latched code of the last trip (@link faults @endlink), cleared when a test starts
+    bool                                FAULTF = 0; ///< A trip of #trip_check() waits for #trip_report()
+    uint16_t                            fault_v; ///< #v at the trip
+    uint16_t                            fault_i; ///< #i at the trip
+    uint16_t                            fault_t; ///< #t at the trip
+    struct filter                       filt[3] = { {V_FILTER, FILTER_IIR_SHIFT}, {I_FILTER, FILTER_IIR_SHIFT}, {T_FILTER, FILTER_IIR_SHIFT} }; ///< Filters of #v, #i and #t, indexed by #FILT_V, #FILT_I and #FILT_T
+    unsigned char                       adc_chan = V_CHAN; ///< Channel selected for the next ADC conversion
+    unsigned char                       adc_slot = 0; ///< ADC slot inside the control cycle. Slot 0 measures the controlled variable
+    bool                                adc_mon_t = 0; ///< Set when the monitoring slot has to measure the temperature
     uint24_t                            vacum = 0; ///< accumulator dor v
     uint24_t                            iacum = 0;
     uint24_t                            tacum = 0;
@@ -189,22 +611,54 @@
     uint16_t                            vavg = 0;  ///< Last one-second-average of #v . Initialized as 0
     uint16_t                            iavg = 0;  ///< Last one-second-average of #i . Initialized as 0
     int16_t                            tavg = 0;  ///< Last one-second-average of #t . Initialized as 0
-    uint16_t                            qavg = 0;  ///< Integration of #i . Initialized as 0
-    uint16_t                            vmax = 0;   ///< Maximum recorded average voltage. 
-    int24_t                             intacum;   ///< Integral acumulator of PI compensator
-    int16_t                             kp;  ///< Proportional compesator gain
-    int16_t                             ki;  ///< Integral compesator gain      
-    uint16_t                            vref = 0;  ///< Scaled voltage setpoint. Initialized as 0
+    uint32_t                            cc_uah = 0; ///< Charge counted by #coulomb_count() in uAh, only written by the ISR
+    uint16_t                            cc_rem = 0; ///< Counts x periods of #i not yet carried into #cc_uah
+    uint32_t                            cc_uah_last = 0; ///< Value of #cc_uah at the last call of #coulomb_update()
+    uint32_t                            cc_uwh = 0; ///< Energy in uWh, integrated by #coulomb_update()
+    uint16_t                            cc_nwh = 0; ///< Energy in nWh not yet carried into #cc_uwh
+    uint24_t                            vacum_hr = 0; ///< Sum of the raw voltage conversions for #vavg_hr
+    uint16_t                            vhr_n = 0; ///< Voltage conversions still to be added to #vacum_hr in this second
+    uint16_t                            vavg_hr = 0; ///< One-second average of the voltage with #VHR_BITS extra bits (ADC counts << #VHR_BITS, 76 uV with 4 bits)
     uint16_t                            cvref = 0;  ///< Unscaled voltage setpoint. Initialized as 0
-    uint16_t                            iref = 0;  ///< Current setpoint. Initialized as 0
     uint16_t                            ccref = 0;  ///< Unscaled voltage setpoint. Initialized as 0
-    bool                                cmode = 1;  ///< CC / CV selector. CC: <tt> cmode = 1 </tt>. CV: <tt> cmode = 0 </tt>   
-    uint16_t                            dc = 0;  ///< Duty cycle
+    uint16_t                            dcref = 0; ///< Discharge current in mA, #i_disc before its scaling
     //char                                clear;  ///< Variable to clear the transmission buffer of UART
     bool                                log_on = 0; ///< Variable to indicate if the log is activated 
+    bool                                log_bin = LOG_BIN_DEFAULT; ///< Log with binary frames (1) or ASCII lines (0). Toggled with the 'b' key
+    uint8_t                             frame_seq = 0; ///< Sequence number of the next binary frame
+    uint16_t                            frame_crc; ///< CRC-16 of the binary frame being sent
+    uint8_t                             stream_rate = 0; ///< Streaming rate as a power of two in Hz (16, 32 or 64 Hz), 0 if the streaming is off. Selected with the 'h' key
+    uint16_t                            stream_states = STREAM_STATES_DEFAULT; ///< One bit per state (#STREAM_STATE()) that shall be streamed. The 'H' key switches between all states and the default
+    uint16_t                            stream_mask; ///< Number of control periods of one streamed sample minus one
+    uint8_t                             stream_shift; ///< Shift that divides the sum of one streamed sample into its average
+    uint24_t                            stream_vmark = 0; ///< Value of #vacum at the end of the last streamed sample
+    uint24_t                            stream_imark = 0; ///< Value of #iacum at the end of the last streamed sample
+    uint16_t                            stream_v; ///< Average of #v over the last streamed sample
+    uint16_t                            stream_i; ///< Average of #i over the last streamed sample
+    uint8_t                             stream_idx = 0; ///< Index of the streamed sample inside the current second
+    uint8_t                             stream_sec; ///< Index of the last streamed sample, as it was taken
+    bool                                STREAMF = 0; ///< A new streamed sample is ready for #stream_send()
+    char                                cmd_line[CMD_LEN]; ///< Command line received by #cmd_rx(), from #CMD_START to the end of the line
+    unsigned char                       cmd_len = 0; ///< Bytes in #cmd_line, 0 while no command line is being received
+    bool                                CMDF = 0; ///< A command line is complete in #cmd_line and waits for #command()
+    bool                                remote = 0; ///< Remote mode: set by the first command, the menus are not shown until ESC or @p $MENU
+    uint16_t                            stream_missed = 0; ///< Samples overwritten before the main loop could send them
+    struct relay_step                   relay_q[RELAY_QUEUE]; ///< Steps of the relay sequencer, run by #relay_tick()
+    unsigned char                       relay_head = 0; ///< Next free position in #relay_q
+    unsigned char                       relay_tail = 0; ///< Next step of #relay_q to run
+    uint16_t                            relay_wait = 0; ///< Control periods to wait before the next step of #relay_q
+    struct diag                         diag; ///< Timing of the ISR in the last second, see #diag_report()
+    bool                                diag_on = 0; ///< Report the timing of the ISR every second. Toggled with the 'd' key
+    uint16_t                            diag_t0; ///< Timer1 count at the entry of the ISR
+    uint16_t                            diag_t; ///< Timer1 count at the last split of #diag
+    uint16_t                            diag_tn; ///< Timer1 count of the split being taken
+    char                                tx_buf[TX_BUF_SIZE]; ///< UART transmission ring buffer, emptied by the transmission interrupt
+    unsigned char                       tx_head = 0; ///< Next free position in #tx_buf, only moved by #UART_send_char()
+    unsigned char                       tx_tail = 0; ///< Next byte to send from #tx_buf, only moved by the ISR
+    uint16_t                            tx_dropped = 0; ///< Bytes dropped because #tx_buf was full inside the ISR
+    uint16_t                            tx_overflows = 0; ///< Bytes that had to wait because #tx_buf was full
     int16_t                             second = 0; ///< Seconds counter, resetted after 59 seconds.
     uint16_t                            minute = 0; ///< Minutes counter, only manually reset
-    uint16_t                            timeout = 0;
     //Strings       
     char const                          comma = ',';
     char const                          colons = ':'; 
@@ -216,7 +670,9 @@
     char const                          Q_str = 'Q';
     char const                          R_str = 'R';
     char const                          W_str = 'W';
+    char const                          E_str = 'E';
     char const                          press_s_str[] = "Press 's' to start: ";
+    char const                          parallel_str[] = "Test the cells in parallel, overlapping the rests? (y/n): ";
     char const                          starting_str[] = "Starting...";
     char const                          done_str[] = "DONE";
     char const                          num_1and2_str[] = "Please input a number between 1 and 2";
@@ -224,8 +680,21 @@
     char const                          num_1and4_str[] = "Please input a number between 1 and 4";         
     char const                          param_def_str[] = "---Parameter definition for charger and discharger---";
     char const                          restarting_str[] = "Restarting...";
-    char const                          chem_def_liion[] = "Chemistry defined as Li-Ion";
-    char const                          chem_def_nimh[] = "Chemistry defined as Ni-MH";
+    char const                          resuming_str[] = "Resuming...";
+    char const                          interrupted_str[] = "Interrupted test of cell ";
+    char const                          at_step_str[] = " at step ";
+    char const                          at_minute_str[] = ", minute ";
+    char const                          press_r_str[] = "Press 'r' to resume it, or any other key for the menu";
+    char const                          chem_def_str[] = "Chemistry defined as ";
+    char const                          chem_opt_str[] = "(c) Select or edit the chemistry";
+    char const                          chem_sel_str[] = "Select the chemistry (1-4), (e) to edit the selected one or ESC to go back: ";
+    char const                          chem_cv_str[] = "Constant voltage in mV";
+    char const                          chem_cap_str[] = "Nominal capacity in mAh";
+    char const                          chem_eoc_str[] = "End of charge, current in mA or voltage drop in mV";
+    char const                          chem_eod_str[] = "End of discharge voltage in mV";
+    char const                          chem_tout_str[] = "Charge timeout in % of the charge time, 0 for none";
+    char const                          chem_dv_str[] = "End the charge by voltage drop, -dV (y/n): ";
+    char const                          chem_keep_str[] = " (enter keeps ";
     char const                          mV_str[] = " mV";
     char const                          mAh_str[] = " mAh";
     char const                          mA_str[] = " mA";
@@ -257,11 +726,34 @@
     char const                          op_2_str[] = "(2) Charge->Discharge";
     char const                          op_3_str[] = "(3) Only Charge";
     char const                          op_4_str[] = "(4) Only Discharge";
+    char const                          op_5_str[] = "(5) Uploaded profile";
+    char const                          op_w_str[] = "(w) Define the adaptive rest";
+    char const                          op_p_str[] = "(p) Upload a profile";
+    char const                          rest_str[] = "Rest: ";
+    char const                          rest_fixed_str[] = "fixed time";
+    char const                          uV_min_str[] = " uV/min";
+    char const                          def_rest_str[] = "Define the rest threshold in uV/min, 0 for a fixed time (input the number and press enter): ";
+    char const                          op_5_sel_str[] = "Uploaded profile selected...";
+    char const                          op_6_str[] = "(6) Predischarge->(Charge->Discharge) x N->Postcharge";
+    char const                          op_6_sel_str[] = "Cycling selected...";
+    char const                          def_cycles_str[] = "Define number of cycles (input the number and press enter): ";
+    char const                          num_1and6_str[] = "Please input a number between 1 and 6, w or p";
+    char const                          profile_str[] = "Send the steps as state,current,end,limit,timeout separated by ';', finish with '.'";
+    char const                          profile_err_str[] = "Invalid profile";
     char const                          op_1_sel_str[] = "Predischarge->Charge->Discharge->Postcharge selected...";
     char const                          op_2_sel_str[] = "Charge->Discharge selected...";
     char const                          op_3_sel_str[] = "Only Charge selected...";
     char const                          op_4_sel_str[] = "Only Discharge selected...";
     char const                          cell_below_str[] = "Cell below 0.9V or not present";
+    char const                          cmd_set_str[] = "SET";
+    char const                          cmd_step_str[] = "STEP";
+    char const                          cmd_start_str[] = "START";
+    char const                          cmd_abort_str[] = "ABORT";
+    char const                          cmd_status_str[] = "STATUS";
+    char const                          cmd_menu_str[] = "MENU";
+    char const                          cmd_resume_str[] = "RESUME";
+    char const                          cmd_ok_str[] = "$OK<";
+    char const                          cmd_err_str[] = "$ERR<";
 
 #endif /* CHARGER_DISCHARGER_H*/
 
@@ -0,0 +1,714 @@
+/**
+ * @file chargerd.c
+ * @author Juan J. Rojas
+ * @date 17 Oct 2026
+ * @brief Linux daemon that runs the tests of many charger/discharger boards at once.
+ * @par Institution:
+ * LaSEINE / CeNT. Kyushu Institute of Technology.
+ * @par Mail (after leaving Kyutech):
+ * juan.rojas@tec.ac.cr
+ * @par Git repository:
+ * https://bitbucket.org/juanjorojash/cell_charger_discharger
+ *
+ * Each board is a serial port (or the pseudo-terminal of <tt> sim/charger_sim -p </tt>). All the ports are
+ * served by one thread with @p epoll. The daemon answers the prompts of @p param() with the keys given in the
+ * command line, or with @p -r configures the board with the command protocol of the firmware (@p command()), starts
+ * the test and writes the records of each cell in its own files:
+ *
+ * - <tt> dir/board/cellN.col </tt> and <tt> cellN.idx </tt>: the log of each second in the columnar store
+ *   (colstore.c), read with @p colquery
+ * - <tt> dir/board/cellN.txt </tt>: the other records of the cell (DC resistance, charge and energy, cycles)
+ * - <tt> dir/board/cellN_stream.csv </tt>: streamed samples, <tt> unix time,state,n,mV,mA </tt>
+ * - <tt> dir/board/diag.csv </tt>: timing of the ISR, reported every second after the 'd' key
+ * - <tt> dir/board/raw.log </tt>: everything received from the board
+ *
+ * When the board prints the menu (or with @p -r its status in STANDBY) again after a test, the board is done, unless
+ * @p -l is given.
+ */
+
+#define     _GNU_SOURCE ///< signalfd() and cfmakeraw()
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "host.h"
+
+#define     BOARDS_MAX                  64 ///< Maximum number of boards
+#define     OUT_MAX                     512 ///< Bytes waiting to be sent to one board
+#define     KEY_GAP_MS                  5 ///< Time between two bytes sent to a board, the PIC only buffers two
+#define     RETRY_MS                    2000 ///< Time between two attempts to open a board that is not connected
+#define     RESTARTS_MAX                3 ///< Menu restarts after a rejected answer before the board is given up
+#define     QUIET_MS                    2000 ///< A board that is silent this long while the menu is restarted gets ESC again
+#define     ANSWER_MS                   50 ///< Silence of the board before an answer is sent, the ISR drops the keys received while the menu is printed
+#define     CMDS_MAX                    28 ///< Commands sent to configure and start a board with @p -r: the profile steps, @p $SET and @p $START
+#define     CMD_MAX                     40 ///< Length of a command line of the firmware, including the line end
+
+/** Phase of the test of a board */
+enum phase {
+    PHASE_OFFLINE = 0, ///< The port is not open
+    PHASE_MENU, ///< The board is in @p param(), its prompts are answered
+    PHASE_RUN, ///< The test is running
+    PHASE_DONE ///< The test finished, or the board was given up
+};
+
+/** Answers to the menu, the same for every board */
+struct answers {
+    char charge; ///< Key of the charge current
+    char discharge; ///< Key of the discharge current
+    char option; ///< Key of the test option
+    char cells; ///< Key of the number of cells
+    bool parallel; ///< Test the cells in parallel
+    const char *cycles; ///< Number of cycles of option 6
+    const char *profile; ///< Profile sent for option 5 or 'p', without the final '.'
+    bool loop; ///< Start the test again when it finishes
+    bool attach; ///< Do not stop a test that is already running when the daemon starts
+    const char *remote; ///< Fields of @p $SET given with @p -r, NULL to answer the menu
+    bool resume; ///< Resume a test interrupted by a reset of the board instead of starting a new one
+};
+
+/** One board and its files */
+struct board {
+    char name[64]; ///< Name of the board, also the directory of its files
+    char path[PATH_MAX]; ///< Serial port
+    int fd; ///< Open port, -1 if #PHASE_OFFLINE
+    enum phase phase;
+    struct parser parser;
+    bool configured; ///< The charge current was answered since the last menu, so the test may be started
+    bool sync; ///< The menu is being restarted, the prompts are not answered until the board confirms it
+    uint8_t pending_esc; ///< ESC sent to restart the menu, not yet confirmed with "Restarting..."
+    bool stopping; ///< A running test was stopped with 'c' to restart the menu
+    uint64_t last_rx; ///< Time of the last byte received, in ms
+    bool prompted; ///< The prompt of the current partial line was already answered
+    bool hold; ///< #out holds an answer, sent once the board is silent for #ANSWER_MS
+    int cmd; ///< With @p -r, index in #cmds of the command waiting for its answer, -1 if none
+    bool fast; ///< With @p -r, the board answered a command, so it receives with the interrupt and #out is sent at once
+    int restarts; ///< Menu restarts in a row
+    char out[OUT_MAX]; ///< Bytes waiting to be sent, one every #KEY_GAP_MS
+    size_t out_len, out_pos;
+    uint64_t send_at; ///< Time of the next byte of #out, in ms
+    uint64_t retry_at; ///< Time of the next attempt to open the port, in ms
+    FILE *raw;
+    FILE *diag;
+    struct col_writer *col[HOST_CELLS];
+    FILE *txt[HOST_CELLS];
+    FILE *stream[HOST_CELLS];
+};
+
+static struct board                     boards[BOARDS_MAX];
+static int                              nboards = 0;
+static struct answers                   ans = { '1', '1', '1', '1', 0, "1", NULL, 0, 0, NULL, 0 };
+static char                             cmds[CMDS_MAX][CMD_MAX]; ///< Commands that configure and start a board with @p -r
+static int                              ncmds = 0;
+static const char                       *out_dir = ".";
+static int                              epfd;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static void note(const struct board *b, const char *msg)
+{
+    fprintf(stderr, "%s: %s\n", b->name, msg);
+}
+
+/**@brief Queue @p s to be sent to the board, paced by #KEY_GAP_MS
+*/
+static void send_str(struct board *b, const char *s)
+{
+    size_t n = strlen(s);
+    if (b->out_pos == b->out_len)
+    {
+        b->out_pos = b->out_len = 0;
+        b->hold = 0;
+    }
+    if (b->out_len + n > OUT_MAX) n = OUT_MAX - b->out_len;
+    memcpy(b->out + b->out_len, s, n);
+    if (b->out_pos == b->out_len) b->send_at = now_ms();
+    b->out_len += n;
+}
+
+static void send_key(struct board *b, char key)
+{
+    char s[2] = { key, 0 };
+    send_str(b, s);
+}
+
+/**@brief Open a file of the board in append mode, creating the directory of the board and writing @p header
+if the file is new
+*/
+static FILE *open_file(const struct board *b, const char *file, const char *header)
+{
+    char path[PATH_MAX];
+    FILE *f;
+    snprintf(path, sizeof(path), "%s/%s", out_dir, b->name);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/%s/%s", out_dir, b->name, file);
+    f = fopen(path, "a");
+    if (!f)
+    {
+        perror(path);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOLBF, 0);
+    if (header && ftell(f) == 0) fprintf(f, "%s\n", header);
+    return f;
+}
+
+/**@brief File of the cell @p cell (1 to 4) of a kind, opened the first time it is needed
+*/
+static FILE *cell_file(struct board *b, FILE **files, uint8_t cell, const char *suffix, const char *header)
+{
+    char file[32];
+    if (cell < 1 || cell > HOST_CELLS) return NULL;
+    if (!files[cell - 1])
+    {
+        snprintf(file, sizeof(file), "cell%u%s", cell, suffix);
+        files[cell - 1] = open_file(b, file, header);
+    }
+    return files[cell - 1];
+}
+
+/**@brief Columnar store of the cell @p cell (1 to 4), opened the first time it is needed
+*/
+static struct col_writer *cell_store(struct board *b, uint8_t cell)
+{
+    char path[PATH_MAX];
+    if (cell < 1 || cell > HOST_CELLS) return NULL;
+    if (!b->col[cell - 1])
+    {
+        snprintf(path, sizeof(path), "%s/%s", out_dir, b->name);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/%s/cell%u", out_dir, b->name, cell);
+        b->col[cell - 1] = col_open(path, cell);
+    }
+    return b->col[cell - 1];
+}
+
+/**@brief Restart the menu of the board with ESC, dropping the bytes not yet sent. The prompts are not answered
+until the board confirms the restart, since it may still be reading bytes that were sent before
+*/
+static void resync(struct board *b)
+{
+    b->out_pos = b->out_len = 0;
+    b->hold = 0;
+    b->sync = 1;
+    b->configured = 0;
+    b->pending_esc++;
+    send_key(b, 0x1B);
+}
+
+/**@brief Answer the prompts of @p param() and follow the phase of the test from the text lines
+@param line Complete line, or the partial line when the board waits for input without a line break
+*/
+static void menu(struct board *b, const char *line)
+{
+    char key[2] = { 0, 0 };
+    if (strstr(line, "---Parameter definition")) /// * The menu after a test means that the test finished
+    {
+        b->prompted = 1;
+        if (b->phase == PHASE_RUN)
+        {
+            note(b, "test finished");
+            if (!ans.loop) b->phase = PHASE_DONE;
+        }
+        if (b->stopping) /// - After a test stopped with 'c' the menu starts from the beginning
+        {
+            b->stopping = 0;
+            b->sync = 0;
+            b->pending_esc = 0;
+        }
+        if (b->phase != PHASE_DONE) b->phase = PHASE_MENU;
+        b->configured = 0;
+        return;
+    }
+    if (b->phase == PHASE_DONE) return;
+    if (strstr(line, "Restarting...")) /// * The menu restarts after each ESC, the last one ends the #resync()
+    {
+        b->prompted = 1;
+        if (b->pending_esc && !--b->pending_esc) b->sync = 0;
+        return;
+    }
+    if (b->sync) return;
+    if (strstr(line, "Starting...") || strstr(line, "Resuming..."))
+    {
+        b->prompted = 1;
+        b->phase = PHASE_RUN;
+        b->restarts = 0;
+        note(b, strstr(line, "Resuming...") ? "test resumed" : "test started");
+        return;
+    }
+    if (strstr(line, "Please input a number") || strstr(line, "Invalid profile")) /// * A rejected answer restarts the menu
+    {
+        b->prompted = 1;
+        if (++b->restarts > RESTARTS_MAX)
+        {
+            note(b, "the board rejects the answers, given up");
+            b->phase = PHASE_DONE;
+            return;
+        }
+        resync(b);
+        return;
+    }
+    if (strstr(line, "Press 'r' to resume")) key[0] = ans.resume ? 'r' : 'n'; /// * A test interrupted by a reset is resumed with @p -R
+    else if (strstr(line, "Define charge current"))
+    {
+        key[0] = ans.charge;
+        b->configured = 1;
+    }
+    else if (strstr(line, "Define discharge current")) key[0] = ans.discharge;
+    else if (strstr(line, "(p) Upload a profile")) key[0] = ans.option;
+    else if (strstr(line, "Define number of cells")) key[0] = ans.cells;
+    else if (strstr(line, "Test the cells in parallel")) key[0] = ans.parallel ? 'y' : 'n';
+    else if (strstr(line, "Define number of cycles"))
+    {
+        send_str(b, ans.cycles);
+        send_key(b, '\r');
+    }else if (strstr(line, "Send the steps"))
+    {
+        if (ans.profile) send_str(b, ans.profile);
+        send_key(b, '.');
+    }else if (strstr(line, "Press 's' to start")) /// * A menu that was not answered by the daemon is restarted
+    {
+        if (b->configured) key[0] = 's';
+        else resync(b);
+    }
+    else return;
+    b->prompted = 1;
+    b->phase = PHASE_MENU;
+    if (key[0]) send_str(b, key);
+    b->hold = 1;
+}
+
+/**@brief A test is running: it is stopped with 'c' while the menu is restarted, unless the daemon only attaches
+to the running tests
+*/
+static void running(struct board *b)
+{
+    if (!b->sync)
+    {
+        if (b->phase == PHASE_MENU) b->phase = PHASE_RUN;
+    }else if (ans.attach)
+    {
+        b->sync = 0;
+        b->pending_esc = 0;
+        b->phase = PHASE_RUN;
+    }else if (!b->stopping)
+    {
+        b->out_pos = b->out_len = 0;
+        b->hold = 0;
+        b->stopping = 1;
+        b->pending_esc = 0; /// The running firmware ignores ESC
+        send_key(b, 'c');
+    }
+}
+
+/**@brief Send the command line @p s to the board
+*/
+static void send_cmd(struct board *b, const char *s)
+{
+    send_str(b, s);
+    send_key(b, '\r');
+}
+
+/**@brief Build #cmds from the answers: the steps of the profile, @p $SET with the fields of @p -r and the option,
+cells, parallel and cycles of the menu answers, and @p $START
+@return 0 if a command does not fit
+*/
+static bool cmds_init(void)
+{
+    char step[CMD_MAX];
+    const char *p = ans.profile;
+    int n;
+    if (p) /// The profile is cleared with an empty @p $STEP and sent one step per command
+    {
+        snprintf(cmds[ncmds++], CMD_MAX, "$STEP");
+        while (*p && ncmds < CMDS_MAX - 2)
+        {
+            unsigned v[5] = { 0, 0, 0, 0, 0 };
+            n = (int) strcspn(p, ";");
+            snprintf(step, sizeof(step), "%.*s", n, p);
+            sscanf(step, "%u,%u,%u,%u,%u", &v[0], &v[1], &v[2], &v[3], &v[4]);
+            snprintf(cmds[ncmds++], CMD_MAX, "$STEP,S%u,I%u,E%u,L%u,T%u", v[0], v[1], v[2], v[3], v[4]);
+            p += n;
+            if (*p) p++;
+        }
+    }
+    n = snprintf(cmds[ncmds++], CMD_MAX, "$SET,%s%sO%c,N%c,P%d,Y%s", ans.remote, *ans.remote ? "," : "", ans.option,
+                 ans.cells, ans.parallel, ans.cycles);
+    snprintf(cmds[ncmds++], CMD_MAX, "$START");
+    return n < CMD_MAX;
+}
+
+/**@brief Follow a board configured with the command protocol (@p -r) from its answers and status records
+*/
+static void remote(struct board *b, const char *line)
+{
+    const char *s;
+    if (!strncmp(line, "$S,", 3)) /// * The status in STANDBY ends a running test, or starts the commands of #cmds
+    {
+        b->fast = 1;
+        s = strstr(line, ",S");
+        if (!s || atoi(s + 2) != 0) /// - Another state is a test that is running, when the daemon attaches to it
+        {
+            if (ans.attach && b->phase == PHASE_MENU && b->cmd < 0) b->phase = PHASE_RUN;
+            return;
+        }
+        if (b->phase == PHASE_RUN)
+        {
+            note(b, "test finished");
+            if (!ans.loop) b->phase = PHASE_DONE;
+            else b->phase = PHASE_MENU;
+        }
+        if (b->phase == PHASE_MENU && b->cmd < 0)
+        {
+            s = strstr(line, ",R");
+            if (ans.resume && s && atoi(s + 2)) send_cmd(b, "$RESUME"); /// - With @p -R a test interrupted by a reset (@p R1) is resumed
+            else
+            {
+                b->cmd = 0;
+                send_cmd(b, cmds[0]);
+            }
+        }
+    }else if (!strcmp(line, "$OK")) /// * Each accepted command sends the next one
+    {
+        b->fast = 1;
+        if (b->cmd < 0) return;
+        if (++b->cmd < ncmds) send_cmd(b, cmds[b->cmd]);
+        else b->cmd = -1;
+    }else if (!strcmp(line, "$ERR")) /// * A rejected command gives the board up
+    {
+        b->fast = 1;
+        if (b->cmd < 0) return;
+        fprintf(stderr, "%s: the board rejects %s, given up\n", b->name, cmds[b->cmd]);
+        b->cmd = -1;
+        b->phase = PHASE_DONE;
+    }else if (strstr(line, "Starting...") || strstr(line, "Resuming..."))
+    {
+        b->phase = PHASE_RUN;
+        note(b, strstr(line, "Resuming...") ? "test resumed" : "test started");
+    }else if (strstr(line, "---Parameter definition")) /// * The menu (ESC on the board) gets the first command again after #QUIET_MS
+    {
+        if (b->phase == PHASE_RUN)
+        {
+            note(b, "test finished");
+            b->phase = ans.loop ? PHASE_MENU : PHASE_DONE;
+        }
+        b->cmd = -1;
+    }
+}
+
+/**@brief Store one record of the board, called by #parser_feed()
+*/
+static void on_record(void *arg, const struct rec *r, const char *line)
+{
+    struct board *b = arg;
+    FILE *f;
+    struct col_writer *w;
+    long t = (long) time(NULL);
+    switch (r->type)
+    {
+        case REC_LOG:
+            if ((w = cell_store(b, r->cell))) col_append(w, (uint32_t) t, r);
+            running(b);
+            break;
+        case REC_STREAM:
+            f = cell_file(b, b->stream, r->cell, "_stream.csv", "time,state,n,v_mv,i_ma");
+            if (f) fprintf(f, "%ld,%u,%u,%u,%u\n", t, r->state, r->n, r->v, r->i);
+            break;
+        case REC_WAIT:
+            running(b);
+            break;
+        case REC_END:
+            fprintf(stderr, "%s: cell %u finished\n", b->name, r->cell);
+            if ((w = cell_store(b, r->cell))) col_flush(w);
+            /* fall through */
+        case REC_RES:
+        case REC_CHARGE:
+        case REC_CYCLE:
+            f = cell_file(b, b->txt, r->cell, ".txt", NULL);
+            if (f) fprintf(f, "%ld %s\n", t, line);
+            break;
+        case REC_DIAG:
+            if (!b->diag) b->diag = open_file(b, "diag.csv", "time,calls,max,mean,adc,loop,avg,latency,overruns,"
+                                                "h0,h1,h2,h3,h4,h5,h6,h7");
+            if (!b->diag) break;
+            fprintf(b->diag, "%ld,%u,%u,%u,%u,%u,%u,%u,%u", t, r->calls, r->isr_max, r->isr_mean, r->t_adc,
+                    r->t_loop, r->t_avg, r->lat, r->overruns);
+            for (int k = 0; k < HOST_DIAG_BINS; k++) fprintf(b->diag, ",%u", r->hist[k]);
+            fprintf(b->diag, "\n");
+            break;
+        case REC_CELL:
+            break;
+        case REC_TEXT:
+            if (ans.remote) remote(b, line);
+            else if (!b->prompted) menu(b, line);
+            break;
+    }
+    b->prompted = 0;
+}
+
+static void close_board(struct board *b)
+{
+    if (b->fd >= 0)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, b->fd, NULL);
+        close(b->fd);
+    }
+    b->fd = -1;
+    if (b->phase != PHASE_DONE) b->phase = PHASE_OFFLINE;
+    b->retry_at = now_ms() + RETRY_MS;
+    b->out_pos = b->out_len = 0;
+    b->hold = 0;
+}
+
+/**@brief Open the port of the board: raw mode, 57600 bps, 8 bits, no parity, one stop bit, no flow control
+*/
+static void open_board(struct board *b)
+{
+    struct termios tio;
+    struct epoll_event ev;
+    b->retry_at = now_ms() + RETRY_MS;
+    b->fd = open(b->path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (b->fd < 0) return;
+    if (!tcgetattr(b->fd, &tio))
+    {
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, B57600);
+        cfsetospeed(&tio, B57600);
+        tio.c_cflag |= CLOCAL | CREAD;
+        tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+        tcsetattr(b->fd, TCSANOW, &tio);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = b;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, b->fd, &ev);
+    parser_init(&b->parser);
+    b->phase = PHASE_MENU;
+    b->configured = 0;
+    b->prompted = 0;
+    b->restarts = 0;
+    note(b, "connected");
+    b->stopping = 0;
+    b->pending_esc = 0;
+    b->last_rx = now_ms();
+    b->cmd = -1;
+    b->fast = 0;
+    if (ans.remote) send_cmd(b, ans.attach ? "$STATUS" : "$ABORT"); /// With @p -r the board answers with its status
+    else resync(b); /// The board may be anywhere in the menu or running a test, the menu is restarted
+}
+
+static void read_board(struct board *b)
+{
+    char buf[4096];
+    ssize_t n = read(b->fd, buf, sizeof(buf));
+    if (n <= 0)
+    {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        note(b, "disconnected");
+        close_board(b);
+        return;
+    }
+    b->last_rx = now_ms();
+    if (!b->raw) b->raw = open_file(b, "raw.log", NULL);
+    if (b->raw) fwrite(buf, 1, (size_t) n, b->raw);
+    parser_feed(&b->parser, buf, (size_t) n, on_record, b);
+    if (b->parser.len && !b->prompted && !ans.remote) menu(b, b->parser.line); /// Some prompts wait for input without a line break
+}
+
+/**@brief Send the next queued byte of every board that is due
+@return Time until the next byte or retry is due in ms, -1 if there is none
+*/
+static int service(void)
+{
+    uint64_t now = now_ms();
+    uint64_t next = UINT64_MAX;
+    for (int k = 0; k < nboards; k++)
+    {
+        struct board *b = &boards[k];
+        if (b->fd < 0)
+        {
+            if (b->phase == PHASE_DONE) continue;
+            if (now >= b->retry_at) open_board(b);
+            if (b->fd < 0 && b->retry_at < next) next = b->retry_at;
+            continue;
+        }
+        if (b->sync && b->out_pos == b->out_len) /// A board that stays silent while the menu is restarted did not get the ESC
+        {
+            if (now >= b->last_rx + QUIET_MS)
+            {
+                b->stopping = 0;
+                b->pending_esc = 0;
+                b->last_rx = now;
+                resync(b);
+            }else if (b->last_rx + QUIET_MS < next) next = b->last_rx + QUIET_MS;
+        }
+        if (ans.remote && b->phase == PHASE_MENU && b->cmd < 0 && b->out_pos == b->out_len)
+        {
+            if (now >= b->last_rx + QUIET_MS) /// With @p -r, a board that does not answer gets the first command again
+            {
+                b->last_rx = now;
+                send_cmd(b, ans.attach ? "$STATUS" : "$ABORT");
+            }else if (b->last_rx + QUIET_MS < next) next = b->last_rx + QUIET_MS;
+        }
+        if (b->hold && b->out_pos < b->out_len && b->send_at < b->last_rx + ANSWER_MS)
+            b->send_at = b->last_rx + ANSWER_MS;
+        if (b->out_pos < b->out_len && now >= b->send_at)
+        {
+            ssize_t w = write(b->fd, &b->out[b->out_pos], b->fast ? b->out_len - b->out_pos : 1); /// A board in remote mode gets the whole command at once
+            if (w > 0) b->out_pos += (size_t) w;
+            b->send_at = now + KEY_GAP_MS;
+        }
+        if (b->out_pos < b->out_len && b->send_at < next) next = b->send_at;
+    }
+    if (next == UINT64_MAX) return -1;
+    return next > now ? (int) (next - now) : 0;
+}
+
+static bool all_done(void)
+{
+    for (int k = 0; k < nboards; k++) if (boards[k].phase != PHASE_DONE) return 0;
+    return 1;
+}
+
+static void close_files(struct board *b)
+{
+    if (b->raw) fclose(b->raw);
+    if (b->diag) fclose(b->diag);
+    for (int c = 0; c < HOST_CELLS; c++)
+    {
+        col_close(b->col[c]);
+        if (b->txt[c]) fclose(b->txt[c]);
+        if (b->stream[c]) fclose(b->stream[c]);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [-d dir] [-a keys] [-r fields] [-y] [-N cycles] [-P profile] [-l] [-x] [-R] [name=]port...\n"
+        "  -d  directory of the files of the boards (default .)\n"
+        "  -a  answers of the menu: charge current, discharge current, option and cells (default \"1111\")\n"
+        "  -r  configure the boards with commands instead of the menu, with these fields of $SET (e.g. K2,IC500,ID500\n"
+        "      for the chemistry 2 at 500 mA), the option and cells of -a and the rest of the options\n"
+        "  -y  test the cells in parallel\n"
+        "  -N  number of cycles of option 6 (default 1)\n"
+        "  -P  profile for option 5, steps separated by ';' without the final '.'\n"
+        "  -l  start the test again when it finishes\n"
+        "  -x  do not stop a test that is already running, only log it\n"
+        "  -R  resume a test interrupted by a reset of the board, if there is one, instead of starting a new one\n",
+        prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct epoll_event ev[BOARDS_MAX];
+    sigset_t mask;
+    int sfd, opt;
+    while ((opt = getopt(argc, argv, "d:a:r:yN:P:lxRh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                out_dir = optarg;
+                break;
+            case 'a':
+                if (strlen(optarg) != 4) usage(argv[0]);
+                ans.charge = optarg[0];
+                ans.discharge = optarg[1];
+                ans.option = optarg[2];
+                ans.cells = optarg[3];
+                break;
+            case 'r':
+                ans.remote = optarg;
+                break;
+            case 'y':
+                ans.parallel = 1;
+                break;
+            case 'N':
+                ans.cycles = optarg;
+                break;
+            case 'P':
+                ans.profile = optarg;
+                break;
+            case 'l':
+                ans.loop = 1;
+                break;
+            case 'x':
+                ans.attach = 1;
+                break;
+            case 'R':
+                ans.resume = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc || argc - optind > BOARDS_MAX) usage(argv[0]);
+    if (ans.remote && !cmds_init())
+    {
+        fprintf(stderr, "the $SET command is longer than %d bytes\n", CMD_MAX - 1);
+        return 2;
+    }
+    mkdir(out_dir, 0755);
+    for (int k = optind; k < argc; k++) /// Each board is <tt> name=port </tt>, or only the port named after its file
+    {
+        struct board *b = &boards[nboards++];
+        const char *eq = strchr(argv[k], '=');
+        const char *base = strrchr(argv[k], '/');
+        memset(b, 0, sizeof(*b));
+        b->fd = -1;
+        if (eq)
+        {
+            snprintf(b->name, sizeof(b->name), "%.*s", (int) (eq - argv[k]), argv[k]);
+            snprintf(b->path, sizeof(b->path), "%s", eq + 1);
+        }else
+        {
+            snprintf(b->name, sizeof(b->name), "%s", base ? base + 1 : argv[k]);
+            snprintf(b->path, sizeof(b->path), "%s", argv[k]);
+        }
+        parser_init(&b->parser);
+    }
+    epfd = epoll_create1(0);
+    sigemptyset(&mask); /// SIGINT and SIGTERM are received through a descriptor, so the files are closed properly
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sfd = signalfd(-1, &mask, 0);
+    if (epfd < 0 || sfd < 0)
+    {
+        perror("epoll");
+        return 1;
+    }
+    struct epoll_event sev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &sev);
+    while (!all_done())
+    {
+        int n = epoll_wait(epfd, ev, BOARDS_MAX, service());
+        for (int k = 0; k < n; k++)
+        {
+            struct board *b = ev[k].data.ptr;
+            if (!b) goto STOP;
+            if (b->fd >= 0) read_board(b);
+        }
+    }
+    STOP:
+    for (int k = 0; k < nboards; k++)
+    {
+        close_files(&boards[k]);
+        if (boards[k].fd >= 0) close(boards[k].fd);
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+/**
+ * @file colquery.c
+ * @author Juan J. Rojas
+ * @date 17 Oct 2026
+ * @brief Range queries over the columnar store written by chargerd.
+ * @par Institution:
+ * LaSEINE / CeNT. Kyushu Institute of Technology.
+ * @par Mail (after leaving Kyutech):
+ * juan.rojas@tec.ac.cr
+ * @par Git repository:
+ * https://bitbucket.org/juanjorojash/cell_charger_discharger
+ *
+ * Prints the rows of the cells of a board that match the state and time range as CSV, or with @p -l only the
+ * segments found in the index. For example, all the discharges of the cell 3:
+ *
+ * <tt> host/colquery -c 3 -s DISCHARGE data/board1 </tt>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "host.h"
+
+/** Names of the @p states of the firmware */
+static const char *const state_names[] = { "STANDBY", "IDLE", "FAULT", "ISDONE", "WAIT", "PREDISCHARGE", "CHARGE",
+    "DISCHARGE", "POSTCHARGE", "DS_DC_res", "CS_DC_res", "PS_DC_res" };
+
+#define     STATES                      (int) (sizeof(state_names) / sizeof(state_names[0]))
+
+static const char *state_name(uint8_t s)
+{
+    return s < STATES ? state_names[s] : "?";
+}
+
+/**@brief State given by name or number
+@return -2 if it is not a state
+*/
+static int parse_state(const char *s)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (!*end) return n >= 0 && n < STATES ? (int) n : -2;
+    for (int k = 0; k < STATES; k++) if (!strcasecmp(s, state_names[k])) return k;
+    return -2;
+}
+
+static void print_row(void *arg, const struct col_entry *e, const struct col_row *r)
+{
+    (void) arg;
+    printf("%u,%u,%s,%u,%u,%u,%u,%d,%u\n", e->cell, e->seq, state_name(e->state), r->time, r->sec, r->v, r->i,
+           r->t, r->q);
+}
+
+/**@brief Print the segments of a cell that match @p q, merging the chunks of each segment
+*/
+static void list(const char *base, const struct col_filter *q)
+{
+    struct col_entry *e, seg;
+    size_t n;
+    uint32_t rows = 0;
+    if (col_load(base, &e, &n)) return;
+    for (size_t k = 0; k < n; k++)
+    {
+        if ((q->state >= 0 && e[k].state != q->state) || e[k].t_last < q->from || e[k].t_first > q->to) continue;
+        if (rows && e[k].seq != seg.seq)
+        {
+            printf("%u,%u,%s,%u,%u,%u\n", seg.cell, seg.seq, state_name(seg.state), seg.t_first, seg.t_last, rows);
+            rows = 0;
+        }
+        if (!rows) seg = e[k];
+        seg.t_last = e[k].t_last;
+        rows += e[k].rows;
+    }
+    if (rows) printf("%u,%u,%s,%u,%u,%u\n", seg.cell, seg.seq, state_name(seg.state), seg.t_first, seg.t_last, rows);
+    free(e);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [-c cell] [-s state] [-f from] [-t to] [-l] board_dir\n"
+        "  -c  cell from 1 to %d (default all)\n"
+        "  -s  state, by name (CHARGE, DISCHARGE...) or number (default all)\n"
+        "  -f  first unix time (default 0)\n"
+        "  -t  last unix time (default none)\n"
+        "  -l  list the segments instead of the rows: cell,segment,state,first,last,rows\n",
+        prog, HOST_CELLS);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct col_filter q = { -1, 0, UINT32_MAX };
+    char base[1024];
+    int opt, cell = 0;
+    bool segments = 0;
+    while ((opt = getopt(argc, argv, "c:s:f:t:lh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                cell = atoi(optarg);
+                if (cell < 1 || cell > HOST_CELLS) usage(argv[0]);
+                break;
+            case 's':
+                if ((q.state = parse_state(optarg)) < -1) usage(argv[0]);
+                break;
+            case 'f':
+                q.from = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                q.to = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                segments = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) usage(argv[0]);
+    if (segments) printf("cell,segment,state,first,last,rows\n");
+    else printf("cell,segment,state,time,seconds,v_mv,i_ma,t_dc,q_dmah\n");
+    for (int c = 1; c <= HOST_CELLS; c++)
+    {
+        if (cell && c != cell) continue;
+        snprintf(base, sizeof(base), "%s/cell%d", argv[optind], c);
+        if (segments) list(base, &q);
+        else col_query(base, &q, print_row, NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,393 @@
+/**
+ * @file colstore.c
+ * @author Juan J. Rojas
+ * @date 17 Oct 2026
+ * @brief Columnar storage of the log of each second of a cell.
+ * @par Institution:
+ * LaSEINE / CeNT. Kyushu Institute of Technology.
+ * @par Mail (after leaving Kyutech):
+ * juan.rojas@tec.ac.cr
+ * @par Git repository:
+ * https://bitbucket.org/juanjorojash/cell_charger_discharger
+ *
+ * The #REC_LOG records of a cell are kept in chunks of up to #COL_CHUNK_ROWS rows of one state. A chunk is stored
+ * column by column (unix time, seconds, V, I, T, Q), each column as the deltas between its rows, zigzag and
+ * varint coded, with the runs of equal deltas collapsed. The log of one second takes about 6 bytes instead of
+ * about 40 bytes of text.
+ *
+ * Two files are written per cell:
+ * - <tt> cellN.col </tt>: the chunks, one after the other
+ * - <tt> cellN.idx </tt>: one #col_entry of #COL_ENTRY_SIZE bytes per chunk, with its cell, state, segment and
+ *   time range. A segment is a run of one state: a range query only reads the index and the chunks it needs.
+ *
+ * A chunk is appended to @p cellN.col before its entry is appended to the index, so after a crash the index
+ * never points to a chunk that is not complete. The rows of the chunk not yet closed are lost, but they are
+ * also in @p raw.log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host.h"
+
+#define     COL_MAGIC                   "CCD1" ///< First bytes of both files
+#define     COL_ENTRY_SIZE              32 ///< Bytes of a #col_entry in the index file
+#define     COL_VARINT_MAX              10 ///< Longest varint of a 64-bit value
+
+/** Columns of a chunk, in the order they are stored */
+enum col_column {
+    COL_TIME = 0, ///< Unix time of the host
+    COL_SEC, ///< Seconds since the start of the state, see #rec::time
+    COL_V,
+    COL_I,
+    COL_T,
+    COL_Q
+};
+
+static void put_le(uint8_t *p, uint64_t v, int n)
+{
+    for (int k = 0; k < n; k++) p[k] = (uint8_t) (v >> (8 * k));
+}
+
+static uint64_t get_le(const uint8_t *p, int n)
+{
+    uint64_t v = 0;
+    for (int k = n - 1; k >= 0; k--) v = (v << 8) | p[k];
+    return v;
+}
+
+/**@brief FNV-1a hash of a chunk, stored in its index entry to detect a damaged file
+*/
+static uint32_t checksum(const uint8_t *p, size_t n)
+{
+    uint32_t h = 2166136261u;
+    while (n--) h = (h ^ *p++) * 16777619u;
+    return h;
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        p[n++] = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t) v;
+    return n;
+}
+
+/**@brief Read a varint
+@return Bytes read, 0 if it does not end before @p end
+*/
+static size_t get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    size_t n = 0;
+    int shift = 0;
+    *v = 0;
+    while (p + n < end && shift < 64)
+    {
+        *v |= (uint64_t) (p[n] & 0x7F) << shift;
+        if (!(p[n++] & 0x80)) return n;
+        shift += 7;
+    }
+    return 0;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+/**@brief Code one column: each delta is a varint of <tt> zigzag(delta) << 1 </tt>, with the low bit set when
+it repeats, and then followed by the varint of the repetitions minus 2
+@return Bytes written to @p p
+*/
+static size_t put_column(uint8_t *p, const int64_t *col, uint16_t rows)
+{
+    size_t n = 0;
+    int64_t prev = 0;
+    for (uint16_t k = 0; k < rows;)
+    {
+        int64_t d = col[k] - prev;
+        uint16_t run = 1;
+        while (k + run < rows && col[k + run] - col[k + run - 1] == d) run++;
+        n += put_varint(p + n, zigzag(d) << 1 | (run > 1));
+        if (run > 1) n += put_varint(p + n, run - 2);
+        prev = col[k + run - 1];
+        k += run;
+    }
+    return n;
+}
+
+/**@brief Decode one column of @p rows values
+@return Start of the next column, NULL if the chunk is damaged
+*/
+static const uint8_t *get_column(const uint8_t *p, const uint8_t *end, int64_t *col, uint16_t rows)
+{
+    int64_t val = 0;
+    uint64_t tok, run;
+    size_t n;
+    for (uint16_t k = 0; k < rows;)
+    {
+        if (!(n = get_varint(p, end, &tok))) return NULL;
+        p += n;
+        run = 1;
+        if (tok & 1)
+        {
+            if (!(n = get_varint(p, end, &run))) return NULL;
+            p += n;
+            run += 2;
+        }
+        if (run > (uint64_t) (rows - k)) return NULL;
+        for (; run; run--)
+        {
+            val += unzigzag(tok >> 1);
+            col[k++] = val;
+        }
+    }
+    return p;
+}
+
+static void put_entry(uint8_t *p, const struct col_entry *e)
+{
+    put_le(p, e->offset, 8);
+    put_le(p + 8, e->size, 4);
+    put_le(p + 12, e->t_first, 4);
+    put_le(p + 16, e->t_last, 4);
+    put_le(p + 20, e->seq, 4);
+    put_le(p + 24, e->sum, 4);
+    put_le(p + 28, e->rows, 2);
+    p[30] = e->cell;
+    p[31] = e->state;
+}
+
+static void get_entry(const uint8_t *p, struct col_entry *e)
+{
+    e->offset = get_le(p, 8);
+    e->size = (uint32_t) get_le(p + 8, 4);
+    e->t_first = (uint32_t) get_le(p + 12, 4);
+    e->t_last = (uint32_t) get_le(p + 16, 4);
+    e->seq = (uint32_t) get_le(p + 20, 4);
+    e->sum = (uint32_t) get_le(p + 24, 4);
+    e->rows = (uint16_t) get_le(p + 28, 2);
+    e->cell = p[30];
+    e->state = p[31];
+}
+
+/**@brief Open a file for appending, writing #COL_MAGIC if it is new
+*/
+static FILE *open_append(const char *base, const char *suffix)
+{
+    char path[1024];
+    FILE *f;
+    snprintf(path, sizeof(path), "%s%s", base, suffix);
+    f = fopen(path, "ab");
+    if (!f)
+    {
+        perror(path);
+        return NULL;
+    }
+    if (ftell(f) == 0) fwrite(COL_MAGIC, 1, 4, f);
+    return f;
+}
+
+/**@brief Open the store of a cell for appending
+@param base Path of the files without the suffix, like <tt> dir/board/cell3 </tt>
+@return NULL if the files cannot be opened
+*/
+struct col_writer *col_open(const char *base, uint8_t cell)
+{
+    struct col_writer *w = calloc(1, sizeof(*w));
+    struct col_entry *e;
+    size_t n;
+    if (!w) return NULL;
+    w->cell = cell;
+    if (!col_load(base, &e, &n) && n) /// The segments continue the numbering of the entries already stored
+    {
+        w->seq = e[n - 1].seq + 1;
+        free(e);
+    }
+    w->data = open_append(base, ".col");
+    w->index = open_append(base, ".idx");
+    if (!w->data || !w->index)
+    {
+        col_close(w);
+        return NULL;
+    }
+    return w;
+}
+
+/**@brief Close the chunk being filled, appending it and its index entry
+*/
+void col_flush(struct col_writer *w)
+{
+    static uint8_t buf[COL_COLUMNS * COL_CHUNK_ROWS * (COL_VARINT_MAX + 3) + 2];
+    uint8_t ent[COL_ENTRY_SIZE];
+    struct col_entry e;
+    size_t n = 2;
+    if (!w->rows) return;
+    put_le(buf, w->rows, 2);
+    for (int c = 0; c < COL_COLUMNS; c++) n += put_column(buf + n, w->col[c], w->rows);
+    fseek(w->data, 0, SEEK_END);
+    e.offset = (uint64_t) ftell(w->data);
+    e.size = (uint32_t) n;
+    e.t_first = (uint32_t) w->col[COL_TIME][0];
+    e.t_last = (uint32_t) w->col[COL_TIME][w->rows - 1];
+    e.seq = w->seq;
+    e.sum = checksum(buf, n);
+    e.rows = w->rows;
+    e.cell = w->cell;
+    e.state = w->state;
+    put_entry(ent, &e);
+    if (fwrite(buf, 1, n, w->data) == n && !fflush(w->data)) /// The chunk is on disk before its entry
+    {
+        fwrite(ent, 1, COL_ENTRY_SIZE, w->index);
+        fflush(w->index);
+    }
+    w->rows = 0;
+}
+
+/**@brief Add one #REC_LOG record received at the unix time @p time. A change of state, or a state that starts
+again, begins a new segment
+*/
+void col_append(struct col_writer *w, uint32_t time, const struct rec *r)
+{
+    if (w->rows && (r->state != w->state || r->time < w->col[COL_SEC][w->rows - 1]))
+    {
+        col_flush(w);
+        w->seq++;
+    }
+    if (!w->rows) w->state = r->state;
+    w->col[COL_TIME][w->rows] = time;
+    w->col[COL_SEC][w->rows] = r->time;
+    w->col[COL_V][w->rows] = r->v;
+    w->col[COL_I][w->rows] = r->i;
+    w->col[COL_T][w->rows] = r->t;
+    w->col[COL_Q][w->rows] = r->q;
+    if (++w->rows == COL_CHUNK_ROWS) col_flush(w);
+}
+
+void col_close(struct col_writer *w)
+{
+    if (!w) return;
+    if (w->data && w->index) col_flush(w);
+    if (w->data) fclose(w->data);
+    if (w->index) fclose(w->index);
+    free(w);
+}
+
+/**@brief Load the index of a cell. Entries that point past the end of the chunks are dropped
+@param base Path of the files without the suffix
+@param e Receives the entries, to be freed by the caller, NULL if there are none
+@param n Receives the number of entries
+@return 0, or -1 if the index cannot be read
+*/
+int col_load(const char *base, struct col_entry **e, size_t *n)
+{
+    char path[1024];
+    uint8_t ent[COL_ENTRY_SIZE];
+    size_t cap = 0;
+    long end;
+    FILE *f;
+    *e = NULL;
+    *n = 0;
+    snprintf(path, sizeof(path), "%s.col", base);
+    if (!(f = fopen(path, "rb"))) return -1;
+    fseek(f, 0, SEEK_END);
+    end = ftell(f);
+    fclose(f);
+    snprintf(path, sizeof(path), "%s.idx", base);
+    if (!(f = fopen(path, "rb"))) return -1;
+    if (fread(ent, 1, 4, f) != 4 || memcmp(ent, COL_MAGIC, 4))
+    {
+        fclose(f);
+        return -1;
+    }
+    while (fread(ent, 1, COL_ENTRY_SIZE, f) == COL_ENTRY_SIZE)
+    {
+        if (*n == cap)
+        {
+            struct col_entry *m = realloc(*e, (cap = cap ? cap * 2 : 256) * sizeof(**e));
+            if (!m) break;
+            *e = m;
+        }
+        get_entry(ent, &(*e)[*n]);
+        if ((*e)[*n].offset + (*e)[*n].size <= (uint64_t) end) (*n)++;
+    }
+    fclose(f);
+    return 0;
+}
+
+/**@brief Decode the chunk of the entry @p e
+@param f The chunks file of the cell
+@param rows Receives the rows, at least #COL_CHUNK_ROWS
+@return 0, or -1 if the chunk is damaged
+*/
+int col_read(FILE *f, const struct col_entry *e, struct col_row *rows)
+{
+    static uint8_t buf[COL_COLUMNS * COL_CHUNK_ROWS * (COL_VARINT_MAX + 3) + 2];
+    static int64_t col[COL_COLUMNS][COL_CHUNK_ROWS];
+    const uint8_t *p = buf, *end = buf + e->size;
+    if (e->size > sizeof(buf) || e->rows > COL_CHUNK_ROWS || fseek(f, (long) e->offset, SEEK_SET)
+        || fread(buf, 1, e->size, f) != e->size || checksum(buf, e->size) != e->sum || get_le(buf, 2) != e->rows)
+        return -1;
+    p += 2;
+    for (int c = 0; c < COL_COLUMNS && p; c++) p = get_column(p, end, col[c], e->rows);
+    if (!p) return -1;
+    for (uint16_t k = 0; k < e->rows; k++)
+    {
+        rows[k].time = (uint32_t) col[COL_TIME][k];
+        rows[k].sec = (uint32_t) col[COL_SEC][k];
+        rows[k].v = (uint16_t) col[COL_V][k];
+        rows[k].i = (uint16_t) col[COL_I][k];
+        rows[k].t = (int16_t) col[COL_T][k];
+        rows[k].q = (uint32_t) col[COL_Q][k];
+    }
+    return 0;
+}
+
+/**@brief Call @p fn with every row of a cell that matches @p q. Only the chunks whose index entry matches are
+read
+@param base Path of the files without the suffix
+@return Rows found, -1 if the store cannot be read
+*/
+long col_query(const char *base, const struct col_filter *q, col_fn fn, void *arg)
+{
+    static struct col_row rows[COL_CHUNK_ROWS];
+    char path[1024];
+    struct col_entry *e;
+    size_t n;
+    long found = 0;
+    FILE *f;
+    if (col_load(base, &e, &n)) return -1;
+    snprintf(path, sizeof(path), "%s.col", base);
+    if (!(f = fopen(path, "rb")))
+    {
+        free(e);
+        return -1;
+    }
+    for (size_t k = 0; k < n; k++)
+    {
+        if ((q->state >= 0 && e[k].state != q->state) || e[k].t_last < q->from || e[k].t_first > q->to) continue;
+        if (col_read(f, &e[k], rows))
+        {
+            fprintf(stderr, "%s.col: chunk at %llu is damaged\n", base, (unsigned long long) e[k].offset);
+            continue;
+        }
+        for (uint16_t r = 0; r < e[k].rows; r++)
+        {
+            if (rows[r].time < q->from || rows[r].time > q->to) continue;
+            fn(arg, &e[k], &rows[r]);
+            found++;
+        }
+    }
+    fclose(f);
+    free(e);
+    return found;
+}
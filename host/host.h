@@ -0,0 +1,129 @@
+/**
+ * @file host.h
+ * @author Juan J. Rojas
+ * @date 17 Oct 2026
+ * @brief Host tools header file: records of the serial log of the charger/discharger and their parser.
+ * @par Institution:
+ * LaSEINE / CeNT. Kyushu Institute of Technology.
+ * @par Mail (after leaving Kyutech):
+ * juan.rojas@tec.ac.cr
+ * @par Git repository:
+ * https://bitbucket.org/juanjorojash/cell_charger_discharger
+ */
+
+#ifndef HOST_H
+    #define HOST_H
+    #include <stdint.h>
+    #include <stdbool.h>
+    #include <stddef.h>
+    #include <stdio.h>
+
+    #define     HOST_CELLS              4 ///< Cells in the switcher board
+    #define     HOST_LINE_MAX           256 ///< Longest line kept by the parser, longer lines are cut
+    #define     HOST_DIAG_BINS          8 ///< Bins of the histogram of #REC_DIAG, @p DIAG_BINS of the firmware
+    #define     COL_CHUNK_ROWS          512 ///< Rows of a chunk of the columnar store (colstore.c)
+    #define     COL_COLUMNS             6 ///< Columns of a chunk: unix time, seconds, V, I, T, Q
+
+    /** Kind of a line of the serial log, see @p log_control(), @p coulomb_report(), @p cycle_report() and
+    @p stream_send() and @p diag_report() in the firmware */
+    enum rec_type {
+        REC_TEXT = 0, ///< Any other line: menus, prompts and messages
+        REC_LOG, ///< <tt> m:ss,Cn,Ss,Vmv,Ima,Tt,Qq </tt>, once per second
+        REC_WAIT, ///< <tt> Cn,S4,Ws </tt>, once per second of a rest
+        REC_RES, ///< <tt> Cn,Ss,Rr </tt>, DC resistance
+        REC_CHARGE, ///< <tt> Cn,Ss,Qmah.uah,Emwh </tt>, charge and energy at the end of a state
+        REC_CYCLE, ///< <tt> Cn,Yc,QC..,QD..,EC..,ED..,F..,RC..,RD..,T.. </tt>, summary of a cycle
+        REC_STREAM, ///< <tt> Hn,Ss,Vmv,Ima </tt>, streamed sample
+        REC_DIAG, ///< <tt> Gcalls,Xmax,Mmean,Aadc,Lloop,Savg,Ulat,Oover,Bh0..Bh7 </tt>, timing of the ISR in the last second
+        REC_CELL, ///< <tt> Cell n </tt>, the following records belong to the cell n
+        REC_END ///< <tt> >END </tt>, the test of the cell is finished
+    };
+
+    /** One parsed line. Only the fields of its @p type are set, the rest are 0 */
+    struct rec {
+        enum rec_type type;
+        uint8_t cell; ///< Cell from 1 to 4, 0 if the line does not name it
+        uint8_t state; ///< State of the firmware (@p states)
+        uint16_t n; ///< Cycle of #REC_CYCLE, sample of #REC_STREAM
+        uint32_t time; ///< #REC_LOG: seconds since the start of the state
+        uint16_t v; ///< Voltage in mV
+        uint16_t i; ///< Current in mA
+        int16_t t; ///< #REC_LOG: temperature in 0.1 degC, #REC_CYCLE: maximum temperature
+        uint32_t q; ///< #REC_LOG: charge in 0.1 mAh, #REC_CHARGE: charge in uAh
+        uint32_t e; ///< #REC_CHARGE: energy in mWh
+        uint16_t w; ///< #REC_WAIT: seconds left
+        uint16_t r; ///< #REC_RES: DC resistance in 0.1 mOhm
+        uint16_t qc, qd, ec, ed; ///< #REC_CYCLE: charge and discharge in mAh, energies in mWh
+        uint16_t f; ///< #REC_CYCLE: coulombic efficiency in per mille
+        uint16_t rc, rd; ///< #REC_CYCLE: DC resistance charged and discharged in 0.1 mOhm
+        uint16_t calls; ///< #REC_DIAG: calls of the ISR
+        uint16_t isr_max, isr_mean; ///< #REC_DIAG: longest and mean call of the ISR in cycles of 0.125 us
+        uint16_t t_adc, t_loop, t_avg; ///< #REC_DIAG: longest ADC read, control loop and averaging
+        uint16_t lat; ///< #REC_DIAG: longest latency from the overflow of Timer1
+        uint16_t overruns; ///< #REC_DIAG: Timer1 overflows pending at the end of the ADC interrupt
+        uint16_t hist[HOST_DIAG_BINS]; ///< #REC_DIAG: calls of the ISR by duration
+    };
+
+    /** Splits the byte stream of a board into lines. A line ends with CR, LF or '<' */
+    struct parser {
+        char line[HOST_LINE_MAX]; ///< Line being received, always terminated
+        size_t len; ///< Length of #line
+        uint8_t cell; ///< Last cell named by the log, for the records that do not name it
+        uint64_t lines; ///< Lines parsed
+    };
+
+    /** Called by #parser_feed() with every complete line and its record */
+    typedef void (*rec_fn)(void *arg, const struct rec *r, const char *line);
+
+    /** Index entry of a chunk of the columnar store */
+    struct col_entry {
+        uint64_t offset; ///< Position of the chunk in the @p .col file
+        uint32_t size; ///< Bytes of the chunk
+        uint32_t t_first, t_last; ///< Unix time of the first and last rows
+        uint32_t seq; ///< Segment: run of one state, counted from the first record of the cell
+        uint32_t sum; ///< Checksum of the chunk
+        uint16_t rows;
+        uint8_t cell;
+        uint8_t state;
+    };
+
+    /** One row of the columnar store, a #REC_LOG record and the time it was received */
+    struct col_row {
+        uint32_t time; ///< Unix time
+        uint32_t sec; ///< Seconds since the start of the state
+        uint16_t v; ///< Voltage in mV
+        uint16_t i; ///< Current in mA
+        int16_t t; ///< Temperature in 0.1 degC
+        uint32_t q; ///< Charge in 0.1 mAh
+    };
+
+    /** Writer of the store of one cell, it keeps the chunk being filled */
+    struct col_writer {
+        FILE *data, *index;
+        uint8_t cell;
+        uint8_t state; ///< State of the chunk being filled
+        uint32_t seq; ///< Segment of the chunk being filled
+        uint16_t rows; ///< Rows of the chunk being filled
+        int64_t col[COL_COLUMNS][COL_CHUNK_ROWS];
+    };
+
+    /** Range query of the store */
+    struct col_filter {
+        int state; ///< State of the rows, -1 for all
+        uint32_t from, to; ///< Unix time range, both included
+    };
+
+    /** Called by #col_query() with every row that matches, and the entry of its chunk */
+    typedef void (*col_fn)(void *arg, const struct col_entry *e, const struct col_row *row);
+
+    bool parse_line(const char *line, struct rec *r);
+    void parser_init(struct parser *p);
+    void parser_feed(struct parser *p, const char *data, size_t n, rec_fn fn, void *arg);
+    struct col_writer *col_open(const char *base, uint8_t cell);
+    void col_append(struct col_writer *w, uint32_t time, const struct rec *r);
+    void col_flush(struct col_writer *w);
+    void col_close(struct col_writer *w);
+    int col_load(const char *base, struct col_entry **e, size_t *n);
+    int col_read(FILE *f, const struct col_entry *e, struct col_row *rows);
+    long col_query(const char *base, const struct col_filter *q, col_fn fn, void *arg);
+#endif /* HOST_H */
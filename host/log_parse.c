@@ -0,0 +1,234 @@
+/**
+ * @file log_parse.c
+ * @author Juan J. Rojas
+ * @date 17 Oct 2026
+ * @brief Parser of the serial log of the charger/discharger.
+ * @par Institution:
+ * LaSEINE / CeNT. Kyushu Institute of Technology.
+ * @par Mail (after leaving Kyutech):
+ * juan.rojas@tec.ac.cr
+ * @par Git repository:
+ * https://bitbucket.org/juanjorojash/cell_charger_discharger
+ *
+ * The records are comma separated fields made of a tag (one or two capital letters) and a number, like
+ * <tt> V1436 </tt> or <tt> QC1064 </tt>. The parser does not allocate and does not use @p sscanf(), since it also
+ * runs over recorded logs of many days.
+ */
+
+#include <string.h>
+#include "host.h"
+
+/**@brief Read one field of a record
+@param s Start of the field
+@param tag Receives the tag, up to two letters, terminated
+@param val Receives the integer part of the number
+@param frac Receives the fractional part in thousandths (for <tt> Qmah.uah </tt>)
+@return Start of the next field, NULL if there is none
+*/
+static const char *field(const char *s, char tag[3], long *val, long *frac)
+{
+    int k = 0;
+    bool neg = 0;
+    long v = 0, f = 0, scale = 100;
+    while (*s >= 'A' && *s <= 'Z')
+    {
+        if (k < 2) tag[k++] = *s;
+        s++;
+    }
+    tag[k] = 0;
+    if (*s == '-')
+    {
+        neg = 1;
+        s++;
+    }
+    while (*s >= '0' && *s <= '9') v = v * 10 + (*s++ - '0');
+    if (*s == '.')
+    {
+        for (s++; *s >= '0' && *s <= '9'; s++)
+        {
+            f += (*s - '0') * scale;
+            scale /= 10;
+        }
+    }
+    *val = neg ? -v : v;
+    *frac = f;
+    while (*s && *s != ',') s++;
+    return *s ? s + 1 : NULL;
+}
+
+/**@brief Parse the fields of a #REC_DIAG record, their tags are not the ones of the other records
+*/
+static void parse_diag(const char *s, struct rec *r)
+{
+    char tag[3];
+    long val, frac;
+    int bin = 0;
+    r->type = REC_DIAG;
+    while (s)
+    {
+        s = field(s, tag, &val, &frac);
+        switch (tag[0])
+        {
+            case 'G':
+                r->calls = (uint16_t) val;
+                break;
+            case 'X':
+                r->isr_max = (uint16_t) val;
+                break;
+            case 'M':
+                r->isr_mean = (uint16_t) val;
+                break;
+            case 'A':
+                r->t_adc = (uint16_t) val;
+                break;
+            case 'L':
+                r->t_loop = (uint16_t) val;
+                break;
+            case 'S':
+                r->t_avg = (uint16_t) val;
+                break;
+            case 'U':
+                r->lat = (uint16_t) val;
+                break;
+            case 'O':
+                r->overruns = (uint16_t) val;
+                break;
+            case 'B':
+                if (bin < HOST_DIAG_BINS) r->hist[bin++] = (uint16_t) val;
+                break;
+        }
+    }
+}
+
+/**@brief Parse one line of the log, without the terminator
+@return 0 if the line is not a record (#REC_TEXT)
+*/
+bool parse_line(const char *line, struct rec *r)
+{
+    const char *s = line;
+    char tag[3];
+    long val, frac;
+    memset(r, 0, sizeof(*r));
+    if (!strcmp(line, ">END"))
+    {
+        r->type = REC_END;
+        return 1;
+    }
+    if (!strncmp(line, "Cell ", 5) && line[5] >= '1' && line[5] <= '4' && !line[6])
+    {
+        r->type = REC_CELL;
+        r->cell = (uint8_t) (line[5] - '0');
+        return 1;
+    }
+    if (*s >= '0' && *s <= '9') /// * A line that starts with <tt> m:ss </tt> is a #REC_LOG
+    {
+        long m = 0, sec = 0;
+        while (*s >= '0' && *s <= '9') m = m * 10 + (*s++ - '0');
+        if (*s++ != ':') return 0;
+        while (*s >= '0' && *s <= '9') sec = sec * 10 + (*s++ - '0');
+        if (*s++ != ',') return 0;
+        r->type = REC_LOG;
+        r->time = (uint32_t) (m * 60 + sec);
+    }else if (s[0] == 'H' && s[1] >= '0' && s[1] <= '9') r->type = REC_STREAM;
+    else if (s[0] == 'G' && s[1] >= '0' && s[1] <= '9')
+    {
+        parse_diag(s, r);
+        return 1;
+    }
+    else if (s[0] != 'C' || s[1] < '1' || s[1] > '4' || s[2] != ',') return 0;
+    while (s) /// * The fields are stored by tag, the type of a cell record is given by the tag of its third field
+    {
+        s = field(s, tag, &val, &frac);
+        switch (tag[0])
+        {
+            case 'C':
+                r->cell = (uint8_t) val;
+                break;
+            case 'S':
+                r->state = (uint8_t) val;
+                break;
+            case 'Y':
+                r->type = REC_CYCLE;
+                r->n = (uint16_t) val;
+                break;
+            case 'H':
+                r->n = (uint16_t) val;
+                break;
+            case 'V':
+                r->v = (uint16_t) val;
+                break;
+            case 'I':
+                r->i = (uint16_t) val;
+                break;
+            case 'T':
+                r->t = (int16_t) val;
+                break;
+            case 'W':
+                r->type = REC_WAIT;
+                r->w = (uint16_t) val;
+                break;
+            case 'R':
+                if (tag[1] == 'C') r->rc = (uint16_t) val;
+                else if (tag[1] == 'D') r->rd = (uint16_t) val;
+                else
+                {
+                    r->type = REC_RES;
+                    r->r = (uint16_t) val;
+                }
+                break;
+            case 'Q':
+                if (tag[1] == 'C') r->qc = (uint16_t) val;
+                else if (tag[1] == 'D') r->qd = (uint16_t) val;
+                else if (r->type == REC_LOG) r->q = (uint32_t) val;
+                else
+                {
+                    r->type = REC_CHARGE;
+                    r->q = (uint32_t) (val * 1000 + frac);
+                }
+                break;
+            case 'E':
+                if (tag[1] == 'C') r->ec = (uint16_t) val;
+                else if (tag[1] == 'D') r->ed = (uint16_t) val;
+                else r->e = (uint32_t) val;
+                break;
+            case 'F':
+                r->f = (uint16_t) val;
+                break;
+        }
+    }
+    return r->type != REC_TEXT;
+}
+
+void parser_init(struct parser *p)
+{
+    p->len = 0;
+    p->line[0] = 0;
+    p->cell = 0;
+    p->lines = 0;
+}
+
+/**@brief Split @p data into lines and call @p fn with the record of each line. The records that do not name a
+cell (#REC_STREAM, #REC_DIAG, #REC_END) get the last cell named before them. A partial line is kept for the next call.
+*/
+void parser_feed(struct parser *p, const char *data, size_t n, rec_fn fn, void *arg)
+{
+    struct rec r;
+    for (size_t k = 0; k < n; k++)
+    {
+        char c = data[k];
+        if (c != '\r' && c != '\n' && c != '<')
+        {
+            if (p->len < HOST_LINE_MAX - 1) p->line[p->len++] = c;
+            continue;
+        }
+        if (!p->len) continue;
+        p->line[p->len] = 0;
+        parse_line(p->line, &r);
+        if (r.cell) p->cell = r.cell;
+        else if (r.type != REC_TEXT) r.cell = p->cell;
+        p->lines++;
+        fn(arg, &r, p->line);
+        p->len = 0;
+    }
+    p->line[p->len] = 0;
+}
@@ -0,0 +1,398 @@
+/**
+ * @file replay.c
+ * @author Juan J. Rojas
+ * @date 17 Oct 2026
+ * @brief Replay of recorded logs to benchmark and check the host tools.
+ * @par Institution:
+ * LaSEINE / CeNT. Kyushu Institute of Technology.
+ * @par Mail (after leaving Kyutech):
+ * juan.rojas@tec.ac.cr
+ * @par Git repository:
+ * https://bitbucket.org/juanjorojash/cell_charger_discharger
+ *
+ * The logs (the @p raw.log of chargerd or the output of the simulator) are loaded in memory and fed at maximum
+ * speed through the same path as chargerd: #parser_feed(), the columnar store and the text records. Each
+ * #REC_LOG record also goes through #step_end(), a port of the end-of-step criteria of the firmware for the
+ * steps of options 1 to 4, so that the second where the host decides the end can be compared with the second
+ * where the firmware ended the state.
+ *
+ * A state is checked when it is closed: by its charge record (<tt> C1,Sn,Q... </tt>, printed by the firmware when
+ * the step ends), by a log line of another state or by <tt> >END </tt>. A state still open at the end of a log (a
+ * test that is running, or was stopped with 'c' or 'n') is only counted as unfinished.
+ *
+ * The report gives the throughput, the percentiles of the time taken by each line and the number of states
+ * whose end does not agree. The exit status is 1 if any of them does not agree.
+ */
+
+#define     _GNU_SOURCE ///< mkdtemp()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "host.h"
+
+#define     END_TOLERANCE               1 ///< Seconds between the end decided by the host and the end of the log that still agree
+#define     DV_ROUNDING                 1 ///< mV lost by the -dV measured from the mV of the log, instead of the extra bits of @p vavg_hr
+
+/** States of the firmware that end by a criterion of #step_end(), see @p states */
+enum {
+    PREDISCHARGE = 5,
+    CHARGE = 6,
+    DISCHARGE = 7,
+    POSTCHARGE = 8
+};
+
+/** Parameters of the end of the steps, taken from the menu of the log unless given in the command line */
+struct params {
+    bool li_ion; ///< Li-Ion ends the charge by current, Ni-MH by -dV
+    uint16_t capacity; ///< mAh
+    uint16_t eod_v; ///< End-of-discharge voltage in mV
+    uint16_t eoc_i; ///< Li-Ion end-of-charge current in mA
+    uint16_t eoc_dv; ///< Ni-MH end-of-charge voltage drop in mV
+};
+
+/** State of one cell of the replayed log */
+struct replay_cell {
+    uint8_t state; ///< State of the segment, 0 if there is none
+    uint32_t last_sec; ///< Seconds of the last record of the segment
+    uint16_t vmax; ///< Maximum voltage of the segment, for the -dV of Ni-MH
+    bool ended; ///< #step_end() was met in the segment
+    uint32_t end_sec; ///< Seconds of the record where #step_end() was met
+    bool dv_near; ///< Ni-MH charge: the -dV was reached within the #DV_ROUNDING of the log
+};
+
+/** Results of the replay */
+struct stats {
+    uint64_t lines;
+    uint64_t records;
+    uint32_t *lat; ///< Time of each line in ns
+    size_t nlat, cap;
+    uint32_t segments; ///< States checked
+    uint32_t agree; ///< States whose end agrees
+    uint32_t early; ///< States that the host ends before the firmware
+    uint32_t late; ///< States that the host ends after the firmware, or never
+    uint32_t unfinished; ///< States still open at the end of a log, not checked
+};
+
+static struct params                    par = { 0, 2000, 1000, 100, 10 };
+static struct params                    given; ///< Parameters given in the command line, 0 if not
+static struct replay_cell               cells[HOST_CELLS];
+static struct col_writer                *store[HOST_CELLS];
+static FILE                             *txt[HOST_CELLS];
+static struct stats                     st;
+static bool                             verbose = 0;
+static uint64_t                         last_ns;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**@brief Port of @p step_end() of the firmware, for the default steps of each state (@p profile_1 to
+@p profile_4)
+@return 1 if the step is finished
+*/
+static bool step_end(const struct replay_cell *c, const struct rec *r)
+{
+    switch (r->state)
+    {
+        case CHARGE: /// * #CHARGE: end of charge of the chemistry
+            if (par.li_ion) return r->i < par.eoc_i && r->q > 100;
+            return r->v + DV_ROUNDING < c->vmax - par.eoc_dv && r->q > 100; /// The -dV needs #DV_ROUNDING more, so the mV of the log do not end it early
+        case PREDISCHARGE: /// * #PREDISCHARGE and #DISCHARGE: voltage below the end-of-discharge voltage
+        case DISCHARGE:
+            return r->v < par.eod_v;
+        case POSTCHARGE: /// * #POSTCHARGE: half the capacity
+            return r->q >= (uint32_t) par.capacity * 10 / 2;
+    }
+    return 0;
+}
+
+/**@brief Compare the end decided by #step_end() with the last record of the segment. The log only has the
+voltage in mV, so a Ni-MH charge that the firmware ended by the -dV of @p vavg_hr also agrees if its -dV was
+reached within #DV_ROUNDING
+*/
+static void segment_end(uint8_t cell, struct replay_cell *c)
+{
+    const char *what = NULL;
+    if (c->state < PREDISCHARGE || c->state > POSTCHARGE) return;
+    st.segments++;
+    if ((!c->ended && !c->dv_near) || (c->ended && c->end_sec > c->last_sec + END_TOLERANCE))
+    {
+        st.late++;
+        what = "late";
+    }else if (c->ended && c->end_sec + END_TOLERANCE < c->last_sec)
+    {
+        st.early++;
+        what = "early";
+    }else st.agree++;
+    if (what && verbose)
+    {
+        if (c->ended) fprintf(stderr, "cell %u, state %u ended at %u s, host %s at %u s\n", cell, c->state,
+                              c->last_sec, what, c->end_sec);
+        else fprintf(stderr, "cell %u, state %u ended at %u s, host never\n", cell, c->state, c->last_sec);
+    }
+}
+
+/**@brief Count a segment that is still open at the end of a log, its end is not checked
+*/
+static void segment_open(uint8_t cell, const struct replay_cell *c)
+{
+    if (c->state < PREDISCHARGE || c->state > POSTCHARGE) return;
+    st.unfinished++;
+    if (verbose) fprintf(stderr, "cell %u, state %u still open at %u s, not checked\n", cell, c->state, c->last_sec);
+}
+
+/**@brief Take the parameters of the end of the steps from the menu printed by @p param()
+*/
+static void menu_line(const char *line)
+{
+    const char *s;
+    if ((s = strstr(line, "Nominal capacity: "))) par.capacity = (uint16_t) atoi(s + 18);
+    else if ((s = strstr(line, "End of discharge voltage: "))) par.eod_v = (uint16_t) atoi(s + 26);
+    else if ((s = strstr(line, "End of charge current: ")))
+    {
+        par.li_ion = 1; /// The chemistry is edited in the firmware, its end of charge tells how it ends
+        par.eoc_i = (uint16_t) atoi(s + 23);
+    }
+    else if ((s = strstr(line, "End of charge voltage drop: ")))
+    {
+        par.li_ion = 0;
+        par.eoc_dv = (uint16_t) atoi(s + 28);
+    }
+    if (given.capacity) par.capacity = given.capacity;
+    if (given.eod_v) par.eod_v = given.eod_v;
+    if (given.eoc_i) par.eoc_i = given.eoc_i;
+    if (given.eoc_dv) par.eoc_dv = given.eoc_dv;
+}
+
+/**@brief Handle one record as chargerd does, then check the end of the step. Called by #parser_feed()
+*/
+static void on_record(void *arg, const struct rec *r, const char *line)
+{
+    struct replay_cell *c;
+    uint64_t t;
+    (void) arg;
+    st.lines++;
+    if (r->type == REC_TEXT) menu_line(line);
+    else st.records++;
+    if (r->cell >= 1 && r->cell <= HOST_CELLS)
+    {
+        c = &cells[r->cell - 1];
+        switch (r->type)
+        {
+            case REC_LOG:
+                if (c->state && (r->state != c->state || r->time < c->last_sec)) /// A new segment checks the last one
+                {
+                    segment_end(r->cell, c);
+                    memset(c, 0, sizeof(*c));
+                }
+                c->state = r->state;
+                c->last_sec = r->time;
+                if (r->v > c->vmax) c->vmax = r->v;
+                if (r->state == CHARGE && !par.li_ion && r->v + par.eoc_dv <= c->vmax + DV_ROUNDING && r->q > 100)
+                    c->dv_near = 1;
+                if (!c->ended && step_end(c, r))
+                {
+                    c->ended = 1;
+                    c->end_sec = r->time;
+                }
+                if (store[r->cell - 1]) col_append(store[r->cell - 1], (uint32_t) st.lines, r);
+                break;
+            case REC_CHARGE:
+            case REC_END:
+                if (c->state && (r->type == REC_END || r->state == c->state)) /// The end of the step closes the segment
+                {
+                    segment_end(r->cell, c);
+                    memset(c, 0, sizeof(*c));
+                }
+                /* fall through */
+            case REC_RES:
+            case REC_CYCLE:
+                if (txt[r->cell - 1]) fprintf(txt[r->cell - 1], "%s\n", line);
+                break;
+            default:
+                break;
+        }
+    }
+    t = now_ns();
+    if (st.nlat == st.cap)
+    {
+        uint32_t *m = realloc(st.lat, (st.cap = st.cap ? st.cap * 2 : 65536) * sizeof(*st.lat));
+        if (!m) exit(1);
+        st.lat = m;
+    }
+    st.lat[st.nlat++] = (uint32_t) (t - last_ns < UINT32_MAX ? t - last_ns : UINT32_MAX);
+    last_ns = t;
+}
+
+/**@brief Open the writers of the store and of the text records of each cell in @p dir
+*/
+static void open_writers(const char *dir)
+{
+    char path[1024];
+    for (int k = 0; k < HOST_CELLS; k++)
+    {
+        snprintf(path, sizeof(path), "%s/cell%d", dir, k + 1);
+        store[k] = col_open(path, (uint8_t) (k + 1));
+        snprintf(path, sizeof(path), "%s/cell%d.txt", dir, k + 1);
+        txt[k] = fopen(path, "a");
+    }
+}
+
+static void close_writers(const char *dir, bool remove_files)
+{
+    char path[1024];
+    static const char *const suffix[] = { ".col", ".idx", ".txt" };
+    for (int k = 0; k < HOST_CELLS; k++)
+    {
+        col_close(store[k]);
+        if (txt[k]) fclose(txt[k]);
+        for (int s = 0; remove_files && s < 3; s++)
+        {
+            snprintf(path, sizeof(path), "%s/cell%d%s", dir, k + 1, suffix[s]);
+            unlink(path);
+        }
+    }
+    if (remove_files) rmdir(dir);
+}
+
+static char *load(const char *path, size_t *n)
+{
+    FILE *f = fopen(path, "rb");
+    char *buf;
+    long len;
+    if (!f)
+    {
+        perror(path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc((size_t) len + 1);
+    if (!buf || fread(buf, 1, (size_t) len, f) != (size_t) len)
+    {
+        perror(path);
+        exit(1);
+    }
+    fclose(f);
+    *n = (size_t) len;
+    return buf;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(double p)
+{
+    size_t k = (size_t) (p / 100.0 * (double) (st.nlat - 1) + 0.5);
+    return st.lat[k];
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [-n times] [-o dir] [-C mAh] [-E mV] [-I mA] [-D mV] [-v] log...\n"
+        "  -n  replay the logs this many times (default 1)\n"
+        "  -o  directory of the store and text records (default a temporary one, removed at the end)\n"
+        "  -C  capacity, -E end-of-discharge voltage, -I Li-Ion end-of-charge current, -D Ni-MH end-of-charge\n"
+        "      voltage drop (default: as printed by the menu of the log)\n"
+        "  -v  print the states whose end does not agree\n",
+        prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct parser p;
+    char tmp[] = "/tmp/replayXXXXXX";
+    const char *dir = NULL;
+    char **buf;
+    size_t *len, bytes = 0;
+    int opt, times = 1, nfiles;
+    uint64_t start, elapsed;
+    while ((opt = getopt(argc, argv, "n:o:C:E:I:D:vh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                if ((times = atoi(optarg)) < 1) usage(argv[0]);
+                break;
+            case 'o':
+                dir = optarg;
+                break;
+            case 'C':
+                given.capacity = (uint16_t) atoi(optarg);
+                break;
+            case 'E':
+                given.eod_v = (uint16_t) atoi(optarg);
+                break;
+            case 'I':
+                given.eoc_i = (uint16_t) atoi(optarg);
+                break;
+            case 'D':
+                given.eoc_dv = (uint16_t) atoi(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc) usage(argv[0]);
+    nfiles = argc - optind;
+    buf = calloc((size_t) nfiles, sizeof(*buf));
+    len = calloc((size_t) nfiles, sizeof(*len));
+    for (int f = 0; f < nfiles; f++)
+    {
+        buf[f] = load(argv[optind + f], &len[f]);
+        bytes += len[f];
+    }
+    if (!dir && !(dir = mkdtemp(tmp)))
+    {
+        perror(tmp);
+        return 1;
+    }
+    open_writers(dir);
+    start = now_ns();
+    for (int n = 0; n < times; n++)
+    {
+        for (int f = 0; f < nfiles; f++) /// Each log starts with the cells and the parameters of the menu reset
+        {
+            memset(cells, 0, sizeof(cells));
+            par = (struct params) { 0, 2000, 1000, 100, 10 };
+            menu_line("");
+            parser_init(&p);
+            last_ns = now_ns();
+            parser_feed(&p, buf[f], len[f], on_record, NULL);
+            for (int k = 0; k < HOST_CELLS; k++) if (cells[k].state) segment_open((uint8_t) (k + 1), &cells[k]);
+        }
+    }
+    for (int k = 0; k < HOST_CELLS; k++) col_flush(store[k]);
+    elapsed = now_ns() - start;
+    close_writers(dir, dir == tmp);
+    if (!st.nlat)
+    {
+        fprintf(stderr, "no lines\n");
+        return 1;
+    }
+    qsort(st.lat, st.nlat, sizeof(*st.lat), cmp_u32);
+    printf("replayed %d file(s) x %d: %zu bytes, %llu lines, %llu records in %.3f s\n", nfiles, times, bytes,
+           (unsigned long long) st.lines, (unsigned long long) st.records, (double) elapsed / 1e9);
+    printf("throughput: %.0f lines/s, %.1f MB/s\n", (double) st.lines * 1e9 / (double) elapsed,
+           (double) bytes * times * 1e3 / (double) elapsed);
+    printf("time per line (ns): p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n", percentile(50), percentile(90),
+           percentile(99), percentile(99.9), st.lat[st.nlat - 1]);
+    printf("end of states: %u checked, %u agree, %u early, %u late, %u unfinished\n", st.segments, st.agree, st.early,
+           st.late, st.unfinished);
+    free(st.lat);
+    return st.agree != st.segments;
+}
@@ -26,37 +26,74 @@ void main(void) /// This function performs the folowing tasks:
     __delay_ms(10);
     while(1) /// <li> <b> The main loop repeats the following forever: </b> 
     {
-        if (SECF) /// <ul> <li> Check the #SECF flag, if it is set, 1 second has passed since last execution, so the folowing task are executed:
+        if (CMDF) command(); /// <ul> <li> Check the #CMDF flag, if it is set, run the received command line with #command()
+        if (FAULTF) trip_report(); /// <li> Check the #FAULTF flag, if it is set, the ISR tripped the protection, report it with #trip_report() before the #state_machine can turn #conv on again
+        if (SECF) /// <li> Check the #SECF flag, if it is set, 1 second has passed since last execution, so the folowing task are executed:
         {     
             SECF = 0; /// <ol> <li> Clear the #SECF flag to restart the 1 second timer
             scaling(); /// <li> Scale the average measured values by calling the #scaling function 
             log_control(); /// <li> Print the log in the serial terminal by calling the #log_control function
-            cc_cv_mode(vavg, cvref, cmode); /// <li> Check if the system shall change to CV mode by calling the #cc_cv_mode function
+            cc_cv_mode(vavg, cvref, ctl.cmode); /// <li> Check if the system shall change to CV mode by calling the #cc_cv_mode function
+            temp_protection(); /// <li> Call the #temp_protection function, before the #state_machine can block in a menu and leave #tavg unscaled
             state_machine(); /// <li> Call the #state_machine function
-            temp_protection(); /// <li> Call the #temp_protection function </ol> </ul> </ul>
+            checkpoint(); /// <li> Save the context of a running test every #CKPT_SECS seconds by calling the #checkpoint function
+            if (diag_on) diag_report(); /// <li> If #diag_on is set, report the timing of the ISR by calling #diag_report() </ol>
         }
+        if (STREAMF) /// <li> Check the #STREAMF flag, if it is set, a streamed sample is ready:
+        {
+            STREAMF = 0; /// <ol> <li> Clear the #STREAMF flag
+            stream_send(); /// <li> Send it by calling the #stream_send function </ol> </ul> </ul>
+        }
+        MAIN_IDLE();
 	}
 }
 
-/**@brief <b> This is the interruption service function. It will interrupt the code whenever the Timer1 overflow (0.975625 milliseconds) or when any character is received from the serial terminal via UART. </b>
+/**@brief <b> This is the interruption service function. It will interrupt the code whenever the Timer1 overflow (#ADC_SLOTS times every 0.975625 milliseconds), when an ADC conversion is finished or when any character is received from the serial terminal via UART. </b>
 */
 void __interrupt() ISR(void) /// This function performs the folowing tasks: 
 {
     char recep = 0;
+    DIAG_START(); /// <li> Take the entry time for #diag with #DIAG_START()
     
     if(TMR1IF) /// <li> Check the @b Timer1 interrupt flag, if it is set, the folowing task are executed:
     {
-        TMR1H = 0xE1; // TMR1 clock is Fosc/4= 8Mhz (Tick= 0.125us). TMR1IF is set when the 16-bit register overflows. 7805 x 0.125us = 0.975625 ms.
-        TMR1L = 0x83;/// <ol> <li> Load the @b Timer1 16-bit register so it overflow every 0.975625 ms 
+        DIAG_LATENCY(); /// <ol> <li> Keep the cycles since the overflow in diag::lat with #DIAG_LATENCY()
+        TMR1H = TMR1_RELOAD >> 8; // TMR1 clock is Fosc/4= 8Mhz (Tick= 0.125us). TMR1IF is set when the 16-bit register overflows. 7805 x 0.125us = 0.975625 ms.
+        TMR1L = TMR1_RELOAD & 0xFF;/// <li> Load the @b Timer1 16-bit register so it overflow #ADC_SLOTS times every 0.975625 ms 
+        DIAG_RELOAD(); /// <li> Move the entry time of #diag to the reloaded count with #DIAG_RELOAD()
         TMR1IF = 0; /// <li> Clear the @b Timer1 interrupt flag
-        v = read_ADC(V_CHAN); /// <li> Read the ADC channel #V_CHAN and store the value in #v. Using the #read_ADC() function
-        i = read_ADC(I_CHAN); /// <li> Read the ADC channel #I_CHAN and store the value in #i. Using the #read_ADC() function
-        i = (uint16_t) (abs ( 2048 - (int)i ) ); /// <li> Substract the 2.5V bias from #i, store the absolute value in #i   
-        t = read_ADC(T_CHAN); /// <li> Read the ADC channel #T_CHAN and store the value in #t. Using the #read_ADC() function 
-        if (conv) control_loop(); /// <li> Call the #control_loop() function
-        calculate_avg(); /// <li> Call the #calculate_avg() function
-        timing(); /// <li> Call the #timing() function
-        if (TMR1IF) UART_send_string((char*)"TIMING_ERROR"); /// <li> If the @b Timer1 interrupt flag is set, there is a timing error, print "TIMING_ERROR" into the terminal. </ol>
+        GO_nDONE = 1; /// <li> Start the conversion of the channel selected by #select_ADC(). The result is collected in the ADC interrupt </ol>
+    }
+
+    if(ADIF) /// <li> Check the @b ADC interrupt flag, if it is set, the folowing task are executed:
+    {
+        ADIF = 0; /// <ol> <li> Clear the @b ADC interrupt flag
+        store_ADC(); /// <li> Store the result in #v, #i or #t. Using the #store_ADC() function
+        if (conv && !fault && !RELAY_BUSY()) trip_check(); /// <li> If the converter is on, compare the result with its limit with #trip_check()
+        DIAG_SPLIT(diag.adc); /// <li> Keep the cycles of the ADC read in diag::adc with #DIAG_SPLIT()
+        if (adc_slot == 0) /// <li> If this was the conversion of the controlled variable (slot 0):
+        {
+            if (conv && !fault && !RELAY_BUSY()) /// - If the converter is on, no #fault is latched and the relays settled (#RELAY_BUSY()):
+            {
+                control_loop(); /// + Call the #control_loop() function
+                coulomb_count(); /// + Count the charge of this period with #coulomb_count()
+                DIAG_SPLIT(diag.loop); /// + Keep the cycles of the control loop in diag::loop
+            }
+            calculate_avg(); /// - Call the #calculate_avg() function
+            timing(); /// - Call the #timing() function
+            DIAG_SPLIT(diag.avg); /// - Keep the cycles of the averaging in diag::avg
+            relay_tick(); /// - Run the next step of the relay sequencer with #relay_tick()
+        }
+        if (++adc_slot >= ADC_SLOTS) adc_slot = 0; /// <li> Go to the next slot
+        select_ADC(); /// <li> Select the channel of the next conversion by calling #select_ADC()
+        if (TMR1IF) diag.overruns++; /// <li> If the @b Timer1 interrupt flag is set, there is a timing error, count it in diag::overruns. </ol>
+    }
+
+    if(TXIE && TXIF) /// <li> Check the @b UART transmission interrupt, if it is enabled and the transmission register is empty:
+    {
+        TX1REG = tx_buf[tx_tail]; /// <ol> <li> Load the next byte from #tx_buf
+        tx_tail = (tx_tail + 1) & (TX_BUF_SIZE - 1);
+        if (tx_tail == tx_head) TXIE = 0; /// <li> Disable the interrupt when #tx_buf is empty </ol>
     }
 
     if(RCIF)/// <li> Check the @b UART reception interrupt flag, if it is set, the folowing task are executed:
@@ -66,19 +103,46 @@ void __interrupt() ISR(void) /// This function performs the folowing tasks:
             RC1STAbits.CREN = 0;  
             RC1STAbits.CREN = 1; 
         }
-        while(RCIF) recep = RC1REG; /// <li> Store the received character
-        switch (recep)
+        while(RCIF) /// <li> Read every received character, the UART buffers two
         {
-        case 0x63: /// <li> If a @b "c" was received, the process shall stop, then:
-            STOP_CONVERTER(); /// - Stop the converter by calling the #STOP_CONVERTER() macro
-            state = STANDBY; /// - Go to #STANDBY state
-            break;
-        case 0x6E: /// <li> If @p an @b "n" was received, the system shall jump to the next cell, then:
-            STOP_CONVERTER(); /// - Stop the converter by calling the #STOP_CONVERTER() macro
-            state = ISDONE; /// - Go to #ISDONE state
-            break;
-        default: /// <li> In any other case, do nothing
-            recep = 0; 
-        } /// </ol> </ul>
+            recep = RC1REG;
+            if (cmd_rx(recep)) continue; /// <li> Give the bytes of a command line to #cmd_rx(), the line runs in the main loop
+            switch (recep)
+            {
+            case 0x63: /// <li> If a @b "c" was received, the process shall stop, then:
+                STOP_CONVERTER(); /// - Stop the converter by calling the #STOP_CONVERTER() macro
+                ctx->state = STANDBY; /// - Go to #STANDBY state
+                break;
+            case 0x6E: /// <li> If @p an @b "n" was received, the system shall jump to the next cell, then:
+                STOP_CONVERTER(); /// - Stop the converter by calling the #STOP_CONVERTER() macro
+                ctx->state = ISDONE; /// - Go to #ISDONE state
+                break;
+            case 0x62: /// <li> If a @b "b" was received, switch between the ASCII log and the binary frames
+                log_bin = !log_bin;
+                break;
+            case 0x68: /// <li> If an @b "h" was received, go to the next streaming rate (off, 16, 32, 64 Hz, off...) with #stream_select()
+                if (!stream_rate) stream_select(STREAM_RATE_MIN);
+                else if (stream_rate < STREAM_RATE_MAX) stream_select(stream_rate + 1);
+                else stream_select(0);
+                break;
+            case 0x48: /// <li> If an @b "H" was received, stream all the states or only the default ones (#STREAM_STATES_DEFAULT)
+                stream_states = (stream_states == 0xFFFF) ? STREAM_STATES_DEFAULT : 0xFFFF;
+                break;
+            case 0x64: /// <li> If a @b "d" was received, switch the timing report of #diag_report() on and off, starting with a clear #diag
+                diag_on = !diag_on;
+                memset(&diag, 0, sizeof(diag));
+                break;
+            case 0x1B: /// <li> If an @b ESC was received in #remote mode while the board is stopped, leave the #remote mode and show the menu again
+                if (remote && ctx->state == STANDBY)
+                {
+                    remote = 0;
+                    SECF = 1;
+                }
+                break;
+            default: /// <li> In any other case, do nothing
+                recep = 0; 
+            }
+        } /// </ol>
     }  
+    DIAG_END(); /// <li> Add the cycles from the entry to the exit to #diag with #DIAG_END() </ul>
 }
\ No newline at end of file
@@ -0,0 +1,21 @@
+/**
+ * @file firmware.c
+ * @author Juan J. Rojas
+ * @date 17 Oct 2026
+ * @brief Firmware sources compiled as a single translation unit for the host simulation.
+ * @par Institution:
+ * LaSEINE / CeNT. Kyushu Institute of Technology.
+ * @par Mail (after leaving Kyutech):
+ * juan.rojas@tec.ac.cr
+ * @par Git repository:
+ * https://bitbucket.org/juanjorojash/cell_charger_discharger
+ *
+ * The firmware defines its variables in @p charger_discharger.h, so the sources are included here instead of
+ * being linked separately. @p main() is renamed so the simulator can call it.
+ */
+
+#define main firmware_main
+#include "../main.c"
+#undef main
+#include "../charger_discharger.c"
+#include "../state_machine.c"
@@ -0,0 +1,192 @@
+/**
+ * @file plant.c
+ * @author Juan J. Rojas
+ * @date 17 Oct 2026
+ * @brief Cell and converter models for the host simulation.
+ * @par Institution:
+ * LaSEINE / CeNT. Kyushu Institute of Technology.
+ * @par Mail (after leaving Kyutech):
+ * juan.rojas@tec.ac.cr
+ * @par Git repository:
+ * https://bitbucket.org/juanjorojash/cell_charger_discharger
+ *
+ * Each cell is an open-circuit-voltage curve plus a series resistance and one RC polarization branch, with a
+ * first-order thermal model. The converter is reduced to a first-order current response: in charge the buck
+ * output (duty cycle times the bus voltage) drives current through the charge path resistance, in discharge
+ * the boost stage behaves like a load proportional to the duty cycle.
+ */
+
+#include <math.h>
+#include "sim.h"
+
+/**@brief Linear interpolation in a table of 11 points evenly spaced between 0 and 1
+*/
+static double table11(const double *tab, double soc)
+{
+    double x = soc * 10.0;
+    int k;
+    if (x <= 0.0) return tab[0] + soc * 5.0; /// Below empty the voltage collapses quickly
+    if (x >= 10.0) return tab[10];
+    k = (int) x;
+    return tab[k] + (tab[k + 1] - tab[k]) * (x - k);
+}
+
+static double li_ion_ocv(double soc)
+{
+    static const double tab[11] = { 3.00, 3.45, 3.55, 3.62, 3.68, 3.74, 3.80, 3.88, 3.96, 4.05, 4.18 };
+    return table11(tab, soc) + (soc > 1.0 ? (soc - 1.0) * 2.0 : 0.0);
+}
+
+static double ni_mh_ocv(double soc)
+{
+    static const double tab[11] = { 1.00, 1.20, 1.24, 1.26, 1.27, 1.28, 1.29, 1.30, 1.32, 1.36, 1.42 };
+    return table11(tab, soc);
+}
+
+/**@brief Ni-MH voltage drop after full charge, this is what the -dV end-of-charge detection looks for
+*/
+static double ni_mh_overcharge(double soc, double amps)
+{
+    if (soc <= 1.0 || amps <= 0.0) return 0.0;
+    return -0.3 * (soc - 1.0);
+}
+
+const struct sim_chem sim_li_ion = {
+    "li_ion", 3.25, 0.050, 0.030, 60.0, li_ion_ocv, NULL, 1.0, 1.5
+};
+
+const struct sim_chem sim_ni_mh = {
+    "ni_mh", 2.0, 0.030, 0.020, 60.0, ni_mh_ocv, ni_mh_overcharge, 1.0, 0.3
+};
+
+/**@brief Initialize the plant with four cells of the same chemistry at state of charge @p soc
+*/
+void sim_plant_init(struct sim_plant *p, const struct sim_chem *chem, double soc)
+{
+    int k;
+    p->vbus = 9.0;
+    p->amps = 0.0;
+    p->tau_conv = 0.002;
+    p->ambient = 25.0;
+    p->r_th = 10.0;
+    p->c_th = 40.0;
+    p->noise_lsb = 2.0;
+    p->dir = SIM_DIR_NONE;
+    p->dc = 0;
+    p->seed = 12345;
+    for (k = 0; k < SIM_CELLS; k++)
+    {
+        p->cell[k].chem = chem;
+        p->cell[k].q = soc * chem->capacity_ah * 3600.0;
+        p->cell[k].vp = 0.0;
+        p->cell[k].temp = p->ambient;
+        p->cell[k].temp_max = p->ambient;
+        p->cell[k].q_in = 0.0;
+        p->cell[k].q_out = 0.0;
+    }
+}
+
+static double soc_of(const struct sim_cell *c)
+{
+    return c->q / (c->chem->capacity_ah * 3600.0);
+}
+
+/**@brief Terminal voltage of @p cell in V
+*/
+double sim_plant_volts(const struct sim_plant *p, int cell)
+{
+    const struct sim_cell *c = &p->cell[cell];
+    double soc = soc_of(c);
+    double amps = p->amps;
+    double v = c->chem->ocv(soc) + c->vp;
+    v += amps * c->chem->r0;
+    if (c->chem->overcharge) v += c->chem->overcharge(soc, amps);
+    return v > 0.0 ? v : 0.0;
+}
+
+/**@brief Advance the plant @p dt seconds. @p cell is the cell selected by the switcher board, -1 if none, and it
+* is connected to the converter when @p connected is set (main relay closed).
+*/
+void sim_plant_step(struct sim_plant *p, int cell, bool connected, double dt)
+{
+    double target = 0.0;
+    double d = (double) p->dc / SIM_PWM_PERIOD;
+    int k;
+    if (dt <= 0.0) return;
+    if (connected && cell >= 0)
+    {
+        struct sim_cell *c = &p->cell[cell];
+        double emf = c->chem->ocv(soc_of(c)) + c->vp;
+        if (p->dir == SIM_DIR_CHARGE)
+        {
+            target = (d * p->vbus - emf) / (c->chem->r_path + c->chem->r0);
+            if (target < 0.0) target = 0.0; /// The buck converter cannot sink current
+        }else if (p->dir == SIM_DIR_DISCHARGE)
+        {
+            target = - d * emf / c->chem->r_load;
+        }
+    }
+    p->amps += (target - p->amps) * -expm1(-dt / p->tau_conv);
+    if (fabs(p->amps) < 1e-6) p->amps = 0.0;
+    for (k = 0; k < SIM_CELLS; k++)
+    {
+        struct sim_cell *c = &p->cell[k];
+        double amps = (k == cell) ? p->amps : 0.0;
+        double heat = amps * amps * (c->chem->r0 + c->chem->r1);
+        double soc = soc_of(c);
+        if (amps == 0.0 && c->vp == 0.0 && c->temp == p->ambient) continue;
+        if (amps > 0.0 && soc > 1.0 && c->chem->overcharge)
+        {
+            double excess = (soc - 1.0) * 10.0;
+            heat += amps * 1.4 * (excess > 1.0 ? 1.0 : excess); /// Overcharge energy is turned into heat
+        }
+        c->q += amps * dt;
+        if (amps > 0.0) c->q_in += amps * dt;
+        else c->q_out -= amps * dt;
+        c->vp += (amps * c->chem->r1 - c->vp) * -expm1(-dt / c->chem->tau1);
+        if (fabs(c->vp) < 1e-7) c->vp = 0.0;
+        c->temp += (p->ambient + heat * p->r_th - c->temp) * -expm1(-dt / (p->r_th * p->c_th));
+        if (fabs(c->temp - p->ambient) < 1e-6) c->temp = p->ambient;
+        if (c->temp > c->temp_max) c->temp_max = c->temp;
+    }
+}
+
+/**@brief Triangular noise between -@p peak and +@p peak
+*/
+static double noise(struct sim_plant *p, double peak)
+{
+    double a, b;
+    p->seed = p->seed * 1103515245u + 12345u;
+    a = (double) ((p->seed >> 16) & 0x7FFF) / 32767.0;
+    p->seed = p->seed * 1103515245u + 12345u;
+    b = (double) ((p->seed >> 16) & 0x7FFF) / 32767.0;
+    return (a + b - 1.0) * peak;
+}
+
+/**@brief Result of a 12-bit conversion of the analog @p channel with the connected @p cell, -1 if none
+*/
+uint16_t sim_plant_adc(struct sim_plant *p, int cell, uint8_t channel)
+{
+    double counts = 0.0;
+    switch (channel)
+    {
+        case 10: /// AN10 (RB1), voltage sense behind the cell switcher
+            if (cell >= 0) counts = sim_plant_volts(p, cell) * 4096.0 / 5.0;
+            break;
+        case 12: /// AN12 (RB0), current sensor biased at 2.5 V with 0.4 V/A
+            counts = 2048.0 + p->amps * 0.4 * 4096.0 / 5.0;
+            break;
+        case 4: /// AN4 (RA5), temperature sensor
+        {
+            double temp = (cell >= 0) ? p->cell[cell].temp : p->ambient;
+            counts = (1866.3 - 11.69 * temp) * 4096.0 / 5000.0;
+            break;
+        }
+        default:
+            break;
+    }
+    counts += noise(p, p->noise_lsb);
+    if (counts < 0.0) counts = 0.0;
+    if (counts > 4095.0) counts = 4095.0;
+    return (uint16_t) (counts + 0.5);
+}
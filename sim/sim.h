@@ -0,0 +1,109 @@
+/**
+ * @file sim.h
+ * @author Juan J. Rojas
+ * @date 17 Oct 2026
+ * @brief Host simulation header file: simulated HAL, cell models and converter model.
+ * @par Institution:
+ * LaSEINE / CeNT. Kyushu Institute of Technology.
+ * @par Mail (after leaving Kyutech):
+ * juan.rojas@tec.ac.cr
+ * @par Git repository:
+ * https://bitbucket.org/juanjorojash/cell_charger_discharger
+ */
+
+#ifndef SIM_H
+    #define SIM_H
+    #include <stdint.h>
+    #include <stdbool.h>
+    #include <stdio.h>
+
+    #define     SIM_CELLS               4 ///< Cells in the switcher board (relays @p RB2 to @p RB5)
+    #define     SIM_NS_PER_US           1000ULL
+    #define     SIM_NS_PER_S            1000000000ULL
+    #define     SIM_TMR1_TICK_NS        125 ///< Timer1 clock is FOSC/4 = 8 MHz
+    #define     SIM_ADC_CONV_NS         15000 ///< 12-bit conversion at FOSC/32 (15 TAD of 1 us)
+    #define     SIM_UART_BYTE_NS        173611 ///< 10 bits at 57600 bps
+    #define     SIM_PWM_PERIOD          512 ///< PSMC1 period, 511 + 1 clock cycles
+    #define     SIM_MAX_KEYS            256 ///< Maximum number of scripted key presses
+    #define     SIM_EEPROM_SIZE         256 ///< Bytes of data EEPROM of the PIC16F1786
+    #define     SIM_EEPROM_WRITE_US     4000 ///< Self-timed write of one byte (4 ms maximum)
+
+    /** Direction of the latching charge/discharge relay (pulsed by @p RC4 / @p RC3) */
+    enum sim_dir { SIM_DIR_NONE = 0, SIM_DIR_CHARGE, SIM_DIR_DISCHARGE };
+
+    /** @brief Pluggable cell chemistry. All voltages in V, currents in A, charge in As. */
+    struct sim_chem {
+        const char *name; ///< Name used in the command line
+        double capacity_ah; ///< Nominal capacity
+        double r0; ///< Series resistance in ohm
+        double r1; ///< Polarization resistance in ohm
+        double tau1; ///< Polarization time constant in s
+        double (*ocv)(double soc); ///< Open circuit voltage as a function of the state of charge
+        double (*overcharge)(double soc, double amps); ///< Extra voltage drop and heat source above full charge
+        double r_path; ///< Charge path resistance seen by the buck converter in ohm
+        double r_load; ///< Equivalent discharge load of the boost converter at full duty cycle in ohm
+    };
+
+    /** @brief State of one cell in the switcher board */
+    struct sim_cell {
+        const struct sim_chem *chem; ///< Chemistry of the cell
+        double q; ///< Stored charge in As
+        double vp; ///< Polarization voltage in V
+        double temp; ///< Temperature in Celsius
+        double temp_max; ///< Maximum temperature seen in Celsius
+        double q_in; ///< Total charge delivered to the cell in As
+        double q_out; ///< Total charge taken from the cell in As
+    };
+
+    /** @brief Buck/boost converter and board */
+    struct sim_plant {
+        struct sim_cell cell[SIM_CELLS]; ///< Cells in the switcher board
+        double vbus; ///< Input bus voltage of the buck converter in V
+        double amps; ///< Converter current, positive when charging, in A
+        double tau_conv; ///< Converter current time constant in s
+        double ambient; ///< Ambient temperature in Celsius
+        double r_th; ///< Cell thermal resistance in K/W
+        double c_th; ///< Cell thermal capacity in J/K
+        double noise_lsb; ///< Peak ADC noise in LSB
+        enum sim_dir dir; ///< Position of the charge/discharge relay
+        uint16_t dc; ///< Duty cycle loaded in the PSMC
+        uint32_t seed; ///< Noise generator state
+    };
+
+    /** @brief Statistics gathered during a simulated run */
+    struct sim_stats {
+        uint64_t isr_calls; ///< Number of calls to the interrupt service routine
+        uint64_t tmr1_overflows; ///< Number of Timer1 overflows
+        uint64_t tmr1_missed; ///< Timer1 overflows that happened while the flag was still set
+        uint64_t adc_conversions; ///< Number of ADC conversions
+        uint64_t tx_bytes; ///< Bytes sent by the firmware
+        uint64_t rx_bytes; ///< Bytes received by the firmware
+        uint64_t isr_ns; ///< Simulated time spent inside the interrupt service routine
+        uint64_t isr_max_ns; ///< Longest interrupt service routine
+    };
+
+    extern uint64_t                     sim_now; ///< Simulated time in ns
+    extern uint64_t                     sim_end; ///< Simulated time limit in ns
+    extern struct sim_plant             sim_plant;
+    extern struct sim_stats             sim_stats;
+    extern FILE                         *sim_out; ///< Destination of the UART output
+    extern int                          sim_pty; ///< Pseudo-terminal that replaces the serial port, -1 if none
+    extern const char                   *sim_eeprom_file; ///< File that keeps the data EEPROM between runs, NULL if none
+
+    extern const struct sim_chem        sim_li_ion;
+    extern const struct sim_chem        sim_ni_mh;
+
+    void sim_plant_init(struct sim_plant *p, const struct sim_chem *chem, double soc);
+    void sim_plant_step(struct sim_plant *p, int cell, bool connected, double dt);
+    double sim_plant_volts(const struct sim_plant *p, int cell);
+    uint16_t sim_plant_adc(struct sim_plant *p, int cell, uint8_t channel);
+
+    void sim_key_at(uint64_t at, uint8_t key);
+    void sim_keys(const char *keys);
+    const char *sim_pty_open(void);
+    void sim_run(void);
+    void sim_finish(const char *why);
+
+    void ISR(void); ///< Firmware interrupt service routine
+    void firmware_main(void); ///< Firmware @p main(), renamed by the host build
+#endif /* SIM_H */
@@ -0,0 +1,545 @@
+/**
+ * @file sim_hal.c
+ * @author Juan J. Rojas
+ * @date 17 Oct 2026
+ * @brief Simulated hardware for the host build: registers, time base, Timer1, ADC, PSMC, relays and UART.
+ * @par Institution:
+ * LaSEINE / CeNT. Kyushu Institute of Technology.
+ * @par Mail (after leaving Kyutech):
+ * juan.rojas@tec.ac.cr
+ * @par Git repository:
+ * https://bitbucket.org/juanjorojash/cell_charger_discharger
+ *
+ * The firmware runs unmodified on the host. Simulated time only moves inside the hooks called by the
+ * firmware (delays, ADC conversions, UART polling and the idle main loop), instruction execution itself
+ * is free. Whenever time moves the plant is integrated, the peripherals are updated and, if enabled, the
+ * firmware #ISR() is called just like the interrupt controller would do.
+ */
+
+#define     _GNU_SOURCE ///< posix_openpt() and cfmakeraw()
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include "xc.h"
+#include "sim.h"
+
+#define     SIM_REG(name)               volatile uint8_t name;
+#include "sim_regs.def"
+#undef      SIM_REG
+
+volatile sim_adcon0_t                   ADCON0bits;
+volatile sim_adcon1_t                   ADCON1bits;
+volatile sim_adcon2_t                   ADCON2bits;
+volatile sim_osccon_t                   OSCCONbits;
+volatile sim_psmc1con_t                 PSMC1CONbits;
+volatile sim_rc1sta_t                   RC1STAbits;
+
+#define     SIM_ISR_NS                  1000 ///< Interrupt latency plus context save and restore
+#define     SIM_KEY_GAP_NS              20000000ULL ///< Delay between typed keys (20 ms)
+#define     SIM_POLL_NS                 1000000ULL ///< Time step of a blocking poll with nothing to wait for (1 ms)
+#define     SIM_INPUT_WAIT_NS           (10 * SIM_NS_PER_S) ///< Blocking for input longer than this ends the run
+#define     SIM_PTY_POLL_NS             10000000ULL ///< Period of the check for received bytes on the pseudo-terminal (10 ms)
+
+/** Last hook called by the firmware, used to detect busy-wait loops */
+enum sim_hook { HOOK_NONE = 0, HOOK_DELAY, HOOK_IDLE, HOOK_ADC, HOOK_RCIF, HOOK_RXREG, HOOK_TXIF, HOOK_TXREG };
+
+/** Scripted key press */
+struct sim_key {
+    uint64_t at; ///< Absolute time for timed keys
+    uint8_t key; ///< Character received by the firmware
+};
+
+uint64_t                                sim_now = 0;
+uint64_t                                sim_end = UINT64_MAX;
+struct sim_plant                        sim_plant;
+struct sim_stats                        sim_stats;
+FILE                                    *sim_out = NULL;
+int                                     sim_pty = -1;
+const char                              *sim_eeprom_file = NULL;
+
+static enum sim_hook                    last_hook = HOOK_NONE;
+static bool                             in_isr = 0;
+static uint64_t                         plant_time = 0; ///< Time up to which the plant has been integrated
+static int                              plant_cell = -1; ///< Cell connected to the plant during the last integration
+static bool                             plant_on = 0; ///< Main relay (RC5) during the last integration
+static clock_t                          wall_start;
+//Timer1
+static uint64_t                         tmr1_base_time = 0; ///< Time at which Timer1 had the value #tmr1_base_val
+static uint16_t                         tmr1_base_val = 0;
+static uint16_t                         tmr1_shadow = 0; ///< Value last published in TMR1H:TMR1L
+static bool                             tmr1_running = 0;
+//ADC
+static volatile uint8_t                 adc_go = 0;
+static bool                             adc_busy = 0;
+static uint64_t                         adc_done_at = 0;
+static uint8_t                          adc_chan = 0;
+//UART
+static volatile uint8_t                 tx_reg = 0;
+static bool                             tx_full = 0;
+static uint64_t                         tsr_free_at = 0;
+static uint8_t                          rx_byte = 0;
+static bool                             rx_full = 0;
+static uint64_t                         rx_taken_at = 0;
+static uint64_t                         input_wait = 0; ///< Time spent blocked waiting for input without keys left
+static struct sim_key                   typed[SIM_MAX_KEYS];
+static unsigned                         typed_n = 0, typed_idx = 0;
+static struct sim_key                   timed[SIM_MAX_KEYS];
+static unsigned                         timed_n = 0, timed_idx = 0;
+static uint64_t                         pty_poll_at = 0; ///< Next check of #sim_pty for received bytes
+static bool                             pty_used = 0; ///< A byte was received from #sim_pty
+
+/**@brief Index of the cell connected by the switcher board, -1 if none (or more than one)
+*/
+static int connected_cell(void)
+{
+    int n = RB2 + RB3 + RB4 + RB5;
+    if (n != 1) return -1;
+    if (RB2) return 0;
+    if (RB3) return 1;
+    if (RB4) return 2;
+    return 3;
+}
+
+static uint64_t tmr1_tick(void)
+{
+    return (uint64_t) SIM_TMR1_TICK_NS << ((T1CKPS1 << 1) | T1CKPS0);
+}
+
+static uint16_t tmr1_value(void)
+{
+    if (!tmr1_running) return tmr1_base_val;
+    return (uint16_t) (tmr1_base_val + (sim_now - tmr1_base_time) / tmr1_tick());
+}
+
+static uint64_t tmr1_overflow_at(void)
+{
+    return tmr1_base_time + (65536ULL - tmr1_base_val) * tmr1_tick();
+}
+
+static void tmr1_publish(void)
+{
+    tmr1_shadow = tmr1_value();
+    TMR1H = tmr1_shadow >> 8;
+    TMR1L = tmr1_shadow & 0xFF;
+}
+
+/**@brief Integrate the plant up to the current time with the inputs it had since the last integration
+*/
+static void plant_catch_up(void)
+{
+    sim_plant_step(&sim_plant, plant_cell, plant_on, (double) (sim_now - plant_time) / SIM_NS_PER_S);
+    plant_time = sim_now;
+}
+
+/**@brief Pick up everything the firmware wrote to the registers since the last hook
+*/
+static void hal_sync(void)
+{
+    int cell = connected_cell();
+    uint16_t dc = sim_plant.dc;
+    enum sim_dir dir = sim_plant.dir;
+    uint16_t reg = (uint16_t) ((TMR1H << 8) | TMR1L);
+    if (reg != tmr1_shadow) /// A write to TMR1H:TMR1L restarts the count from the written value
+    {
+        tmr1_base_val = reg;
+        tmr1_base_time = sim_now;
+        tmr1_shadow = reg;
+    }
+    if ((bool) TMR1ON != tmr1_running)
+    {
+        tmr1_base_val = tmr1_value();
+        tmr1_base_time = sim_now;
+        tmr1_running = TMR1ON;
+    }
+    if (PSMC1CONbits.PSMC1LD) /// The PSMC loads the duty cycle buffers and clears the load bit
+    {
+        dc = (uint16_t) (((PSMC1DCH & 0x01) << 8) | PSMC1DCL);
+        PSMC1CONbits.PSMC1LD = 0;
+    }
+    if (RC4) dir = SIM_DIR_CHARGE; /// The charge/discharge relay latches on a pulse
+    if (RC3) dir = SIM_DIR_DISCHARGE;
+    if (cell != plant_cell || (bool) RC5 != plant_on || dc != sim_plant.dc || dir != sim_plant.dir)
+    {
+        plant_catch_up(); /// The plant is only integrated when its inputs change or when it is sampled
+        plant_cell = cell;
+        plant_on = RC5;
+        sim_plant.dc = dc;
+        sim_plant.dir = dir;
+    }
+    if (adc_go && !adc_busy && ADCON0bits.ADON)
+    {
+        adc_busy = 1;
+        adc_chan = ADCON0bits.CHS;
+        adc_done_at = sim_now + SIM_ADC_CONV_NS;
+    }
+}
+
+static void tx_service(void)
+{
+    if (tx_full && sim_now >= tsr_free_at) /// Move the byte from TX1REG to the shift register
+    {
+        if (sim_out) fputc(tx_reg, sim_out);
+        tsr_free_at = sim_now + SIM_UART_BYTE_NS;
+        tx_full = 0;
+        sim_stats.tx_bytes++;
+    }
+}
+
+/**@brief Receive one byte from the pseudo-terminal, if there is one
+*/
+static bool pty_read(void)
+{
+    struct pollfd pfd = { sim_pty, POLLIN, 0 };
+    pty_poll_at = sim_now + SIM_PTY_POLL_NS;
+    if (poll(&pfd, 1, 0) != 1 || read(sim_pty, &rx_byte, 1) != 1) return 0;
+    pty_used = 1;
+    return 1;
+}
+
+/**@brief The firmware waits for input: it polls @p RCIF in a menu, or it waits for a command (reception interrupt on,
+Timer1 stopped)
+*/
+static bool typing(void)
+{
+    return !in_isr && (!RCIE || !tmr1_running);
+}
+
+static void rx_load(void)
+{
+    if (rx_full) return;
+    if (sim_pty >= 0 && sim_now >= pty_poll_at && pty_read()) /// The terminal is only checked every #SIM_PTY_POLL_NS
+    {
+        rx_full = 1;
+    }else if (timed_idx < timed_n && sim_now >= timed[timed_idx].at)
+    {
+        rx_byte = timed[timed_idx++].key;
+        rx_full = 1;
+    }else if (typed_idx < typed_n && typing() && sim_now >= rx_taken_at + SIM_KEY_GAP_NS)
+    {
+        rx_byte = typed[typed_idx++].key; /// Typed keys are only delivered to the blocking menus, or to the ISR while the test is stopped
+        rx_full = 1;
+    }
+    if (rx_full) sim_stats.rx_bytes++;
+}
+
+static bool irq_pending(void)
+{
+    if (!GIE || !PEIE) return 0;
+    return (TMR1IE && TMR1IF) || (RCIE && rx_full) || (TXIE && !tx_full) || (ADIE && ADIF);
+}
+
+static void advance_to(uint64_t target);
+
+/**@brief Call the firmware interrupt service routine while any enabled flag is set
+*/
+static void dispatch(void)
+{
+    while (!in_isr && irq_pending())
+    {
+        uint64_t start = sim_now;
+        uint64_t took;
+        in_isr = 1;
+        GIE = 0; /// The hardware clears GIE on entry and RETFIE sets it again
+        advance_to(sim_now + SIM_ISR_NS);
+        ISR();
+        hal_sync();
+        GIE = 1;
+        in_isr = 0;
+        took = sim_now - start;
+        sim_stats.isr_calls++;
+        sim_stats.isr_ns += took;
+        if (took > sim_stats.isr_max_ns) sim_stats.isr_max_ns = took;
+    }
+}
+
+/**@brief Next time at which a peripheral changes by itself
+*/
+static uint64_t next_event(uint64_t limit)
+{
+    uint64_t next = limit;
+    if (tmr1_running && tmr1_overflow_at() < next) next = tmr1_overflow_at();
+    if (adc_busy && adc_done_at < next) next = adc_done_at;
+    if (tx_full && tsr_free_at < next) next = tsr_free_at;
+    if (!rx_full && timed_idx < timed_n && timed[timed_idx].at < next) next = timed[timed_idx].at;
+    return next;
+}
+
+/**@brief Update the peripherals that have an event due at the current time and call the ISR if needed
+*/
+static void process_events(void)
+{
+    if (tmr1_running && sim_now >= tmr1_overflow_at())
+    {
+        if (TMR1IF) sim_stats.tmr1_missed++;
+        TMR1IF = 1;
+        tmr1_base_time = tmr1_overflow_at();
+        tmr1_base_val = 0;
+        sim_stats.tmr1_overflows++;
+    }
+    if (adc_busy && sim_now >= adc_done_at)
+    {
+        uint16_t res;
+        plant_catch_up();
+        res = sim_plant_adc(&sim_plant, plant_cell, adc_chan);
+        ADRESH = (res >> 8) & 0x0F;
+        ADRESL = res & 0xFF;
+        adc_busy = 0;
+        adc_go = 0;
+        ADIF = 1;
+        sim_stats.adc_conversions++;
+    }
+    tx_service();
+    rx_load();
+    tmr1_publish();
+    if (sim_now >= sim_end) sim_finish("time limit reached");
+    dispatch();
+}
+
+/**@brief Let the simulated time run until @p target, updating the plant and the peripherals
+*/
+static void advance_to(uint64_t target)
+{
+    process_events();
+    while (sim_now < target)
+    {
+        uint64_t next = next_event(target);
+        if (next < sim_now) next = sim_now;
+        sim_now = next;
+        process_events();
+    }
+}
+
+void sim_delay_us(uint32_t us)
+{
+    hal_sync();
+    last_hook = HOOK_DELAY;
+    advance_to(sim_now + (uint64_t) us * SIM_NS_PER_US);
+}
+
+static uint8_t                          eeprom[SIM_EEPROM_SIZE];
+static bool                             eeprom_loaded = 0;
+
+/**@brief Fill the data EEPROM on first use: erased (0xFF), or the contents of #sim_eeprom_file if it exists
+*/
+static void eeprom_load(void)
+{
+    FILE *f;
+    if (eeprom_loaded) return;
+    eeprom_loaded = 1;
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    if (!sim_eeprom_file || !(f = fopen(sim_eeprom_file, "rb"))) return;
+    if (fread(eeprom, 1, sizeof(eeprom), f) != sizeof(eeprom)) memset(eeprom, 0xFF, sizeof(eeprom));
+    fclose(f);
+}
+
+uint8_t eeprom_read(uint8_t addr)
+{
+    eeprom_load();
+    return eeprom[addr];
+}
+
+/**@brief Write one byte, taking the time of the self-timed write. The whole memory is saved to #sim_eeprom_file,
+so a run that ends at any point leaves what the device would keep.
+*/
+void eeprom_write(uint8_t addr, uint8_t value)
+{
+    FILE *f;
+    eeprom_load();
+    eeprom[addr] = value;
+    sim_delay_us(SIM_EEPROM_WRITE_US);
+    if (!sim_eeprom_file || !(f = fopen(sim_eeprom_file, "wb"))) return;
+    fwrite(eeprom, 1, sizeof(eeprom), f);
+    fclose(f);
+}
+
+/**@brief Let the time run until the next key or peripheral event while the firmware waits for input. With a
+pseudo-terminal the wait is in real time. Without keys left, a long wait ends the run
+*/
+static void wait_input(void)
+{
+    uint64_t next = next_event(sim_now + SIM_POLL_NS);
+    if (typed_idx < typed_n && typing() && rx_taken_at + SIM_KEY_GAP_NS < next)
+        next = rx_taken_at + SIM_KEY_GAP_NS;
+    if (next <= sim_now) next = sim_now + 1;
+    if (sim_pty >= 0) /// With a pseudo-terminal, wait for its next byte in real time
+    {
+        struct pollfd pfd = { sim_pty, POLLIN, 0 };
+        if (sim_out) fflush(sim_out);
+        poll(&pfd, 1, (int) (SIM_POLL_NS / 1000000ULL));
+        pty_poll_at = sim_now;
+    }
+    if (typed_idx >= typed_n && timed_idx >= timed_n && (sim_pty < 0 || pty_used))
+    {
+        input_wait += next - sim_now;
+        if (input_wait >= SIM_INPUT_WAIT_NS) sim_finish("waiting for input");
+    }
+    advance_to(next);
+    rx_load();
+}
+
+/**@brief Main loop with nothing to do: jump to the next peripheral event. With Timer1 stopped and the reception
+interrupt on, the firmware waits for a command
+*/
+void sim_idle(void)
+{
+    hal_sync();
+    last_hook = HOOK_IDLE;
+    if (!tmr1_running && RCIE && !rx_full) wait_input();
+    else advance_to(next_event(sim_now + SIM_POLL_NS));
+}
+
+volatile uint8_t *sim_adc_go(void)
+{
+    hal_sync();
+    if (adc_busy && last_hook == HOOK_ADC) advance_to(adc_done_at); /// Polling GO_nDONE waits for the result
+    last_hook = HOOK_ADC;
+    return &adc_go;
+}
+
+uint8_t sim_uart_rcif(void)
+{
+    hal_sync();
+    rx_load();
+    if (!rx_full && !in_isr && last_hook == HOOK_RCIF) wait_input(); /// Polling RCIF waits for the next key
+    last_hook = HOOK_RCIF;
+    return rx_full;
+}
+
+uint8_t sim_uart_rx_read(void)
+{
+    hal_sync();
+    if (rx_full)
+    {
+        rx_full = 0;
+        rx_taken_at = sim_now;
+        input_wait = 0;
+    }
+    last_hook = HOOK_RXREG;
+    return rx_byte;
+}
+
+uint8_t sim_uart_txif(void)
+{
+    hal_sync();
+    tx_service();
+    if (tx_full && last_hook == HOOK_TXIF) advance_to(tsr_free_at); /// Polling TXIF waits for the shift register
+    last_hook = HOOK_TXIF;
+    return !tx_full;
+}
+
+volatile uint8_t *sim_uart_tx_reg(void)
+{
+    hal_sync();
+    tx_full = 1; /// The value is stored by the caller, it is moved to the shift register on a later hook
+    last_hook = HOOK_TXREG;
+    return &tx_reg;
+}
+
+/**@brief Queue a key press at the absolute simulated time @p at (in ns)
+*/
+void sim_key_at(uint64_t at, uint8_t key)
+{
+    unsigned k;
+    if (timed_n >= SIM_MAX_KEYS) return;
+    for (k = timed_n; k > 0 && timed[k - 1].at > at; k--) timed[k] = timed[k - 1];
+    timed[k].at = at;
+    timed[k].key = key;
+    timed_n++;
+}
+
+/**@brief Queue keys to be typed, one by one, whenever the firmware blocks waiting for input
+*/
+void sim_keys(const char *keys)
+{
+    while (*keys && typed_n < SIM_MAX_KEYS)
+    {
+        typed[typed_n].at = 0;
+        typed[typed_n++].key = (uint8_t) *keys++;
+    }
+}
+
+/**@brief Open a pseudo-terminal that replaces the serial port of the board. The UART output is written to it and
+the bytes written to it are received by the firmware
+@return Name of the terminal to open, NULL on error
+*/
+const char *sim_pty_open(void)
+{
+    struct termios tio;
+    const char *name;
+    int slave;
+    sim_pty = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim_pty < 0 || grantpt(sim_pty) || unlockpt(sim_pty) || !(name = ptsname(sim_pty))) return NULL;
+    slave = open(name, O_RDWR | O_NOCTTY); /// The terminal is set to raw mode and kept open, so it does not hang up
+    if (slave < 0 || tcgetattr(slave, &tio)) return NULL;
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    sim_out = fdopen(dup(sim_pty), "w");
+    if (!sim_out) return NULL;
+    setvbuf(sim_out, NULL, _IOLBF, 0); /// The output blocks while the terminal is full, so nothing is lost
+    return name;
+}
+
+/**@brief Start the firmware. It never returns, the run ends in #sim_finish()
+*/
+void sim_run(void)
+{
+    wall_start = clock();
+    firmware_main();
+}
+
+void sim_finish(const char *why)
+{
+    double wall = (double) (clock() - wall_start) / CLOCKS_PER_SEC;
+    double simulated = (double) sim_now / SIM_NS_PER_S;
+    int k;
+    plant_catch_up();
+    if (sim_out) fflush(sim_out);
+    fprintf(stderr, "\n--- simulation finished: %s ---\n", why);
+    fprintf(stderr, "simulated time: %02u:%02u:%02u (%.0f s), wall time %.2f s, speed x%.0f\n",
+            (unsigned) (simulated / 3600), (unsigned) (simulated / 60) % 60, (unsigned) simulated % 60,
+            simulated, wall, wall > 0 ? simulated / wall : 0.0);
+    fprintf(stderr, "isr calls: %llu, isr mean %.1f us, isr max %.1f us, timer1 overflows missed: %llu\n",
+            (unsigned long long) sim_stats.isr_calls,
+            sim_stats.isr_calls ? (double) sim_stats.isr_ns / sim_stats.isr_calls / 1000.0 : 0.0,
+            (double) sim_stats.isr_max_ns / 1000.0, (unsigned long long) sim_stats.tmr1_missed);
+    fprintf(stderr, "adc conversions: %llu, uart tx bytes: %llu, uart rx bytes: %llu\n",
+            (unsigned long long) sim_stats.adc_conversions, (unsigned long long) sim_stats.tx_bytes,
+            (unsigned long long) sim_stats.rx_bytes);
+    for (k = 0; k < SIM_CELLS; k++)
+    {
+        const struct sim_cell *c = &sim_plant.cell[k];
+        fprintf(stderr, "cell %d (%s): soc %.3f, charged %.0f mAh, discharged %.0f mAh, max temp %.1f C\n",
+                k + 1, c->chem->name, c->q / (c->chem->capacity_ah * 3600.0), c->q_in / 3.6, c->q_out / 3.6,
+                c->temp_max);
+    }
+    exit(0);
+}
+
+/**@brief XC8 style @p utoa(), buffer first
+*/
+char *utoa(char *buf, unsigned val, int base)
+{
+    char tmp[17];
+    int n = 0, k = 0;
+    do { tmp[n++] = "0123456789abcdef"[val % (unsigned) base]; val /= (unsigned) base; } while (val);
+    while (n) buf[k++] = tmp[--n];
+    buf[k] = 0;
+    return buf;
+}
+
+/**@brief XC8 style @p itoa(), buffer first
+*/
+char *itoa(char *buf, int val, int base)
+{
+    if (val < 0)
+    {
+        buf[0] = '-';
+        utoa(buf + 1, (unsigned) -val, base);
+        return buf;
+    }
+    return utoa(buf, (unsigned) val, base);
+}
@@ -0,0 +1,111 @@
+/**
+ * @file sim_main.c
+ * @author Juan J. Rojas
+ * @date 17 Oct 2026
+ * @brief Command line of the host simulation: choose the cell model, script the terminal and run the firmware.
+ * @par Institution:
+ * LaSEINE / CeNT. Kyushu Institute of Technology.
+ * @par Mail (after leaving Kyutech):
+ * juan.rojas@tec.ac.cr
+ * @par Git repository:
+ * https://bitbucket.org/juanjorojash/cell_charger_discharger
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+
+#ifndef SIM_DEFAULT_CHEM
+    #define SIM_DEFAULT_CHEM            sim_ni_mh ///< Cell model matching the chemistry compiled in the firmware
+#endif
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [-c li_ion|ni_mh] [-s soc] [-k keys] [-a sec:key] [-t hours] [-o file] [-q] [-p] [-e file]\n"
+        "  -c  cell model (default %s)\n"
+        "  -s  initial state of charge of the cells, 0 to 1 (default 0.5)\n"
+        "  -k  keys typed whenever the firmware waits for input (default \"1111s\":\n"
+        "      0.25C charge, 0.25C discharge, option 1, one cell, start)\n"
+        "  -a  send key at the given simulated second, e.g. -a 3600:n (can be repeated)\n"
+        "  -t  simulated time limit in hours (default 24)\n"
+        "  -o  write the UART output to file instead of stdout\n"
+        "  -q  discard the UART output\n"
+        "  -p  connect the UART to a pseudo-terminal, no keys are typed unless -k is given\n"
+        "  -e  keep the data EEPROM in file between runs (default erased at start)\n",
+        prog, SIM_DEFAULT_CHEM.name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const struct sim_chem *chem = &SIM_DEFAULT_CHEM;
+    const char *keys = NULL;
+    bool pty = 0;
+    double soc = 0.5;
+    double hours = 24.0;
+    int opt;
+    sim_out = stdout;
+    while ((opt = getopt(argc, argv, "c:s:k:a:t:o:qpe:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                if (!strcmp(optarg, sim_li_ion.name)) chem = &sim_li_ion;
+                else if (!strcmp(optarg, sim_ni_mh.name)) chem = &sim_ni_mh;
+                else usage(argv[0]);
+                break;
+            case 's':
+                soc = atof(optarg);
+                break;
+            case 'k':
+                keys = optarg;
+                break;
+            case 'a':
+            {
+                char *colon = strchr(optarg, ':');
+                if (!colon || !colon[1]) usage(argv[0]);
+                sim_key_at((uint64_t) (atof(optarg) * SIM_NS_PER_S), (uint8_t) colon[1]);
+                break;
+            }
+            case 't':
+                hours = atof(optarg);
+                break;
+            case 'o':
+                sim_out = fopen(optarg, "w");
+                if (!sim_out)
+                {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'q':
+                sim_out = NULL;
+                break;
+            case 'p':
+                pty = 1;
+                break;
+            case 'e':
+                sim_eeprom_file = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    sim_plant_init(&sim_plant, chem, soc);
+    if (pty)
+    {
+        const char *name = sim_pty_open();
+        if (!name)
+        {
+            perror("pseudo-terminal");
+            return 1;
+        }
+        fprintf(stderr, "board connected to %s\n", name);
+    }else if (!keys) keys = "1111s";
+    if (keys) sim_keys(keys);
+    sim_end = (uint64_t) (hours * 3600.0 * SIM_NS_PER_S);
+    sim_run();
+    return 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file xc.h
+ * @author Juan J. Rojas
+ * @date 17 Oct 2026
+ * @brief Host stand-in for the XC8 device header of the PIC16F1786.
+ * @par Institution:
+ * LaSEINE / CeNT. Kyushu Institute of Technology.
+ * @par Mail (after leaving Kyutech):
+ * juan.rojas@tec.ac.cr
+ * @par Git repository:
+ * https://bitbucket.org/juanjorojash/cell_charger_discharger
+ *
+ * This file is found before the real @p xc.h when the firmware is compiled with the host simulation
+ * build (see @p sim/Makefile). Plain registers are stored as bytes, while the registers with side effects
+ * (ADC start/done, UART flags and data registers) are routed to the simulated HAL in @p sim_hal.c.
+ */
+
+#ifndef SIM_XC_H
+    #define SIM_XC_H
+    #include <stdint.h>
+
+    typedef uint32_t                    uint24_t; ///< XC8 24-bit unsigned type, widened to 32 bits on the host
+    typedef int32_t                     int24_t; ///< XC8 24-bit signed type, widened to 32 bits on the host
+
+    #define     __interrupt(...) ///< The ISR is called by the simulated interrupt controller
+    #define     __bank(x) ///< There are no RAM banks on the host
+    #define     __delay_us(x)           sim_delay_us((uint32_t)(x)) ///< Busy wait, advances the simulated time
+    #define     __delay_ms(x)           sim_delay_us((uint32_t)(x) * 1000UL) ///< Busy wait, advances the simulated time
+    #define     CLRWDT()                {} ///< The watchdog is not simulated
+    #define     NOP()                   {} ///< No operation
+
+    /** Plain registers, see @p sim_regs.def */
+    #define     SIM_REG(name)           extern volatile uint8_t name;
+    #include "sim_regs.def"
+    #undef      SIM_REG
+
+    /** Registers with bit-field views used by the firmware */
+    typedef struct { uint8_t ADON, CHS, ADRMD; } sim_adcon0_t;
+    typedef struct { uint8_t ADCS, ADFM, ADNREF, ADPREF; } sim_adcon1_t;
+    typedef struct { uint8_t CHSN; } sim_adcon2_t;
+    typedef struct { uint8_t IRCF, SCS, SPLLEN; } sim_osccon_t;
+    typedef struct { uint8_t PSMC1LD; } sim_psmc1con_t;
+    typedef struct { uint8_t CREN, OERR; } sim_rc1sta_t;
+    extern volatile sim_adcon0_t        ADCON0bits;
+    extern volatile sim_adcon1_t        ADCON1bits;
+    extern volatile sim_adcon2_t        ADCON2bits;
+    extern volatile sim_osccon_t        OSCCONbits;
+    extern volatile sim_psmc1con_t      PSMC1CONbits;
+    extern volatile sim_rc1sta_t        RC1STAbits;
+
+    /** Registers with side effects */
+    #define     GO_nDONE                (*sim_adc_go()) ///< Writing 1 starts a conversion, reads as 1 until it is finished
+    #define     RCIF                    (sim_uart_rcif()) ///< Set while a received byte is waiting in #RC1REG
+    #define     RC1REG                  (sim_uart_rx_read()) ///< Reading pops the received byte
+    #define     TXIF                    (sim_uart_txif()) ///< Set while the transmission register is empty
+    #define     TX1REG                  (*sim_uart_tx_reg()) ///< Writing queues a byte for transmission
+
+    /** Simulated HAL entry points, implemented in @p sim_hal.c */
+    void sim_delay_us(uint32_t us);
+    void sim_idle(void);
+    volatile uint8_t *sim_adc_go(void);
+    uint8_t sim_uart_rcif(void);
+    uint8_t sim_uart_rx_read(void);
+    uint8_t sim_uart_txif(void);
+    volatile uint8_t *sim_uart_tx_reg(void);
+
+    /** XC8 library access to the data EEPROM, simulated in @p sim_hal.c */
+    uint8_t eeprom_read(uint8_t addr);
+    void eeprom_write(uint8_t addr, uint8_t value);
+
+    /** XC8 library functions without a glibc counterpart */
+    char *utoa(char *buf, unsigned val, int base);
+    char *itoa(char *buf, int val, int base);
+#endif /* SIM_XC_H */
@@ -17,11 +17,12 @@
 */
 void state_machine()
 {
-    switch(state){
+    if (parallel && scheduler()) return; /// In #parallel mode, the #scheduler() runs first. A cell that was just loaded runs from the next second
+    switch(ctx->state){
     /**The #STANDBY  state goes to the #fSTANDBY()  function.*/
             case STANDBY:
                 fSTANDBY();
-                SECF = 1; //THis makes the thing go inside the state machine
+                if (!remote && !CKPT_STATE(ctx->state)) SECF = 1; //THis makes the thing go inside the state machine. In #remote mode the board waits for #command(), a test resumed by #resume() runs from the next second
                 break;   
     /**The #IDLE  state goes to the #fIDLE()  function.*/             
             case IDLE:
@@ -30,22 +31,22 @@ void state_machine()
     /**The #PREDISCHARGE  and #DISCHARGE  states go to the #fDISCHARGE()  function.*/ 
             case PREDISCHARGE:
             case DISCHARGE:
-                fDISCHARGE();
+                fDISCHARGE(ctx);
                 break;
     /**And the #POSTCHARGE  and #CHARGE  states go to the #fCHARGE()  function.*/  
             case POSTCHARGE:  
             case CHARGE:   
-                fCHARGE();  
+                fCHARGE(ctx);  
                 break;
     /**The #CS_DC_res , #DS_DC_res  and #PS_DC_res  states go to the #fDC_res()  function.*/
             case CS_DC_res:
             case DS_DC_res:
             case PS_DC_res:
-                fDC_res();
+                fDC_res(ctx);
                 break;
     /**The #WAIT  state goes to the #fWAIT()  function.*/
             case WAIT:    
-                fWAIT();
+                fWAIT(ctx);
                 break;
     /**The #ISDONE  state goes to the #fISDONE()  function.*/
             case ISDONE:    
@@ -65,203 +66,450 @@ void fSTANDBY()
     STOP_CONVERTER(); /// * Stop the converter by calling the #STOP_CONVERTER() macro
     RCIE = 0; /// * Disable the USART reception interrupts to avoid interference with the setting of parameters in the #STANDBY state
     TMR1ON = 0; ///* Disable the Timer1 to avoid interference
+    relay_flush(); /// * Run the relay steps left by #STOP_CONVERTER(), #relay_tick() is not called anymore
+    cell_count = '1'; /// * Initialize #cell_count to '1' and the running context #ctx to its cell
+    ctx = &cells[0];
+    ctx->state = STANDBY;
+    if (ckpt_run) /// * The test finished or was stopped, so its last checkpoint is written in #STANDBY with #ckpt_save() and it is not resumed
+    {
+        ckpt_run = 0;
+        ckpt_save();
+    }
+    if (remote) /// * In #remote mode the parameters are kept for the next @p $START, the status is sent with #cmd_status() and the commands are received by the ISR
+    {
+        cmd_status();
+        RCIE = 1;
+        PEIE = 1;
+        GIE = 1;
+        return;
+    }
     option = 0; /// * Initialize #option to 0
     cell_max = 0; /// * Initialize #cell_max to 0
-    cell_count = '1'; /// * Initialize #cell_count to '1'
+    parallel = 0; /// * Initialize #parallel to 0
     LINEBREAK; 
     UART_send_string((char*)param_def_str); /// * Print message: <tt> ---Parameter definition for charger and discharger--- </tt>
     LINEBREAK;
-    #if (LI_ION_CHEM) /// If #LI_ION_CHEM  is set to @b 1 and #NI_MH_CHEM  is set to @b 0, the folowing message will be displayed:
-    UART_send_string((char*)chem_def_liion); /// * <tt> Chemistry defined as Li-Ion </tt>
-    LINEBREAK;
+    UART_send_string((char*)chem_def_str); /// * Print the selected chemistry, for example <tt> Chemistry defined as Ni-MH </tt>
+    chem_name(&chem);
     LINEBREAK;
-    #elif (NI_MH_CHEM) /// If #NI_MH_CHEM  is set to @b 1 and #LI_ION_CHEM  is set to @b 0, the folowing message will be displayed:
-    UART_send_string((char*)chem_def_nimh); /// * <tt> Chemistry defined as Ni-MH </tt>
     LINEBREAK;
-    LINEBREAK; 
-    #endif
+    if (ckpt_valid && resume_ask()) return; /// After a reset in the middle of a test, #resume_ask() offers to resume it
     param(); /// Call the #param() function
 }
 /**@brief This function define the IDLE state of the state machine.
 */
 void fIDLE()
 {
+    unsigned char k;
     /**At first, the function will call the #Start_state_machine()  function.*/
     start_state_machine();
-    /**Then, it will call the #Converter_settings()  function.*/
-    converter_settings(); 
+    /**In #parallel mode, the cells that will be tested are marked in #cells as not started and the rest as done.*/
+    if (parallel && ctx->state == IDLE)
+    {
+        for (k = 1; k < CELLS; k++)
+        {
+            cells[k].state = IDLE;
+            cells[k].wait_count = 0;
+            cells[k].started = 0;
+            cells[k].done = (k >= cell_max - '0');
+        }
+        ctx->started = 1;
+        ctx->done = 0;
+    }
+    /**Then, it will start the first step of the #profile with the #step_start() function, unless the user pressed @b ESC.
+    A sequential test of the options 1 to 4 and 6 writes its checkpoints (#ckpt_run), so it can be resumed after a reset.*/
+    if (ctx->state == IDLE)
+    {
+        ckpt_valid = 0;
+        ckpt_run = !parallel && option != '5';
+        fault = FAULT_NONE;
+        step_start(ctx);
+    }
     /**Then, it will enable the USART reception interrupts to give the possibility to the user to press
     @b ESC to cancel or @b n to go to the next cell, at any time during the testing process*/            
     interrupt_enable();
 }
 
 /**@brief This function define the IDLE state of the state machine.
+@param c Context of the running cell
 */
-void fCHARGE()
+void fCHARGE(struct cell *c)
 {
     LOG_ON(); /// * Activate the logging by calling #LOG_ON() macro
     conv = 1; /// * Activate control loop by setting #conv
     if (vavg < 900) //&& (qavg > 1)) /// If #vavg is below 0.9V
     {
-        state = FAULT; /// * Go to #FAULT state
+        c->state = FAULT; /// * Go to #FAULT state
         UART_send_string((char*)cell_below_str); /// * Send a warning message
         LINEBREAK;
     }
-    if (state == CHARGE){ /// If the #state is #CHARGE
-        #if (LI_ION_CHEM) 
-        /// If the chemistry is Li-Ion
-        if ((iavg < EOC_current)  && (qavg > 100)) /// * If #iavg is below #EOC_current then
-        {                
-            prev_state = state; /// -# Set #prev_state equal to #state
-            if (option == '3') state = ISDONE; /// -# If #option is '3' then go to #DONE state
-            else state = WAIT; /// -# Else, go to #WAIT state
-            wait_count = WAIT_TIME; /// -# Set #wait_count equal to #WAIT_TIME
-            STOP_CONVERTER(); /// -# Stop the converter by calling #STOP_CONVERTER() macro
-        }
-        #elif (NI_MH_CHEM) 
-        /// If the chemistry is Ni-MH
-        if (((vavg < (vmax - Ni_MH_EOC_DV)) && (qavg > 100)) || minute >= timeout)
-        {
-            prev_state = state; /// -# Set #prev_state equal to #state
-            if (option == '3') state = ISDONE; /// -# If #option is '3' then go to #ISDONE state
-            else state = WAIT; /// -# Else, go to #WAIT state
-            wait_count = WAIT_TIME; /// -# Set #wait_count equal to #WAIT_TIME
-            STOP_CONVERTER(); /// -# Stop the converter by calling #STOP_CONVERTER() macro
-        }
-        #endif   
-    } 
-    if (state == POSTCHARGE){
-        #if (LI_ION_CHEM) 
-        if (qavg >= ( (capacity * 10) / 2 ) && ((minute + second) >= 1)){
-            prev_state = state;
-            state = WAIT;
-            wait_count = WAIT_TIME;
-            STOP_CONVERTER();
-        #elif (NI_MH_CHEM)
-        if (qavg >= ( (capacity * 10) / 2 ) || (unsigned) minute >= timeout){
-            prev_state = state;
-            state = WAIT;
-            wait_count = WAIT_TIME;
-            STOP_CONVERTER();
-        }
-        #endif  
-    }    
+    if (tavg > c->step_tmax) c->step_tmax = tavg; /// Keep the maximum temperature of the step in cell::step_tmax
+    if (c->state != FAULT && step_end(c)) step_next(c); /// If the termination criterion of the step is met, go to the next step of the #profile
 }
 
 /**@brief This function define the IDLE state of the state machine.
+@param c Context of the running cell
 */
-void fDISCHARGE()
+void fDISCHARGE(struct cell *c)
 {
     LOG_ON(); /// * Activate the logging by calling #LOG_ON() macro
     conv = 1; /// * Activate control loop by setting #conv
-    if (vavg < EOD_voltage) /// * If #vavg is below #EOD_voltage then
-    {
-        prev_state = state; /// -# Set #prev_state equal to #state
-        if (option == '2'| option == '4') state = ISDONE; /// -# If #option is '2' or '4' then go to #ISDONE state
-        else state = WAIT; /// -# Else, go to #WAIT state                  
-        wait_count = WAIT_TIME; /// -# Set #wait_count equal to #WAIT_TIME
-        STOP_CONVERTER(); /// -# Stop the converter by calling #STOP_CONVERTER() macro  
-    }
+    if (tavg > c->step_tmax) c->step_tmax = tavg; /// * Keep the maximum temperature of the step in cell::step_tmax
+    if (step_end(c)) step_next(c); /// * If the termination criterion of the step is met (#vavg below #EOD_voltage by default), go to the next step of the #profile
 }
 
 /**@brief This function define the IDLE state of the state machine.
+@param c Context of the running cell
 */
-void fDC_res() //can be improved a lot!!
+void fDC_res(struct cell *c) //can be improved a lot!!
 {
     conv = 1; /// * Activate control loop by setting #conv
-    if (dc_res_count == 4)  /// * If #dc_res_count is equal to 4 (CHANGE), then:
+    if (c->dc_res_count == 4)  /// * If cell::dc_res_count is equal to 4 (CHANGE), then:
     {
-        v_1_dcres = vavg;
-        i_1_dcres = iavg;
-        iref = (uint16_t) ( ( ( capacity * 4096.0 ) / (5000 * 2.5 * 1 ) ) + 0.5 );     //1C            
+        c->v_1_dcres = vavg;
+        c->i_1_dcres = iavg;
+        ctl.iref = C_TO_ADC(capacity, 1);     //1C            
     }
-    if (dc_res_count == 1)
+    if (c->dc_res_count == 1)
     {
-        v_2_dcres = vavg;
-        i_2_dcres = iavg;
+        c->v_2_dcres = vavg;
+        c->i_2_dcres = iavg;
         STOP_CONVERTER();            
-        dc_res_val = (uint24_t)(v_1_dcres - v_2_dcres) * 10000;    
-        dc_res_val = dc_res_val /(uint24_t)(i_2_dcres - i_1_dcres);
+        c->dc_res_val = (uint24_t)(c->v_1_dcres - c->v_2_dcres) * 10000;    
+        c->dc_res_val = c->dc_res_val /(uint24_t)(c->i_2_dcres - c->i_1_dcres);
     }
-    if (!dc_res_count)
+    if (!c->dc_res_count)
     {   
         LINEBREAK;
         UART_send_char(C_str);
-        UART_send_char(cell_count);
+        UART_send_char(CELL_CHAR(c));
         UART_send_char(comma);
         UART_send_char(S_str);
-        display_value_u((uint16_t)state);
+        display_value_u((uint16_t)c->state);
         UART_send_char(comma);
         UART_send_char(R_str);
-        display_value_u((uint16_t)dc_res_val);
+        display_value_u((uint16_t)c->dc_res_val);
         UART_send_char('<');
         LINEBREAK;
-        LOG_OFF();   ///I dont like this 
-        prev_state = state;
-        state = WAIT;
-        wait_count = WAIT_TIME;              
-    }else dc_res_count--;
+        step_next(c); /// When it is finished, go to the next step of the #profile
+    }else c->dc_res_count--;
 }
 
 /**@brief This function define the IDLE state of the state machine.
+@param c Context of the running cell
 */
-void fWAIT()
+void fWAIT(struct cell *c)
 {
-    STOP_CONVERTER();  ///MAYBEOK
-    if (wait_count)
+    if (!REST_ADAPTIVE()) STOP_CONVERTER();  ///MAYBEOK. An adaptive rest keeps the cell connected, the converter was stopped by #step_next()
+    if (c->wait_count)
     {   
         LINEBREAK;
         UART_send_char(C_str);
-        UART_send_char(cell_count);
+        UART_send_char(CELL_CHAR(c));
         UART_send_char(comma);
         UART_send_char(S_str);
-        display_value_u((uint16_t)state);
+        display_value_u((uint16_t)c->state);
         UART_send_char(comma);
         UART_send_char(W_str);
-        display_value_u(wait_count);
+        display_value_u(c->wait_count);
         UART_send_char('<');
-        wait_count--;             
+        c->wait_count--;             
     }
-    if(!wait_count)
-    {           
-        switch(prev_state)
+    if (REST_ADAPTIVE() && rest_end(c)) c->wait_count = 0; /// * An adaptive rest also finishes when the cell relaxed, see #rest_end()
+    if(!c->wait_count) step_next(c); /// * When the rest is finished, go to the next step of the #profile
+}
+
+/**@brief This function checks the relaxation of the cell in an adaptive rest. It is called every second by #fWAIT().
+The voltage #vavg_hr is taken every #REST_WINDOW seconds, starting #REST_SETTLE seconds after the start of the rest,
+and the rest is finished when it changed less than #rest_dv uV from the previous one, after #REST_MIN seconds.
+@param c Context of the resting cell
+@return 1 if the cell relaxed
+*/
+bool rest_end(struct cell *c)
+{
+    uint16_t dv;
+    if (++c->rest_secs % REST_WINDOW != REST_SETTLE) return 0;
+    dv = (vavg_hr > c->rest_v) ? vavg_hr - c->rest_v : c->rest_v - vavg_hr;
+    c->rest_v = vavg_hr;
+    return c->rest_secs > REST_WINDOW && c->rest_secs >= REST_MIN && dv <= UV_TO_HR(rest_dv);
+}
+
+/**@brief This function starts the step cell::step_idx of the #profile: it sets cell::state and prepares the converter with
+* #converter_settings(), or the rest time of a #WAIT step. The converter and the relays are the ones of the connected
+* cell, so a step that uses them is only started for #ctx.
+* @param c Context of the cell
+*/
+void step_start(struct cell *c)
+{
+    while (profile[c->step_idx].state == CYCLE) /// * A #CYCLE step is not a state, it is handled at once:
+    {
+        c->cycle++; /// - Count the cycle and print its summary with #cycle_report()
+        cycle_report(c);
+        CYCLE_RESET(c);
+        if (c->cycle < (profile[c->step_idx].timeout ? profile[c->step_idx].timeout : cycles)) c->step_idx = (unsigned char) profile[c->step_idx].limit; /// - Go back to the first step of the cycle, or continue after the last cycle
+        else c->step_idx++;
+    }
+    c->state = profile[c->step_idx].state;
+    switch(c->state)
+    {
+        case WAIT: /// * A #WAIT step rests @p limit seconds, #WAIT_TIME by default. An adaptive rest (#REST_ADAPTIVE()) connects the cell to measure its voltage
+            c->wait_count = profile[c->step_idx].limit ? profile[c->step_idx].limit : WAIT_TIME;
+            c->rest_secs = 0;
+            if (REST_ADAPTIVE()) Cell_ON();
+            break;
+        case ISDONE: /// * The #ISDONE step finishes the test of the cell
+            break;
+        default: /// * The rest of the steps start the converter
+            converter_settings();
+            break;
+    }
+    if (ckpt_run) ckpt_save(); /// * The new step is saved with #ckpt_save()
+}
+
+/**@brief This function finishes the current step and starts the next one of the #profile. The charge and energy
+* of a step that used the converter are printed with #coulomb_report().
+* @param c Context of the cell, the connected one (#ctx) if the step used the converter
+*/
+void step_next(struct cell *c)
+{
+    STOP_CONVERTER(); /// * Stop the converter by calling #STOP_CONVERTER() macro
+    c->prev_state = c->state; /// * Set cell::prev_state equal to cell::state
+    if (c->prev_state != WAIT) coulomb_report();
+    cycle_add(c); /// * Add the step to the summary of the cycle with #cycle_add()
+    c->step_idx++;
+    step_start(c);
+}
+
+/**@brief This function adds the step that just finished to the summary of the cycle, if it belongs to the cycle of
+* the #profile: the charge and energy of #CHARGE and #POSTCHARGE, the discharge of #PREDISCHARGE and #DISCHARGE,
+* the DC resistance of #CS_DC_res and #DS_DC_res, and the maximum temperature.
+* @param c Context of the cell
+*/
+void cycle_add(struct cell *c)
+{
+    if (c->step_idx < cycle_first || c->step_idx >= cycle_end) return;
+    switch(c->prev_state)
+    {
+        case CHARGE:
+        case POSTCHARGE:
+            c->cyc_qc += cc_uah_last;
+            c->cyc_ec += cc_uwh;
+            break;
+        case PREDISCHARGE:
+        case DISCHARGE:
+            c->cyc_qd += cc_uah_last;
+            c->cyc_ed += cc_uwh;
+            break;
+        case CS_DC_res:
+            c->cyc_rc = (uint16_t) c->dc_res_val;
+            break;
+        case DS_DC_res:
+            c->cyc_rd = (uint16_t) c->dc_res_val;
+            break;
+    }
+    if (c->prev_state != WAIT && c->step_tmax > c->cyc_tmax) c->cyc_tmax = c->step_tmax;
+}
+
+/**@brief This function prints the summary of the cycle cell::cycle:
+* <tt> C1,Yn,QCmah,QDmah,ECmwh,EDmwh,Fe,RCr,RDr,Tt< </tt>, with the charge and discharge (mAh), the charged and
+* discharged energy (mWh), the coulombic efficiency @p e (discharge / charge, per mille), the DC resistances in
+* charged and discharged state (0.1 mOhm) and the maximum temperature (0.1 degC). In binary mode (#log_bin) it is
+* a frame of type #FRAME_CYCLE with the same fields (2 bytes each) after the cell number.
+* @param c Context of the cell
+*/
+void cycle_report(struct cell *c)
+{
+    uint16_t qc = (uint16_t) (c->cyc_qc / 1000);
+    uint16_t qd = (uint16_t) (c->cyc_qd / 1000);
+    uint16_t eff = qc ? (uint16_t) (((uint32_t) qd * 1000) / qc) : 0;
+    if (log_bin)
+    {
+        frame_begin(FRAME_CYCLE);
+        frame_u8((uint8_t) (CELL_CHAR(c) - '0'));
+        frame_u16(c->cycle);
+        frame_u16(qc);
+        frame_u16(qd);
+        frame_u16((uint16_t) (c->cyc_ec / 1000));
+        frame_u16((uint16_t) (c->cyc_ed / 1000));
+        frame_u16(eff);
+        frame_u16(c->cyc_rc);
+        frame_u16(c->cyc_rd);
+        frame_u16((uint16_t) c->cyc_tmax);
+        frame_end();
+        return;
+    }
+    LINEBREAK;
+    UART_send_char(C_str);
+    UART_send_char(CELL_CHAR(c));
+    UART_send_char(comma);
+    UART_send_char('Y');
+    display_value_u(c->cycle);
+    UART_send_char(comma);
+    UART_send_char(Q_str);
+    UART_send_char(C_str);
+    display_value_u(qc);
+    UART_send_char(comma);
+    UART_send_char(Q_str);
+    UART_send_char('D');
+    display_value_u(qd);
+    UART_send_char(comma);
+    UART_send_char(E_str);
+    UART_send_char(C_str);
+    display_value_u((uint16_t) (c->cyc_ec / 1000));
+    UART_send_char(comma);
+    UART_send_char(E_str);
+    UART_send_char('D');
+    display_value_u((uint16_t) (c->cyc_ed / 1000));
+    UART_send_char(comma);
+    UART_send_char('F');
+    display_value_u(eff);
+    UART_send_char(comma);
+    UART_send_char(R_str);
+    UART_send_char(C_str);
+    display_value_u(c->cyc_rc);
+    UART_send_char(comma);
+    UART_send_char(R_str);
+    UART_send_char('D');
+    display_value_u(c->cyc_rd);
+    UART_send_char(comma);
+    UART_send_char(T_str);
+    display_value_s(c->cyc_tmax);
+    UART_send_char('<');
+}
+
+/**@brief This function checks the termination criterion of the current step of the #profile. It is called every
+* second by #fCHARGE() and #fDISCHARGE().
+* @param c Context of the cell
+* @return 1 if the step is finished
+*/
+bool step_end(struct cell *c)
+{
+    struct step const *st = &profile[c->step_idx];
+    uint16_t lim = st->limit;
+    if (st->timeout) /// * If the step has a @p timeout, it is finished when #minute reaches it
+    {
+        if (minute >= st->timeout) return 1;
+    }
+    else if (chem.timeout && (c->state == CHARGE || c->state == POSTCHARGE) && minute >= c->timeout) return 1; /// * Else, if the chemistry has a chem::timeout, a charge finishes after cell::timeout minutes
+    switch(st->end) /// * A @p limit of 0 is replaced by the parameter defined in #param()
+    {
+        case END_CHEM:
+            if (!lim) lim = chem.eoc;
+            if (chem.flags & CHEM_DV) return (vavg_hr < (c->vmax_hr - MV_TO_HR(lim))) && (c->qavg > 100); /// - With #CHEM_DV the charge ends by the voltage drop
+            return (iavg < lim) && (c->qavg > 100); /// - Else, it ends when the current falls below the limit
+        case END_V_BELOW:
+            if (!lim) lim = EOD_voltage;
+            return vavg < lim;
+        case END_Q:
+            if (!lim) lim = (capacity * 10) / 2;
+            return c->qavg >= lim;
+        case END_V_ABOVE:
+            if (!lim) lim = cvref;
+            return vavg >= lim;
+        case END_I_BELOW:
+            if (!lim) lim = EOC_current;
+            return (iavg < lim) && (c->qavg > 100);
+        default: /// #END_TIME
+            return (minute * 60 + second) >= lim;
+    }
+}
+
+/**@brief This function receives a profile from the serial terminal and stores it in #custom_profile. Each step is
+* sent as five numbers separated by commas, <tt> state,current,end,limit,timeout </tt> (see #step), the steps are
+* separated by ';' or a new line and the profile finishes with '.'. The missing numbers of a step are 0.
+* The profile is printed back when it is accepted.
+* @return number of steps, 0 if the profile was not valid
+*/
+unsigned char profile_upload()
+{
+    uint16_t val[5];
+    unsigned char field = 0;
+    unsigned char n = 0;
+    bool digits = 0;
+    bool valid = 1;
+    char c;
+    LINEBREAK;
+    UART_send_string((char*)profile_str);
+    LINEBREAK;
+    val[0] = 0;
+    do
+    {
+        c = UART_get_char();
+        if (c >= '0' && c <= '9') /// * The digits are added to the current number
         {
-            case PREDISCHARGE:
-                state = CHARGE;
-                converter_settings();
-                break;
-            case CHARGE:
-                state = CS_DC_res; 
-                converter_settings();
-                break;
-            case DISCHARGE:
-                state = DS_DC_res; 
-                converter_settings();
-                break;
-            case POSTCHARGE:
-                state = PS_DC_res;
-                converter_settings();
-                break;
-            case DS_DC_res:
-                state = POSTCHARGE;
-                converter_settings();
-                break;
-            case CS_DC_res:
-                state = DISCHARGE;
-                converter_settings();
-                break;
-            case PS_DC_res:
-                state = ISDONE;
-                STOP_CONVERTER();
-                break;
-        }
+            if (field < 5) val[field] = val[field] * 10 + (uint16_t) (c - '0');
+            digits = 1;
+        }else if (c == ',') /// * A comma goes to the next number of the step
+        {
+            if (++field < 5) val[field] = 0;
+        }else if (c == ';' || c == '.' || c == '\r' || c == '\n') /// * The end of a step checks it and stores it
+        {
+            if (digits)
+            {
+                while (++field < 5) val[field] = 0;
+                if (valid) valid = profile_step(val, n); /// The step is checked and stored with #profile_step()
+                if (valid) n++;
+            }
+            field = 0;
+            val[0] = 0;
+            digits = 0;
+        }else if (c == 0x1B) valid = 0; /// * ESC cancels the profile
+    }while (c != '.' && c != 0x1B);
+    if (!valid || !n)
+    {
+        custom_profile[0].state = ISDONE; /// * A rejected profile leaves an empty one, closed with an #ISDONE step
+        UART_send_string((char*)profile_err_str);
+        LINEBREAK;
+        return 0;
     }
+    custom_profile[n].state = ISDONE; /// * The profile is closed with an #ISDONE step
+    for (field = 0; field < n; field++) /// * Print the profile back, one step per line
+    {
+        display_value_u(custom_profile[field].state);
+        UART_send_char(comma);
+        display_value_u(custom_profile[field].current);
+        UART_send_char(comma);
+        display_value_u(custom_profile[field].end);
+        UART_send_char(comma);
+        display_value_u(custom_profile[field].limit);
+        UART_send_char(comma);
+        display_value_u(custom_profile[field].timeout);
+        LINEBREAK;
+    }
+    return n + 1;
+}
+
+/**@brief This function checks a step of an uploaded profile and stores it in #custom_profile
+* @param val Numbers of the step: state, current, end, limit and timeout (see #step)
+* @param n Index of the step
+* @return 0 if the step is not valid
+*/
+bool profile_step(uint16_t *val, unsigned char n)
+{
+    if (val[0] < PREDISCHARGE && val[0] != WAIT) return 0; /// * Only the states of the test steps are accepted
+    if ((val[0] > PS_DC_res && val[0] != CYCLE) || val[2] >= END_COUNT || n >= PROFILE_MAX - 1) return 0;
+    if (val[0] == CYCLE && val[3] >= n) return 0; /// * A #CYCLE step can only go back to a previous step
+    custom_profile[n].state = (uint8_t) val[0];
+    custom_profile[n].current = val[1];
+    custom_profile[n].end = (uint8_t) val[2];
+    custom_profile[n].limit = val[3];
+    custom_profile[n].timeout = val[4];
+    return 1;
 }
 
 /**@brief This function is executed every time a whole test process for one cell is finished
 */
 void fISDONE()
 {
+    /**In #parallel mode, the cell is marked as done and the converter goes to the next cell with #cell_switch(),
+    also if it is still resting. When all the cells are done, the program goes to the #STANDBY state.*/
+    if (parallel)
+    {
+        UART_send_string((char*)">END<");
+        ctx->done = 1;
+        if (!cell_switch(1)) ctx->state = STANDBY;
+        return;
+    }
     /**The function will check if the current cell number (@p cell_count) is smaller than the 
     number of cells to be tested (@p cell_max)*/
     if (cell_count < cell_max)
@@ -270,15 +518,76 @@ void fISDONE()
         __delay_ms(500);
         /**If the condition is @b TRUE the counter will be incremented */       
         cell_count++;
-        /**And the testin process of the next cell will be started by going to the @p IDLE state*/
-        state = IDLE;   
+        /**And the testin process of the next cell will be started with its context by going to the @p IDLE state*/
+        ctx = &cells[cell_count - '1'];
+        ctx->state = IDLE;   
     }else
     {
         UART_send_string((char*)">END<");
-        state = STANDBY;
+        ctx->state = STANDBY;
     }    
 }
 
+/**@brief This function schedules the cells in #parallel mode. It runs every second from #state_machine().
+
+Only the running cell (#cell_count) uses the converter. The rests of the other cells are counted down in the
+background, and when the running cell starts a rest, the converter is given to a cell that is ready with
+#cell_switch(). So the rests of a cell overlap with the charges and discharges of the others.
+@return 1 if another cell was loaded
+*/
+bool scheduler()
+{
+    unsigned char k;
+    for (k = 0; k < CELLS; k++) /// * Count down the rests of the cells that are not running
+    {
+        if (&cells[k] != ctx && cells[k].state == WAIT && cells[k].wait_count) cells[k].wait_count--;
+    }
+    return (ctx->state == WAIT && cell_switch(0)); /// * If the running cell is resting, give the converter to a cell that is ready
+}
+
+/**@brief This function gives the converter to the next cell in #parallel mode by pointing #ctx to its context.
+
+A cell is ready when its profile was not started or its rest is finished. The cells are searched from the running
+one, so they take turns with the converter.
+@param force Go to the resting cell with the shortest rest left if no cell is ready
+@return 0 if there was no cell to go to
+*/
+bool cell_switch(bool force)
+{
+    struct cell *c;
+    unsigned char n = cell_count - '1';
+    unsigned char next = CELLS;
+    unsigned char k;
+    for (k = 1; k < CELLS; k++)
+    {
+        c = &cells[(n + k) % CELLS];
+        if (c->done) continue;
+        if (force && (next == CELLS || c->wait_count < cells[next].wait_count)) next = (n + k) % CELLS;
+        if (!c->started || c->state != WAIT || !c->wait_count)
+        {
+            next = (n + k) % CELLS;
+            break;
+        }
+    }
+    if (next == CELLS) return 0;
+    cell_count = next + '1'; /// * The next cell is printed and becomes the running cell
+    ctx = &cells[next];
+    LINEBREAK;
+    UART_send_string((char*)cell_str);
+    display_value_u((uint16_t)(next + 1));
+    LINEBREAK;
+    if (!ctx->started) /// * If its profile was not started, it is started from the first step
+    {
+        ctx->started = 1;
+        ctx->prev_state = IDLE;
+        ctx->step_idx = 0;
+        ctx->cycle = 0;
+        CYCLE_RESET(ctx);
+        step_start(ctx);
+    }
+    return 1;
+}
+
 /**@brief This function define the FAULT state of the state machine.
 */
 void fFAULT()
@@ -286,40 +595,72 @@ void fFAULT()
     /**The function will stop the converter using #STOP_CONVERTER()  macro*/
     STOP_CONVERTER();
     /**The @p state will be set to @p STANDBY*/
-    state = STANDBY;
+    ctx->state = STANDBY;
 }
 
-/**@brief Function to start the state machine.
+/**@brief This function selects the #profile of the #option and searches its #CYCLE step for #cycle_add().
+* @return 0 if the profile has no #ISDONE or #CYCLE step in its first #PROFILE_MAX steps
 */
-void start_state_machine()
+bool profile_select()
 {
-    /**First,*/
     switch(option)
     {
-        /**Check the option (CHANGE)*/
         case '1':
-            /**> if @option is equal to @b 1 it will set the @p state as @p PREDISCHARGE*/
-            state = PREDISCHARGE;
+            profile = profile_1;
             break;
         case '2':
-            /**> if @option is equal to @b 2 it will set the @p state as @p CHARGE*/
-            state = CHARGE;
+            profile = profile_2;
             break;
         case '3':
-            /**> if @option is equal to @b 3 it will set the @p state as @p CHARGE*/
-            state = CHARGE;            
+            profile = profile_3;
             break;
         case '4':
-            /**> if @option is equal to @b 4 it will set the @p state as @p DISCHARGE*/
-            state = DISCHARGE;                
+            profile = profile_4;
             break;
+        case '6':
+            profile = profile_6;
+            break;
+        default:
+            profile = custom_profile;
+            break;
+    }
+    cycle_first = 0; /// Then the #CYCLE step of the profile is searched
+    cycle_end = 0;
+    while (cycle_end < PROFILE_MAX && profile[cycle_end].state != ISDONE && profile[cycle_end].state != CYCLE) cycle_end++;
+    if (cycle_end == PROFILE_MAX) /// A profile without an end is not run
+    {
+        cycle_end = 0;
+        return 0;
+    }
+    if (profile[cycle_end].state == CYCLE) cycle_first = (unsigned char) profile[cycle_end].limit;
+    else cycle_end = 0;
+    return 1;
+}
+
+/**@brief Function to start the state machine.
+*/
+void start_state_machine()
+{
+    /**First, the #profile is selected according to the #option with #profile_select() and the test starts from its
+    first step. A profile that #profile_select() rejects goes back to the #STANDBY state.*/
+    if (!profile_select())
+    {
+        UART_send_string((char*)profile_err_str);
+        LINEBREAK;
+        ctx->state = STANDBY;
+        goto NOSTART;
     }
+    ctx->step_idx = 0;
+    ctx->cycle = 0; /// Then the cycle counter and its summary are cleared
+    CYCLE_RESET(ctx);
     /**First, this function will declare and initialized to zero a variable called @p start, which will
     be used to store the input of the user.*/ 
     unsigned char start = 0;
     switch (cell_count){
         /**If the current cell is the first (<tt>cell_count</tt>) , it will ask for user intervention to start.*/
         case '1':
+            /**In #remote mode the test was already started by #command().*/
+            if (remote) break;
             /**It will prompt the user to press @b s.*/
             UART_send_string((char*)press_s_str);
             LINEBREAK;                  
@@ -334,7 +675,7 @@ void start_state_machine()
                         break;
                     /**The user also can press @b ESC and the program will be restarted to the @p STANBY state.*/ 
                     case 0x1B:
-                        state = STANDBY;
+                        ctx->state = STANDBY;
                         goto NOSTART;  //go to the end of the function 
                     /**If the user press something different from @b s, or @b ESC the program will print 
                     a warning message and wait for a valid input.*/
@@ -369,37 +710,45 @@ void start_state_machine()
 */
 void converter_settings()
 {
-    kp = CC_kp; /// * The proportional constant, #kp is set to #CC_kp
-    ki = CC_ki; /// * The proportional constant, #kp is set to #CC_kp
-    cmode = 1; /// * Start in constant current mode by setting. #cmode
-    intacum = 0; /// * The #integral component of the compensator is set to zero.*/
-    qavg = 0; /// * Average capacity, #q_prom is set to zero.*/
-    vmax = 0; /// * Maximum averaged voltage, #vmax is set to zero.*/
-    dc = DC_MIN;
+    ctl.kp = CC_KP_GAIN; /// * The proportional gain, control::kp is set to #CC_KP_GAIN
+    ctl.ki = CC_KI_GAIN; /// * The integral gain, control::ki is set to #CC_KI_GAIN
+    ctl.cmode = 1; /// * Start in constant current mode by setting. control::cmode
+    ctl.intacum = 0; /// * The #integral component of the compensator is set to zero.*/
+    ctl.track = 0; /// * No transfer to CV mode (control::track) or feed-forward (control::ffwd) is pending
+    ctl.ffwd = 0;
+    COULOMB_RESET(); /// * The charge and energy counters and cell::qavg are set to zero by calling #COULOMB_RESET()
+    ctx->step_tmax = 0;
+    filter_reset(); /// * The ADC filters are loaded again by calling #filter_reset()
+    ctx->vmax_hr = 0; /// * Maximum averaged voltage, cell::vmax_hr is set to zero.*/
+    ctl.dc = DC_MIN;
     set_DC();  /// * The #set_DC() function is called
     Cell_ON(); /// * The #Cell_ON() function is called
-    switch(state)
+    switch(ctx->state)
     {
         case POSTCHARGE:
         case CHARGE: /// If the current state is @p POSTCHARGE or @p CHARGE
-            iref = i_char; /// * The current setpoint, #iref is defined as #i_char
-            timeout = ((capacity / ccref) * 66); /// * Charging #timeout is set to 10% more @b only_for}_NIMH
+            ctl.iref = i_char; /// * The current setpoint, control::iref is defined as #i_char, or the current of the step
+            if (profile[ctx->step_idx].current) ctl.iref = C_TO_ADC(profile[ctx->step_idx].current, 1);
+            ctl.ffwd = 1; /// * The duty cycle is estimated from the cell voltage in the first control period, see #feed_forward()
+            ctx->timeout = (uint16_t) (((uint32_t) capacity * 6 * chem.timeout / 10) / (profile[ctx->step_idx].current ? profile[ctx->step_idx].current : ccref)); /// * Charging cell::timeout is set to chem::timeout percent of the charge time (110 % for Ni-MH)
             SET_CHAR(); /// * The charge/discharge relay is set in charge position by calling the #SET_CHAR() macro
             break;
         case PREDISCHARGE:
         case DISCHARGE: /// If the current state is @p PREDISCHARGE or @p DISCHARGE
-            iref = i_disc; /// * The current setpoint, #iref is defined as #i_disc
+            ctl.iref = i_disc; /// * The current setpoint, control::iref is defined as #i_disc, or the current of the step
+            if (profile[ctx->step_idx].current) ctl.iref = C_TO_ADC(profile[ctx->step_idx].current, 1);
             SET_DISC(); /// * The charge/discharge relay is set in discharge position by calling the #SET_DISC() macro
             break;
         case CS_DC_res:
         case DS_DC_res:
         case PS_DC_res: /// If the current state is #CS_DC_res, #DS_DC_res or #PS_DC_res
-            iref = (uint16_t) ( ( ( capacity * 4096.0 ) / (5000 * 2.5 * 5 ) ) + 0.5 ); /// * The current setpoint, #iref is defined as <tt> capacity / 5 </tt>
-            dc_res_count = DC_RES_SECS; /// * The #dc_res_count is set to #DC_RES_SECS
+            ctl.iref = C_TO_ADC(capacity, 5); /// * The current setpoint, control::iref is defined as <tt> capacity / 5 </tt>
+            ctx->dc_res_count = DC_RES_SECS; /// * The cell::dc_res_count is set to #DC_RES_SECS
             SET_DISC(); /// * The charge/discharge relay is set in discharge position by calling the #SET_DISC() macro
             break;
     }
-    __delay_ms(10);   
+    relay_queue(RELAY_OP(RELAY_NONE, 0), RELAY_SETTLE_MS); /// * Let the contacts settle for #RELAY_SETTLE_MS
+    conv = 1; /// * Activate the control loop by setting #conv, it starts in the ISR as soon as the relay sequencer is done (#RELAY_BUSY())
 }
 /**@brief Function to define the parameters of the testing process for both chemistries.
 */
@@ -409,42 +758,18 @@ void param()
     be used to store the input of the user.*/
     unsigned char input = 0;
     /**Then, it will show the pre-set parameters for charging that are:*/
-    /**For Li Ion:*/
-    /**@code
-    Li_Ion_CV = 4200 mV
-    Li_Ion_CAP = 3250 mAh 
-    @endcode*/ 
-    /**For Ni_MH:*/
-    /**@code
-    Ni_MH_CV = 1700 mV //Just for protection for now, maybe is not necessary to show it
-    Ni_MH_CAP = 2500 mAh
-    @endcode*/
+    /**They are taken from the selected chemistry, #chem (for example 4200 mV and 3250 mAh for Li-Ion, 1750 mV and
+    2000 mAh for Ni-MH), see #chem_menu() to change them.*/
     LINEBREAK;  
-    #if (LI_ION_CHEM)    
-    cvref = (uint16_t) ( ( Li_Ion_CV * 4096 ) / 5000) + 0.5; //Scale the voltage refence to be compare with v
-    cvv = Li_Ion_CV;
+    param_chem(); /// The setpoints of the chemistry are set with #param_chem()
     UART_send_string((char*)cv_val_str);
-    display_value_u(Li_Ion_CV);
+    display_value_u(chem.cv);
     UART_send_string((char*)mV_str);
     LINEBREAK;
-    /** The @p capacity will be set to @p Li_Ion_CAP.*/
-    capacity = Li_Ion_CAP;
+    /** The @p capacity is chem::cap.*/
     UART_send_string((char*)nom_cap_str);
     display_value_u(capacity);
     UART_send_string((char*)mAh_str);
-    #elif (NI_MH_CHEM) 
-    vref = (uint16_t) ( ( ( Ni_MH_CV * 4096.0 ) / 5000 ) + 0.5 ); //Scale the voltage reference to be compare with v
-    cvref = Ni_MH_CV;
-    UART_send_string((char*)cv_val_str);
-    display_value_u(Ni_MH_CV);
-    UART_send_string((char*)mV_str);
-    LINEBREAK;
-    /** The @p capacity will be set to @p Ni_MH_CAP.*/
-    capacity = Ni_MH_CAP;
-    UART_send_string((char*)nom_cap_str);
-    display_value_u(capacity);
-    UART_send_string((char*)mAh_str);
-    #endif
     LINEBREAK;
     LINEBREAK;    
     /**For the charging current it will print three options:*/
@@ -459,6 +784,9 @@ void param()
     /** - 3) 1 C*/
     UART_send_string((char*)one_c_str);
     LINEBREAK;
+    /** - c) Select or edit the chemistry with #chem_menu()*/
+    UART_send_string((char*)chem_opt_str);
+    LINEBREAK;
     LINEBREAK;
     /** .*/
     while(input == 0)
@@ -469,26 +797,34 @@ void param()
         {   
             /**After chosing the charging current, the program will assign it to @p i_char and print it.*/
             case '1':
-                i_char = (uint16_t) ( ( ( capacity * 4096.0 ) / (5000 * 2.5 * 4 ) ) + 0.5 );
-                ccref = (uint16_t) ( (capacity / 4) + 0.5 );
+                i_char = C_TO_ADC(capacity, 4);
+                ccref = capacity / 4;
                 UART_send_string((char*)char_def_quarter_str);  //0.25C
                 LINEBREAK;
                 break;
             case '2':
-                i_char = (uint16_t) ( ( ( capacity * 4096.0 ) / (5000 * 2.5 * 2 ) ) + 0.5 );
-                ccref = (uint16_t) ( (capacity / 2) + 0.5 );
+                i_char = C_TO_ADC(capacity, 2);
+                ccref = capacity / 2;
                 UART_send_string((char*)char_def_half_str);  //0.5C
                 LINEBREAK;
                 break;
             case '3':
-                i_char = (uint16_t) ( ( ( capacity * 4096.0 ) / (5000 * 2.5 * 1 ) ) + 0.5 );
-                ccref = (uint16_t) ( (capacity / 1) + 0.5 );
+                i_char = C_TO_ADC(capacity, 1);
+                ccref = capacity;
                 UART_send_string((char*)char_def_one_str);  //0.1C
                 LINEBREAK;
                 break;
+            /**With @b c the chemistry is selected or edited with #chem_menu() and the menu starts again with its parameters.*/
+            case 'c':
+                chem_menu();
+                ctx->state = STANDBY;
+                LINEBREAK;
+                UART_send_string((char*)restarting_str);  //restarting...
+                LINEBREAK; 
+                goto ESCAPE;
                 /**Unless the user press @e ESC, in that case the program will be restarted to the @p STANBY state.*/
                 case 0x1B:
-                state = STANDBY;
+                ctx->state = STANDBY;
                 LINEBREAK;
                 UART_send_string((char*)restarting_str);  //restarting...
                 LINEBREAK; 
@@ -506,24 +842,18 @@ void param()
     /**Variable @p input is cleared*/
     input = 0; 
     /**Next, the program will show the end-of-charge parameters that are:*/
-    /**For Li Ion, the end-of-charge current:*/
-    /**@code
-    Li_Ion_EOC_I = 100 mA
-    @endcode*/ 
-    /**For Ni_MH, the end-of-charge voltage drop:*/
-    /**@code
-    Ni_MH_EOC_DV = 10 mV
-    @endcode*/
-    #if (LI_ION_CHEM)
-    EOC_current = Li_Ion_EOC_I;
-    UART_send_string((char*)EOC_I_str);
-    display_value(EOC_current);
-    UART_send_string((char*)mA_str);
-    #elif (NI_MH_CHEM) 
-    UART_send_string((char*)EOC_DV_str);
-    display_value_u(Ni_MH_EOC_DV);
-    UART_send_string((char*)mV_str);
-    #endif    
+    /**The end-of-charge voltage drop with #CHEM_DV (Ni-MH, 10 mV), else the end-of-charge current (Li-Ion, 100 mA).*/
+    if (chem.flags & CHEM_DV)
+    {
+        UART_send_string((char*)EOC_DV_str);
+        display_value_u(chem.eoc);
+        UART_send_string((char*)mV_str);
+    }else
+    {
+        UART_send_string((char*)EOC_I_str);
+        display_value_u(EOC_current);
+        UART_send_string((char*)mA_str);
+    }
     LINEBREAK; 
     LINEBREAK;
     /**For the discharging current it will show three options:*/
@@ -548,23 +878,26 @@ void param()
         {
             /**After chosing the discharging current, the program will assign it to @p i_disc and print it.*/
             case '1':
-                i_disc = (uint16_t) ( ( ( capacity * 4096.0) / ( 5000 * 2.5 * 4 ) ) + 0.5 );
+                i_disc = C_TO_ADC(capacity, 4);
+                dcref = capacity / 4;
                 UART_send_string((char*)dis_def_quarter_str);  //0.25 C
                 LINEBREAK;            
                 break;
             case '2':
-                i_disc = (uint16_t) ( ( ( capacity * 4096.0 ) / ( 5000 * 2.5 * 2 ) ) + 0.5 );
+                i_disc = C_TO_ADC(capacity, 2);
+                dcref = capacity / 2;
                 UART_send_string((char*)dis_def_half_str);  //0.5 C
                 LINEBREAK;         
                 break;
             case '3':
-                i_disc = (uint16_t) ( ( ( capacity * 4096.0 ) / ( 5000 * 2.5 * 1 ) ) + 0.5 );
+                i_disc = C_TO_ADC(capacity, 1);
+                dcref = capacity;
                 UART_send_string((char*)dis_def_one_str);  //1C
                 LINEBREAK;
                 break;
             /**Unless the user press @e ESC, in that case the program will be restarted to the @p STANBY state.*/
             case 0x1B:  //ESC button was pressed
-                state = STANDBY;
+                ctx->state = STANDBY;
                 LINEBREAK;
                 UART_send_string((char*)restarting_str);  //restarting...
                 LINEBREAK;             
@@ -582,24 +915,19 @@ void param()
     /**Varible @p input is cleared*/
     input = 0;
     /**Next, the program will show the end-of-discharge voltage constant that is: ((CHANGE THIS STYLE))*/
-    /**For Li Ion:*/
-    /**@code
-    Li_Ion_EOD_V = 3000 mV
-    @endcode*/ 
-    /**For Ni_MH:*/
-    /**@code
-    Ni_MH_EOD_V = 1000 mV
-    @endcode*/
-    #if (LI_ION_CHEM)
-    EOD_voltage = Li_Ion_EOD_V;
+    /**It is chem::eod, 3000 mV for Li-Ion and 1000 mV for Ni-MH.*/
     UART_send_string((char*)EOD_V_str);
-    #elif (NI_MH_CHEM)
-    EOD_voltage = Ni_MH_EOD_V;  //This is compared to vavg
-    UART_send_string((char*)EOD_V_str);
-    #endif
     display_value_u(EOD_voltage);
     UART_send_string((char*)mV_str);
     LINEBREAK;
+    /**And the rest between the steps: a fixed time or the threshold of the adaptive rest, #rest_dv*/
+    UART_send_string((char*)rest_str);
+    if (rest_dv)
+    {
+        display_value_u(rest_dv);
+        UART_send_string((char*)uV_min_str);
+    }else UART_send_string((char*)rest_fixed_str);
+    LINEBREAK;
     /**For the test cycle it will show four options:*/
     LINEBREAK;
     UART_send_string((char*)cho_bet_str);
@@ -616,6 +944,18 @@ void param()
     /** - 4) Only Discharge*/
     UART_send_string((char*)op_4_str);
     LINEBREAK;
+    /** - 5) The uploaded profile, see #profile_upload()*/
+    UART_send_string((char*)op_5_str);
+    LINEBREAK;
+    /** - 6) Predischarge->(Charge->Discharge) x N->Postcharge, the number of cycles is asked after the option*/
+    UART_send_string((char*)op_6_str);
+    LINEBREAK;
+    /** - w) Define the threshold of the adaptive rest*/
+    UART_send_string((char*)op_w_str);
+    LINEBREAK;
+    /** - p) Upload a profile*/
+    UART_send_string((char*)op_p_str);
+    LINEBREAK;
     LINEBREAK;
     /** .*/
     while(option == 0)
@@ -645,9 +985,37 @@ void param()
                 UART_send_string((char*)op_4_sel_str);  //Only Discharge
                 LINEBREAK;             
                 break;
+            case '6':
+                LINEBREAK;
+                UART_send_string((char*)op_6_sel_str);  //Cycling
+                LINEBREAK;
+                UART_send_string((char*)def_cycles_str);
+                cycles = UART_get_number(); /// With option 6 the number of #cycles is asked
+                if (!cycles) cycles = 1;
+                LINEBREAK;
+                break;
+            case '5':
+                if (custom_len) /// The uploaded profile can only be selected if there is one, else it is asked first
+                {
+                    LINEBREAK;
+                    UART_send_string((char*)op_5_sel_str);  //Uploaded profile
+                    LINEBREAK;
+                    break;
+                }
+            case 'p': /// With @b p a new profile is uploaded with #profile_upload() and the option is asked again
+                custom_len = profile_upload();
+                option = 0;
+                break;
+            case 'w': /// With @b w the threshold of the adaptive rest is asked and stored with #rest_store(), and the option is asked again
+                LINEBREAK;
+                UART_send_string((char*)def_rest_str);
+                rest_store(UART_get_number());
+                LINEBREAK;
+                option = 0;
+                break;
             /**Unless the user press @e ESC, in that case the program will be restarted to the @p STANBY state.*/
             case 0x1B:
-                state = STANDBY;
+                ctx->state = STANDBY;
                 LINEBREAK;
                 UART_send_string((char*)restarting_str);
                 LINEBREAK;
@@ -657,7 +1025,7 @@ void param()
             default:
                 option = 0;
                 LINEBREAK;
-                UART_send_string((char*)num_1and4_str);  //ask the user to use a number between 1 and 4.
+                UART_send_string((char*)num_1and6_str);  //ask the user to use a number between 1 and 6.
                 LINEBREAK;
                 break;
         }
@@ -699,7 +1067,7 @@ void param()
                 break;
             /**Unless the user press @b ESC, in that case the program will be restarted to the @p STANBY state.*/
             case 0x1B:
-                state = STANDBY;
+                ctx->state = STANDBY;
                 LINEBREAK;
                 UART_send_string((char*)restarting_str);
                 LINEBREAK;
@@ -714,7 +1082,486 @@ void param()
                 break;
         }           
     }
+    /**With more than one cell, the program will ask if the cells are tested in #parallel*/
+    if (cell_max > '1')
+    {
+        UART_send_string((char*)parallel_str);
+        LINEBREAK;
+        unsigned char yn = 0;
+        while (yn == 0)
+        {
+            yn = UART_get_char();
+            switch (yn)
+            {
+                case 'y':
+                    parallel = 1;
+                    break;
+                case 'n':
+                    parallel = 0;
+                    break;
+                case 0x1B:
+                    ctx->state = STANDBY;
+                    LINEBREAK;
+                    UART_send_string((char*)restarting_str);
+                    LINEBREAK;
+                    goto ESCAPE;  //go to the end of the function
+                default:
+                    yn = 0;
+                    break;
+            }
+        }
+        LINEBREAK;
+    }
     /**After the user has set the number of cells the program will go to the @p IDLE state. @see fIDLE()*/
-    state = IDLE;  //go to IDLE state
+    ctx->state = IDLE;  //go to IDLE state
     ESCAPE: ;  //label to goto the end of the function 
-}
\ No newline at end of file
+}
+/**@brief This function sets the setpoints of the selected chemistry, #chem: CV (#ctl and #cvref), #capacity,
+* #EOC_current (unless the charge ends by -dV, #CHEM_DV) and #EOD_voltage.
+*/
+void param_chem()
+{
+    ctl.vref = MV_TO_ADC(chem.cv); //Scale the voltage reference to be compare with v
+    trip_v = MV_TO_ADC(chem.cv + TRIP_V_MV); //Over-voltage limit of #trip_check()
+    cvref = chem.cv;
+    capacity = chem.cap;
+    if (!(chem.flags & CHEM_DV)) EOC_current = chem.eoc;
+    EOD_voltage = chem.eod;  //This is compared to vavg
+}
+/**@brief This function offers to resume the test of the checkpoint at #ckpt_addr, interrupted by a reset. It prints
+* the cell, the step and the minute of the checkpoint and waits for a key: @b r resumes the test with #resume(), @b ESC
+* (also a command line) restarts the #STANDBY state and any other key goes on to the menu of #param().
+* @return 1 if the menu is not shown
+*/
+bool resume_ask()
+{
+    struct ckpt k;
+    ee_read(ckpt_addr, &k, sizeof(struct ckpt));
+    UART_send_string((char*)interrupted_str); /// * Print <tt> Interrupted test of cell 1 at step 3, minute 42 </tt>
+    UART_send_char(k.cell_count);
+    UART_send_string((char*)at_step_str);
+    display_value_u((uint16_t) (k.step_idx + 1));
+    UART_send_string((char*)at_minute_str);
+    display_value_u(k.minute);
+    LINEBREAK;
+    UART_send_string((char*)press_r_str);
+    LINEBREAK;
+    switch (UART_get_char())
+    {
+        case 'r':
+            resume();
+            return 1;
+        case 0x1B:
+            LINEBREAK;
+            UART_send_string((char*)restarting_str);
+            LINEBREAK;
+            return 1;
+    }
+    LINEBREAK;
+    return 0;
+}
+/**@brief This function resumes the test of the checkpoint at #ckpt_addr. The parameters of the test are restored,
+* the step of the checkpoint is started again with #step_start() and its charge, energy, maximum voltage and time
+* are restored, so the termination criteria and the timeouts of the step go on where they were. A #WAIT step rests
+* the time it had left. The summary of the cycle restarts with the resumed step, and a DC resistance step is
+* measured again.
+*/
+void resume()
+{
+    struct ckpt k;
+    ee_read(ckpt_addr, &k, sizeof(struct ckpt));
+    if (k.chem != chem_sel) chem_select(k.chem); /// * The chemistry, the currents, the option, the cells and the #cycles of the test are restored
+    param_chem();
+    ccref = k.ccref;
+    i_char = C_TO_ADC(k.ccref, 1);
+    dcref = k.dcref;
+    i_disc = C_TO_ADC(k.dcref, 1);
+    option = k.option;
+    cell_max = k.cell_max;
+    parallel = 0;
+    cycles = k.cycles;
+    cell_count = k.cell_count; /// * The cell of the checkpoint becomes the running cell #ctx and its #profile is selected with #profile_select()
+    ctx = &cells[cell_count - '1'];
+    ckpt_valid = 0;
+    if (!profile_select())
+    {
+        UART_send_string((char*)profile_err_str);
+        LINEBREAK;
+        ctx->state = STANDBY;
+        return;
+    }
+    ctx->step_idx = k.step_idx;
+    ctx->prev_state = k.prev_state;
+    ctx->cycle = k.cycle;
+    CYCLE_RESET(ctx);
+    LINEBREAK; /// * Print <tt> Resuming... </tt> and the cell, like the start of a test
+    UART_send_string((char*)resuming_str);
+    LINEBREAK;
+    LINEBREAK;
+    UART_send_string((char*)cell_str);
+    display_value_u((uint16_t)(cell_count - '0'));
+    LINEBREAK;
+    fault = FAULT_NONE;
+    step_start(ctx); /// * Start the step again with #step_start(), then restore the progress of the step
+    if (ctx->state == WAIT)
+    {
+        if (k.wait_count) ctx->wait_count = k.wait_count;
+    }else
+    {
+        cc_uah = k.uah;
+        cc_uah_last = k.uah;
+        ctx->qavg = (uint16_t) (k.uah / 100);
+        cc_uwh = k.uwh;
+        ctx->vmax_hr = k.vmax_hr;
+        minute = k.minute;
+        second = k.second;
+        LOG_ON(); /// * The log is on, so #log_control() does not reset the time of the step
+    }
+    ckpt_run = 1; /// * The checkpoints go on from the resumed step
+    ckpt_save();
+    interrupt_enable(); /// * Enable the interrupts as #fIDLE() does
+}
+/**@brief This function runs the command line in #cmd_line, received by #cmd_rx(). It is the machine interface of
+* the board, in place of the menus of #param() and #start_state_machine(). A command is a word and comma separated
+* fields, each one a tag and a number like the records of the log, for example <tt> $SET,K2,IC500,ID500,O3,N1 </tt>:
+* - @p $SET: set the parameters with #cmd_set()
+* - @p $STEP: add a step to the uploaded profile with #cmd_step()
+* - @p $START: start the test with the parameters set
+* - @p $ABORT: stop the test and go to #STANDBY
+* - @p $STATUS: send the status with #cmd_status()
+* - @p $MENU: leave the #remote mode, the menu is shown again
+* - @p $RESUME: resume the test interrupted by a reset with #resume(), if the status has @p R1
+*
+* The answer is <tt> $OK< </tt> or <tt> $ERR< </tt>. @p $SET, @p $STEP and @p $START are only accepted in #STANDBY.
+* Any command but @p $MENU puts the board in #remote mode, where #STANDBY sends the status instead of the menu.
+*/
+void command()
+{
+    char *s = &cmd_line[1];
+    char *args = s;
+    bool ok = 0;
+    while (*args && *args != ',') args++; /// * The word is split from the fields
+    if (*args) *args++ = 0;
+    if (cmd_line[0] != CMD_START) *s = 0; /// * An emptied #cmd_line (the line did not fit) is not a command
+    remote = 1;
+    if (!strcmp(s, cmd_status_str))
+    {
+        cmd_status();
+        ok = 1;
+    }else if (!strcmp(s, cmd_abort_str) || !strcmp(s, cmd_menu_str)) /// * @p $ABORT and @p $MENU stop the converter and go to #STANDBY at once
+    {
+        remote = !strcmp(s, cmd_abort_str);
+        STOP_CONVERTER();
+        ctx->state = STANDBY;
+        SECF = 1;
+        ok = 1;
+    }else if (ctx->state == STANDBY)
+    {
+        if (!strcmp(s, cmd_set_str)) ok = cmd_set(args);
+        else if (!strcmp(s, cmd_step_str)) ok = cmd_step(args);
+        else if (!strcmp(s, cmd_start_str) && i_char && i_disc && option && cell_max) /// * @p $START needs both currents, the option and the cells
+        {
+            ctx->state = IDLE;
+            SECF = 1;
+            ok = 1;
+        }else if (!strcmp(s, cmd_resume_str) && ckpt_valid)
+        {
+            resume();
+            ok = 1;
+        }
+    }
+    LINEBREAK;
+    UART_send_string((char*)(ok ? cmd_ok_str : cmd_err_str));
+    LINEBREAK;
+    CMDF = 0; /// * The next command line can be received
+}
+/**@brief This function sets the parameters of the test from the fields of @p $SET. The fields that are not given
+* keep their values:
+* - @p K: chemistry of the EEPROM table, from 1 to #CHEMS, selected with #chem_select()
+* - @p IC, @p ID: charge and discharge currents in mA, up to 1C of the chemistry
+* - @p O: option, from 1 to 6 (5 needs a profile, see #cmd_step())
+* - @p N: number of cells, from 1 to 4
+* - @p P: 1 to test the cells in #parallel
+* - @p Y: number of #cycles
+* - @p W: threshold of the adaptive rest in uV/min, 0 for a fixed time, see #rest_store()
+* - @p FV, @p FI, @p FT: filter of the voltage, current and temperature channels, one of the @link filters @endlink, see #filter_select()
+* @param s fields of the command
+* @return 0 if a field is not valid, then nothing is changed
+*/
+bool cmd_set(char *s)
+{
+    struct chem c;
+    char tag[2];
+    uint16_t val;
+    uint8_t k = chem_sel;
+    uint16_t ic = ccref;
+    uint16_t id = dcref;
+    unsigned char o = option;
+    unsigned char n = cell_max;
+    bool p = parallel;
+    uint16_t y = cycles;
+    uint16_t w = rest_dv;
+    uint8_t f[3] = { filt[FILT_V].mode, filt[FILT_I].mode, filt[FILT_T].mode };
+    uint8_t j;
+    while (s && *s)
+    {
+        s = cmd_field(s, tag, &val);
+        switch (tag[0])
+        {
+            case 'K':
+                if (!val || val > CHEMS) return 0;
+                k = (uint8_t) (val - 1);
+                break;
+            case 'I':
+                if (tag[1] == 'C') ic = val;
+                else if (tag[1] == 'D') id = val;
+                else return 0;
+                break;
+            case 'O':
+                if (!val || val > 6 || (val == 5 && !custom_len)) return 0;
+                o = (unsigned char) (val + '0');
+                break;
+            case 'N':
+                if (!val || val > CELLS) return 0;
+                n = (unsigned char) (val + '0');
+                break;
+            case 'P':
+                p = (val != 0);
+                break;
+            case 'Y':
+                if (!val) return 0;
+                y = val;
+                break;
+            case 'W':
+                w = val;
+                break;
+            case 'F':
+                if (val > FILTER_MED3) return 0;
+                if (tag[1] == 'V') f[FILT_V] = (uint8_t) val;
+                else if (tag[1] == 'I') f[FILT_I] = (uint8_t) val;
+                else if (tag[1] == 'T') f[FILT_T] = (uint8_t) val;
+                else return 0;
+                break;
+            default:
+                return 0;
+        }
+    }
+    ee_read(EE_CHEM + k * sizeof(struct chem), &c, sizeof(struct chem)); /// * The currents are checked against the capacity of the new chemistry
+    if (ic > c.cap || id > c.cap) return 0;
+    if (k != chem_sel) chem_select(k);
+    param_chem();
+    ccref = ic;
+    i_char = C_TO_ADC(ic, 1);
+    dcref = id;
+    i_disc = C_TO_ADC(id, 1);
+    option = o;
+    cell_max = n;
+    parallel = p && (n > '1');
+    cycles = y;
+    if (w != rest_dv) rest_store(w);
+    for (j = 0; j < 3; j++) if (f[j] != filt[j].mode) filter_select(j, f[j]);
+    return 1;
+}
+/**@brief This function adds a step to the uploaded profile from the fields of @p $STEP: @p S state, @p I current,
+* @p E end, @p L limit and @p T timeout, as the numbers of #profile_upload(). A @p $STEP without fields clears the profile.
+* @param s fields of the command
+* @return 0 if the step is not valid
+*/
+bool cmd_step(char *s)
+{
+    uint16_t val[5] = {0, 0, 0, 0, 0};
+    unsigned char n = custom_len ? custom_len - 1 : 0;
+    char tag[2];
+    uint16_t v;
+    if (!*s)
+    {
+        custom_len = 0;
+        custom_profile[0].state = ISDONE;
+        if (option == '5') option = 0;
+        return 1;
+    }
+    while (s && *s)
+    {
+        s = cmd_field(s, tag, &v);
+        switch (tag[0])
+        {
+            case 'S':
+                val[0] = v;
+                break;
+            case 'I':
+                val[1] = v;
+                break;
+            case 'E':
+                val[2] = v;
+                break;
+            case 'L':
+                val[3] = v;
+                break;
+            case 'T':
+                val[4] = v;
+                break;
+            default:
+                return 0;
+        }
+    }
+    if (!profile_step(val, n)) return 0;
+    custom_profile[n + 1].state = ISDONE; /// * The profile is closed with an #ISDONE step after each new step
+    custom_len = n + 2;
+    return 1;
+}
+/**@brief This function sends the status of the board as a record,
+* <tt> $S,Ccell,Sstate,Kchemistry,ICmA,IDmA,Ooption,Ncells,Pparallel,Ycycles,Wuv,Lsteps,Rresume< </tt>. The option and the
+* cells are 0 while they are not set, the steps are the ones of the uploaded profile. @p R is 1 if a test interrupted
+* by a reset can be resumed with @p $RESUME.
+*/
+void cmd_status()
+{
+    LINEBREAK;
+    UART_send_string((char*)"$S");
+    cmd_value("C", (uint16_t) (cell_count - '0'));
+    cmd_value("S", ctx->state);
+    cmd_value("F", fault);
+    cmd_value("K", (uint16_t) (chem_sel + 1));
+    cmd_value("IC", ccref);
+    cmd_value("ID", dcref);
+    cmd_value("O", option ? (uint16_t) (option - '0') : 0);
+    cmd_value("N", cell_max ? (uint16_t) (cell_max - '0') : 0);
+    cmd_value("P", parallel);
+    cmd_value("Y", cycles);
+    cmd_value("W", rest_dv);
+    cmd_value("FV", filt[FILT_V].mode);
+    cmd_value("FI", filt[FILT_I].mode);
+    cmd_value("FT", filt[FILT_T].mode);
+    cmd_value("L", custom_len ? (uint16_t) (custom_len - 1) : 0);
+    cmd_value("R", ckpt_valid);
+    UART_send_char('<');
+    LINEBREAK;
+}
+/**@brief This function sends one field of a record, a comma, the @p tag and the @p value
+*/
+void cmd_value(const char *tag, uint16_t value)
+{
+    UART_send_char(comma);
+    UART_send_string((char*)tag);
+    display_value_u(value);
+}
+/**@brief This function reads one field of a command, one or two capital letters and a decimal number
+* @param s Start of the field
+* @param tag Receives the letters, 0 if there is none. The first one is 0 if the field is not valid
+* @param val Receives the number, 0 if there is none
+* @return Start of the next field, NULL if this was the last one
+*/
+char *cmd_field(char *s, char *tag, uint16_t *val)
+{
+    tag[0] = 0;
+    tag[1] = 0;
+    *val = 0;
+    if (*s >= 'A' && *s <= 'Z') tag[0] = *s++;
+    if (*s >= 'A' && *s <= 'Z') tag[1] = *s++;
+    while (*s >= '0' && *s <= '9' && *val < 6553) *val = *val * 10 + (uint16_t) (*s++ - '0'); /// * The number must fit in 16 bits
+    if (*s == ',') return s + 1;
+    if (*s) tag[0] = 0; /// * Anything else after the number makes the field not valid
+    return NULL;
+}
+/**@brief This function prints the name of the chemistry @p c
+*/
+void chem_name(const struct chem *c)
+{
+    uint8_t k;
+    for (k = 0; k < sizeof(c->name) && c->name[k]; k++) UART_send_char(c->name[k]);
+}
+/**@brief This function prints the chemistry @p k of the EEPROM table in one line, for example
+* <tt> (2) Ni-MH: 1750 mV, 2000 mAh, EOC 10 mV -dV, EOD 1000 mV, timeout 110 % </tt>. The selected one is marked with @b *.
+*/
+void chem_print(uint8_t k)
+{
+    struct chem c;
+    ee_read(EE_CHEM + k * sizeof(struct chem), &c, sizeof(struct chem));
+    UART_send_char(k == chem_sel ? '*' : ' ');
+    UART_send_char('(');
+    UART_send_char('1' + k);
+    UART_send_string((char*)") ");
+    chem_name(&c);
+    UART_send_string((char*)": ");
+    display_value_u(c.cv);
+    UART_send_string((char*)mV_str);
+    UART_send_string((char*)", ");
+    display_value_u(c.cap);
+    UART_send_string((char*)mAh_str);
+    UART_send_string((char*)", EOC ");
+    display_value_u(c.eoc);
+    UART_send_string((char*)((c.flags & CHEM_DV) ? " mV -dV" : mA_str));
+    UART_send_string((char*)", EOD ");
+    display_value_u(c.eod);
+    UART_send_string((char*)mV_str);
+    UART_send_string((char*)", timeout ");
+    display_value_u(c.timeout);
+    UART_send_string((char*)" %");
+    LINEBREAK;
+}
+/**@brief This function is the menu of the chemistries, called from #param() with @b c. The table of the EEPROM is
+* printed with #chem_print(), a number selects a chemistry with #chem_select() and @b e edits the selected one
+* with #chem_edit(). @b ESC goes back. The selection is kept in the EEPROM, so changing the batch of cells on the
+* rack only needs <tt> c, number, ESC </tt>.
+*/
+void chem_menu()
+{
+    unsigned char input;
+    uint8_t k;
+    do
+    {
+        LINEBREAK;
+        for (k = 0; k < CHEMS; k++) chem_print(k);
+        UART_send_string((char*)chem_sel_str);
+        input = UART_get_char();
+        LINEBREAK;
+        if (input >= '1' && input < '1' + CHEMS) chem_select((uint8_t) (input - '1'));
+        else if (input == 'e') chem_edit();
+    }while (input != 0x1B);
+}
+/**@brief This function edits the selected chemistry. Every field is asked with #chem_field(), an empty answer
+* keeps the value. The result is written to the EEPROM with #chem_store() and loaded into #chem.
+*/
+void chem_edit()
+{
+    struct chem c = chem;
+    unsigned char input;
+    c.cv = chem_field(chem_cv_str, c.cv);
+    c.cap = chem_field(chem_cap_str, c.cap);
+    c.eoc = chem_field(chem_eoc_str, c.eoc);
+    c.eod = chem_field(chem_eod_str, c.eod);
+    c.timeout = (uint8_t) chem_field(chem_tout_str, c.timeout);
+    UART_send_string((char*)chem_dv_str);
+    input = UART_get_char();
+    if (input == 'y') c.flags |= CHEM_DV; /// * @b y or @b n sets or clears #CHEM_DV, any other key keeps it
+    else if (input == 'n') c.flags &= (uint8_t) ~CHEM_DV;
+    LINEBREAK;
+    if (!c.cv || !c.cap) return; /// * A chemistry without CV or capacity is not stored
+    chem_store(chem_sel, &c);
+    chem_select(chem_sel);
+}
+/**@brief This function asks one field of a chemistry, as <tt> prompt (enter keeps old): </tt>
+* @return the number typed, or @p old if no digit was typed
+*/
+uint16_t chem_field(const char *prompt, uint16_t old)
+{
+    uint16_t value = 0;
+    bool digits = 0;
+    char c;
+    UART_send_string((char*)prompt);
+    UART_send_string((char*)chem_keep_str);
+    display_value_u(old);
+    UART_send_string((char*)"): ");
+    while(1)
+    {
+        c = UART_get_char();
+        if (c >= '0' && c <= '9' && value < 6553) /// * The digits are echoed, as in #UART_get_number()
+        {
+            value = value * 10 + (uint16_t) (c - '0');
+            digits = 1;
+            UART_send_char(c);
+        }else if (c == 13 || c == 10 || c == 0x1B) break;
+    }
+    LINEBREAK;
+    return digits ? value : old;
+}